@@ -0,0 +1,570 @@
+//    libxclip -- If xclip / xsel was a C library
+//    Copyright (C) 2024  Emma Bastås <emma.bastas@protonmail.com>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+
+
+
+#include "libxclip.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+
+// Global variables that are setup in main an accessible to each benchmark
+Display *display;  // X connection.
+
+// Microseconds elapsed since `start`.
+double micros_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e6
+        + (now.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+void _100_get_latency() {
+    printf("\n\n=== Per-call latency of libxclip_get and libxclip_ctx_get ===\n");
+    const int n = 1000;
+
+    libxclip_put(display, "foo", 3, NULL);
+
+    // Before: every call sets up (and tears down) a connection, a window and
+    // the atoms.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i ++) {
+        char *data;
+        size_t size;
+        assert(libxclip_get(display, &data, &size, NULL) == 0);
+        free(data);
+    }
+    printf("libxclip_get:     %8.1f us/call\n", micros_since(start) / n);
+
+    // After: the setup is done once and reused.
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i ++) {
+        char *data;
+        size_t size;
+        assert(libxclip_ctx_get(ctx, &data, &size, NULL) == 0);
+        free(data);
+    }
+    printf("libxclip_ctx_get: %8.1f us/call\n", micros_since(start) / n);
+    libxclip_ctx_destroy(ctx);
+}
+
+void _200_targets_latency() {
+    printf("\n\n=== Per-call latency of libxclip_targets and libxclip_ctx_targets ===\n");
+    const int n = 1000;
+
+    libxclip_put(display, "foo", 3, NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i ++) {
+        Atom *targets;
+        unsigned long nitems;
+        assert(libxclip_targets(display, &targets, &nitems, NULL) == 0);
+        free(targets);
+    }
+    printf("libxclip_targets:     %8.1f us/call\n", micros_since(start) / n);
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i ++) {
+        Atom *targets;
+        unsigned long nitems;
+        assert(libxclip_ctx_targets(ctx, &targets, &nitems, NULL) == 0);
+        free(targets);
+    }
+    printf("libxclip_ctx_targets: %8.1f us/call\n", micros_since(start) / n);
+    libxclip_ctx_destroy(ctx);
+}
+
+void _300_get_throughput() {
+    printf("\n\n=== Throughput of libxclip_ctx_get for successively larger data ===\n");
+    const unsigned long n = 30;
+    char *buffer = malloc(1UL << n);
+    memset(buffer, '#', 1UL << n);
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    printf("buffer size (#bytes): throughput\n");
+    for (int i = 11; i <= n; i ++) {
+        const unsigned long len = 1UL << i;
+        libxclip_put(display, buffer, len, NULL);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        char *data;
+        size_t size;
+        assert(libxclip_ctx_get(ctx, &data, &size, NULL) == 0);
+        double micros = micros_since(start);
+        assert(size == len);
+        free(data);
+
+        printf("%lu: %10.1f MiB/s (%.1f us)\n",
+               len, len / micros * 1e6 / (1 << 20), micros);
+    }
+    libxclip_ctx_destroy(ctx);
+    free(buffer);
+}
+
+void _400_put_latency() {
+    printf("\n\n=== Per-call latency of libxclip_put, fork vs thread mode ===\n");
+    const int n = 200;
+
+    libxclip_putopts fork_opts;
+    libxclip_putopts_initialize(&fork_opts);
+    libxclip_putopts thread_opts = fork_opts;
+    thread_opts.mode = LIBXCLIP_PUT_THREAD;
+
+    // fork has to copy the page tables, so its cost grows with how much
+    // memory the calling process has. Some ballast (touched, so that it's
+    // actually mapped) stands in for the heap of a big application.
+    const size_t ballast_sizes[3] = { 0, 256UL << 20, 1UL << 30 };
+    printf("ballast (#bytes): fork, thread\n");
+    for (int i = 0; i < 3; i ++) {
+        char *ballast = malloc(ballast_sizes[i]);
+        memset(ballast, '#', ballast_sizes[i]);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < n; j ++) {
+            assert(libxclip_put(display, "foo", 3, &fork_opts) == 0);
+        }
+        double fork_micros = micros_since(start) / n;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < n; j ++) {
+            assert(libxclip_put(display, "foo", 3, &thread_opts) == 0);
+        }
+        double thread_micros = micros_since(start) / n;
+
+        printf("%zu: %8.1f us/call, %8.1f us/call\n",
+               ballast_sizes[i], fork_micros, thread_micros);
+        free(ballast);
+    }
+}
+
+void _500_put_latency_by_size() {
+    printf("\n\n=== Per-call latency of libxclip_put by size and mode ===\n");
+    const int n = 100;
+    const char *names[3] = { "fork", "thread", "daemon" };
+    const int modes[3] = {
+        LIBXCLIP_PUT_FORK, LIBXCLIP_PUT_THREAD, LIBXCLIP_PUT_DAEMON
+    };
+
+    const size_t sizes[4] = { 3, 1UL << 16, 1UL << 20, 1UL << 26 };
+    char *data = malloc(sizes[3]);
+    memset(data, '#', sizes[3]);
+
+    printf("size (#bytes): fork, thread, daemon\n");
+    for (int i = 0; i < 4; i ++) {
+        printf("%zu:", sizes[i]);
+        for (int m = 0; m < 3; m ++) {
+            libxclip_putopts options;
+            libxclip_putopts_initialize(&options);
+            options.mode = modes[m];
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int j = 0; j < n; j ++) {
+                assert(libxclip_put(display, data, sizes[i], &options) == 0);
+            }
+            printf(" %10.1f us/call (%s)", micros_since(start) / n, names[m]);
+        }
+        printf("\n");
+    }
+    free(data);
+}
+
+void _600_negotiation_latency() {
+    printf("\n\n=== Latency of picking a target: libxclip_targets + libxclip_get vs preferred ===\n");
+    const int n = 1000;
+
+    Atom a_html = XInternAtom(display, "text/html", False);
+    Atom a_jpeg = XInternAtom(display, "image/jpeg", False);
+    struct libxclip_target targets[1] = { { a_html, "<i>it</i>", 9 } };
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.targets = targets;
+    putopts.ntargets = 1;
+    libxclip_put(display, "it", 2, &putopts);
+
+    // Before: ask for the targets, then for the best one.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i ++) {
+        Atom *available;
+        unsigned long nitems;
+        assert(libxclip_targets(display, &available, &nitems, NULL) == 0);
+        free(available);
+
+        struct libxclip_getopts getopts;
+        libxclip_getopts_initialize(&getopts);
+        getopts.target = a_html;
+        char *data;
+        size_t size;
+        assert(libxclip_get(display, &data, &size, &getopts) == 0);
+        free(data);
+    }
+    printf("targets + get:              %8.1f us/call\n",
+           micros_since(start) / n);
+
+    // After: one call, when the first preference is there and when it isn't.
+    Atom hit[2] = { a_html, a_jpeg };
+    Atom miss[2] = { a_jpeg, a_html };
+    Atom *preferred[2] = { hit, miss };
+    const char *names[2] = { "hit", "miss" };
+    for (int p = 0; p < 2; p ++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i ++) {
+            struct libxclip_getopts getopts;
+            libxclip_getopts_initialize(&getopts);
+            getopts.preferred = preferred[p];
+            getopts.npreferred = 2;
+            char *data;
+            size_t size;
+            assert(libxclip_get(display, &data, &size, &getopts) == 0);
+            free(data);
+        }
+        printf("preferred (first one %4s): %8.1f us/call\n",
+               names[p], micros_since(start) / n);
+    }
+}
+
+void _700_incr_throughput() {
+    // bench.sh runs this once against each of the backends.
+    #ifdef LIBXCLIP_XCB
+    const char *backend = "xcb";
+    #else
+    const char *backend = "xlib";
+    #endif
+    printf("\n\n=== INCR throughput of libxclip_ctx_get (%s) ===\n", backend);
+    const unsigned long sizes[] = { 1UL << 20, 1UL << 24, 1UL << 28 };
+    const int reps[] = { 20, 5, 2 };
+    char *buffer = malloc(sizes[2]);
+    memset(buffer, '#', sizes[2]);
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    printf("buffer size (#bytes): best / mean throughput\n");
+    for (int s = 0; s < 3; s ++) {
+        libxclip_put(display, buffer, sizes[s], NULL);
+
+        double best = 0;
+        double total = 0;
+        for (int i = 0; i < reps[s]; i ++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            char *data;
+            size_t size;
+            assert(libxclip_ctx_get(ctx, &data, &size, NULL) == 0);
+            double micros = micros_since(start);
+            assert(size == sizes[s]);
+            free(data);
+
+            double mibs = sizes[s] / micros * 1e6 / (1 << 20);
+            best = mibs > best ? mibs : best;
+            total += micros;
+        }
+
+        printf("%lu: %10.1f / %10.1f MiB/s\n", sizes[s], best,
+               sizes[s] * reps[s] / total * 1e6 / (1 << 20));
+    }
+    libxclip_ctx_destroy(ctx);
+    free(buffer);
+}
+
+// One reader of _800_concurrent_incr_throughput.
+void *incr_reader(void *arg) {
+    char *data;
+    size_t size;
+    assert(libxclip_get(display, &data, &size, NULL) == 0);
+    assert(size == *(size_t *) arg);
+    free(data);
+    return NULL;
+}
+
+void _800_concurrent_incr_throughput() {
+    printf("\n\n=== Aggregate throughput of concurrent INCR transfers ===\n");
+    const size_t size = 1 << 25;
+    char *buffer = malloc(size);
+    memset(buffer, '#', size);
+    libxclip_put(display, buffer, size, NULL);
+
+    printf("#readers: aggregate throughput\n");
+    for (int n = 1; n <= 16; n *= 2) {
+        pthread_t threads[16];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i ++) {
+            pthread_create(&threads[i], NULL, incr_reader, (void *) &size);
+        }
+        for (int i = 0; i < n; i ++) {
+            pthread_join(threads[i], NULL);
+        }
+        double micros = micros_since(start);
+        printf("%2d: %10.1f MiB/s\n", n,
+               (double) size * n / micros * 1e6 / (1 << 20));
+    }
+    free(buffer);
+}
+
+void _900_chunk_policy_sweep() {
+    printf("\n\n=== Throughput of libxclip_ctx_get for each chunk policy ===\n");
+    const char *names[6] = {
+        "fixed 64KiB", "fixed 256KiB", "fixed 1MiB", "default",
+        "server max", "adaptive"
+    };
+    const int policies[6] = {
+        LIBXCLIP_CHUNK_FIXED, LIBXCLIP_CHUNK_FIXED, LIBXCLIP_CHUNK_FIXED,
+        LIBXCLIP_CHUNK_FIXED, LIBXCLIP_CHUNK_SERVER_MAX,
+        LIBXCLIP_CHUNK_ADAPTIVE
+    };
+    const size_t chunk_sizes[6] = { 1 << 16, 1 << 18, 1 << 20, 0, 0, 0 };
+    const int n = 28;
+    char *buffer = malloc(1UL << n);
+    memset(buffer, '#', 1UL << n);
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    for (int p = 0; p < 6; p ++) {
+        printf("%s, buffer size (#bytes): throughput\n", names[p]);
+        for (int i = 16; i <= n; i += 2) {
+            const unsigned long len = 1UL << i;
+            libxclip_putopts putopts;
+            libxclip_putopts_initialize(&putopts);
+            putopts.chunk_policy = policies[p];
+            putopts.chunk_size = chunk_sizes[p];
+            libxclip_put(display, buffer, len, &putopts);
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            char *data;
+            size_t size;
+            assert(libxclip_ctx_get(ctx, &data, &size, NULL) == 0);
+            double micros = micros_since(start);
+            assert(size == len);
+            free(data);
+
+            printf("%lu: %10.1f MiB/s\n", len,
+                   len / micros * 1e6 / (1 << 20));
+        }
+    }
+    libxclip_ctx_destroy(ctx);
+    free(buffer);
+}
+
+// The resident set size of this process, in bytes.
+size_t rss_bytes() {
+    size_t pages = 0;
+    size_t resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+// One reader of _1000_json_suite.
+void *suite_reader(void *arg) {
+    char *data;
+    size_t size;
+    assert(libxclip_get(display, &data, &size, NULL) == 0);
+    assert(size == *(size_t *) arg);
+    free(data);
+    return NULL;
+}
+
+// Everything the other benchmarks measure, as a single JSON document on
+// stdout, so that runs can be compared by a script. bench.sh runs this against
+// an Xvfb of its own and keeps the output in bench.json.
+void _1000_json_suite() {
+    #ifdef LIBXCLIP_XCB
+    const char *backend = "xcb";
+    #else
+    const char *backend = "xlib";
+    #endif
+    printf("{\n  \"backend\": \"%s\",\n", backend);
+
+    // Put latency, at a few sizes of the process calling put. fork copies
+    // the page tables so its cost grows with them, see _400_put_latency.
+    printf("  \"put_latency\": [");
+    const char *mode_names[3] = { "fork", "thread", "daemon" };
+    const int modes[3] = {
+        LIBXCLIP_PUT_FORK, LIBXCLIP_PUT_THREAD, LIBXCLIP_PUT_DAEMON
+    };
+    const size_t ballast_sizes[4] = {
+        0, 64UL << 20, 256UL << 20, 1UL << 30
+    };
+    const char *sep = "";
+    for (int b = 0; b < 4; b ++) {
+        char *ballast = malloc(ballast_sizes[b]);
+        memset(ballast, '#', ballast_sizes[b]);
+        const size_t rss = rss_bytes();
+        for (int m = 0; m < 3; m ++) {
+            const int n = 100;
+            libxclip_putopts putopts;
+            libxclip_putopts_initialize(&putopts);
+            putopts.mode = modes[m];
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < n; i ++) {
+                assert(libxclip_put(display, "foo", 3, &putopts) == 0);
+            }
+            printf("%s\n    {\"rss_bytes\": %zu, \"mode\": \"%s\", "
+                   "\"us\": %.1f}",
+                   sep, rss, mode_names[m], micros_since(start) / n);
+            sep = ",";
+        }
+        free(ballast);
+    }
+    printf("\n  ],\n");
+
+    // Get throughput from 2 KiB to 1 GiB. In one go for as long as that fits
+    // in one request, and with INCR (in at least four chunks) throughout.
+    printf("  \"get_throughput\": [");
+    const int largest = 30;
+    char *buffer = malloc(1UL << largest);
+    memset(buffer, '#', 1UL << largest);
+    long max_request = XExtendedMaxRequestSize(display);
+    if (max_request == 0) {
+        max_request = XMaxRequestSize(display);
+    }
+    const size_t single_shot_max = (size_t) max_request * 4 - 28;
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    sep = "";
+    for (int i = 11; i <= largest; i ++) {
+        const size_t len = 1UL << i;
+        for (int incr = 0; incr < 2; incr ++) {
+            libxclip_putopts putopts;
+            libxclip_putopts_initialize(&putopts);
+            if (incr) {
+                putopts.chunk_size = len / 4 < (1 << 18) ? len / 4 : 1 << 18;
+            } else if (len <= single_shot_max) {
+                putopts.chunk_policy = LIBXCLIP_CHUNK_SERVER_MAX;
+            } else {
+                continue;
+            }
+            assert(libxclip_put(display, buffer, len, &putopts) == 0);
+
+            const int reps = i < 20 ? 20 : i < 26 ? 5 : 2;
+            double best = 0;
+            for (int r = 0; r < reps; r ++) {
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                char *data;
+                size_t size;
+                assert(libxclip_ctx_get(ctx, &data, &size, NULL) == 0);
+                double micros = micros_since(start);
+                assert(size == len);
+                free(data);
+                best = best == 0 || micros < best ? micros : best;
+            }
+            printf("%s\n    {\"bytes\": %zu, \"mode\": \"%s\", "
+                   "\"us\": %.1f, \"mib_per_s\": %.1f}",
+                   sep, len, incr ? "incr" : "single_shot", best,
+                   len / best * 1e6 / (1 << 20));
+            sep = ",";
+        }
+    }
+    printf("\n  ],\n");
+
+    // Targets latency.
+    {
+        const int n = 1000;
+        libxclip_put(display, "foo", 3, NULL);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i ++) {
+            Atom *targets;
+            unsigned long nitems;
+            assert(libxclip_ctx_targets(ctx, &targets, &nitems, NULL) == 0);
+            free(targets);
+        }
+        printf("  \"targets_latency_us\": %.1f,\n", micros_since(start) / n);
+    }
+    libxclip_ctx_destroy(ctx);
+
+    // Aggregate throughput of concurrent readers, each with a connection of
+    // its own (bench.sh raises the X server's client limit for this).
+    printf("  \"concurrent_readers\": [");
+    size_t size = 1 << 22;
+    libxclip_put(display, buffer, size, NULL);
+    sep = "";
+    for (int n = 1; n <= 256; n *= 2) {
+        pthread_t threads[256];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i ++) {
+            pthread_create(&threads[i], NULL, suite_reader, (void *) &size);
+        }
+        for (int i = 0; i < n; i ++) {
+            pthread_join(threads[i], NULL);
+        }
+        double micros = micros_since(start);
+        printf("%s\n    {\"readers\": %d, \"bytes_each\": %zu, "
+               "\"mib_per_s\": %.1f}",
+               sep, n, size, (double) size * n / micros * 1e6 / (1 << 20));
+        sep = ",";
+    }
+    printf("\n  ]\n}\n");
+    free(buffer);
+}
+
+int main(void) {
+    XInitThreads();
+    display = XOpenDisplay(NULL);
+
+    char buffer[100];
+    memset(buffer, 0, 100);
+    read(STDIN_FILENO, buffer, 100);
+
+    if(strcmp(buffer, "100\n") == 0) {
+        _100_get_latency();
+    }
+    if(strcmp(buffer, "200\n") == 0) {
+        _200_targets_latency();
+    }
+    if(strcmp(buffer, "300\n") == 0) {
+        _300_get_throughput();
+    }
+    if(strcmp(buffer, "400\n") == 0) {
+        _400_put_latency();
+    }
+    if(strcmp(buffer, "500\n") == 0) {
+        _500_put_latency_by_size();
+    }
+    if(strcmp(buffer, "600\n") == 0) {
+        _600_negotiation_latency();
+    }
+    if(strcmp(buffer, "700\n") == 0) {
+        _700_incr_throughput();
+    }
+    if(strcmp(buffer, "800\n") == 0) {
+        _800_concurrent_incr_throughput();
+    }
+    if(strcmp(buffer, "900\n") == 0) {
+        _900_chunk_policy_sweep();
+    }
+    if(strcmp(buffer, "1000\n") == 0) {
+        _1000_json_suite();
+    }
+
+    return 0;
+}
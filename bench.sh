@@ -0,0 +1,48 @@
+#!/usr/bin/env sh
+
+#    libxclip -- If xclip / xsel was a C library
+#    Copyright (C) 2024  Emma Bastås <emma.bastas@protonmail.com>
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+
+
+
+# Everything runs against an X server of its own, so that nothing else on the
+# display gets in the way (or in the clipboard), with room for the concurrent
+# readers' connections. Xvfb picks a free display number and tells us.
+Xvfb -displayfd 3 -nolisten tcp -maxclients 512 3>.bench_display &
+XVFB_PID=$!
+trap 'kill $XVFB_PID; rm -f .bench_display' EXIT
+while [ ! -s .bench_display ]; do
+    sleep 0.1
+done
+export DISPLAY=":$(cat .bench_display)"
+
+gcc -O2 -Wall -Wno-unused-result -lX11 -pthread libxclip.c bench.c -o bench
+gcc -O2 -Wall -Wno-unused-result -DLIBXCLIP_XCB -lX11 -lxcb -pthread \
+    libxclip.c bench.c -o bench_xcb
+
+echo "100" | ./bench
+echo "200" | ./bench
+echo "300" | ./bench
+echo "400" | ./bench
+echo "500" | ./bench
+echo "600" | ./bench
+echo "800" | ./bench
+echo "900" | ./bench
+
+# The same transfers through each of the backends.
+echo "700" | ./bench
+echo "700" | ./bench_xcb
+
+# The lot again as JSON, to keep around and compare runs with.
+echo "1000" | ./bench > bench.json
+echo "1000" | ./bench_xcb > bench_xcb.json
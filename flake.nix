@@ -29,6 +29,10 @@
               pkg-config
               cpplint
               xorg.libX11
+              xorg.libxcb
+              xorg.libXfixes
+              zlib
+              xorg.xorgserver
               xclip
             ];
           };
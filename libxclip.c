@@ -13,15 +13,36 @@
 
 
 
+#define _GNU_SOURCE     // for memfd_create
+
 #include "./libxclip.h"
 
 #include <stdlib.h>
+#include <stdint.h>     // for intptr_t
 #include <assert.h>     // for assert
 #include <unistd.h>     // for fork, read, write and pipe
+#include <errno.h>
+#include <fcntl.h>      // for open
+#include <sys/mman.h>   // for mmap
+#include <sys/stat.h>   // for fstat
+#include <pthread.h>    // for the stream's producer thread
+#include <sys/socket.h> // for the daemon's control socket
 #include <stdio_ext.h>  // for __fpurge
+#include <poll.h>       // for poll
+#include <sched.h>      // for sched_yield
 #include <time.h>
 #include <string.h>
 #include <X11/Xlib.h>
+#ifdef LIBXCLIP_XCB
+#include <xcb/xcb.h>
+#endif
+#ifdef LIBXCLIP_ZLIB
+#include <zlib.h>
+#endif
+#ifdef LIBXCLIP_XFIXES
+#include <X11/Xatom.h>  // for XA_PRIMARY
+#include <X11/extensions/Xfixes.h>
+#endif
 
 // #define DEBUG
 
@@ -30,9 +51,513 @@
 #include <stdio.h>
 #endif
 
-struct libxclip_putopts {
-    char phantom;  // Just here to remove -pedantic warning
-};
+
+
+/*
+ * The connection to X
+ *
+ * Every connection libxclip makes to X of its own (the owner's, and a
+ * requestor context's) goes through the handful of functions below. By default
+ * they're thin wrappers around Xlib. Built with -DLIBXCLIP_XCB (and linked
+ * with -lxcb) they talk XCB instead, where every request is sent without
+ * waiting for the previous one's reply and property data is handed to us
+ * straight from the reply buffer instead of being copied into a buffer of
+ * Xlib's. Either way the rest of the library deals in Atoms, Windows and
+ * XEvents, and the `Display *` the caller gives us is only used to learn which
+ * display to connect to.
+ *
+ * The wrappers are named after, and mostly take the same arguments as, the
+ * Xlib function they stand in for. Data returned by xconn_get_property must be
+ * freed with xconn_free.
+ *
+ * Built with -DLIBXCLIP_COUNT_ROUNDTRIPS every wrapper that waits for a reply
+ * counts that, per thread, and libxclip_roundtrips tells the test suite how
+ * many round trips the calling thread has made so far.
+ */
+
+#ifdef LIBXCLIP_COUNT_ROUNDTRIPS
+static __thread unsigned long roundtrips = 0;
+
+unsigned long libxclip_roundtrips(void) {
+    return roundtrips;
+}
+
+#define ROUNDTRIP() (roundtrips++)
+#else
+#define ROUNDTRIP() ((void) 0)
+#endif
+
+#ifdef LIBXCLIP_XCB
+
+typedef struct xconn {
+    xcb_connection_t *c;
+    xcb_window_t root;
+    // An event xconn_pending has read, but which xconn_next_event is yet to
+    // return.
+    xcb_generic_event_t *next;
+} xconn;
+
+static xconn *xconn_open(Display *parent_display) {
+    xconn *conn = calloc(1, sizeof(xconn));
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    int screen;
+    conn->c = xcb_connect(XDisplayString(parent_display), &screen);
+    if (xcb_connection_has_error(conn->c)) {
+        xcb_disconnect(conn->c);
+        free(conn);
+        return NULL;
+    }
+
+    xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(conn->c));
+    for (; screen > 0 && it.rem > 1; screen--) {
+        xcb_screen_next(&it);
+    }
+    conn->root = it.data->root;
+    return conn;
+}
+
+static void xconn_close(xconn *conn) {
+    free(conn->next);
+    xcb_disconnect(conn->c);
+    free(conn);
+}
+
+static int xconn_fd(xconn *conn) {
+    return xcb_get_file_descriptor(conn->c);
+}
+
+// Sends all of the InternAtom requests before waiting for the first reply.
+static void xconn_intern_atoms(xconn *conn,
+                               char **names,
+                               int count,
+                               Atom *atoms_ret) {
+    ROUNDTRIP();
+    xcb_intern_atom_cookie_t cookies[count];
+    for (int i = 0; i < count; i++) {
+        cookies[i] = xcb_intern_atom(conn->c, 0, strlen(names[i]), names[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        xcb_intern_atom_reply_t *reply =
+            xcb_intern_atom_reply(conn->c, cookies[i], NULL);
+        atoms_ret[i] = reply != NULL ? reply->atom : None;
+        free(reply);
+    }
+}
+
+static Window xconn_create_window(xconn *conn) {
+    xcb_window_t window = xcb_generate_id(conn->c);
+    xcb_create_window(conn->c, XCB_COPY_FROM_PARENT, window, conn->root,
+                      0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      XCB_COPY_FROM_PARENT, 0, NULL);
+    return window;
+}
+
+static void xconn_destroy_window(xconn *conn, Window window) {
+    xcb_destroy_window(conn->c, window);
+}
+
+static void xconn_select_input(xconn *conn, Window window, long event_mask) {
+    uint32_t mask = event_mask;
+    xcb_change_window_attributes(conn->c, window, XCB_CW_EVENT_MASK, &mask);
+}
+
+// The events we've selected on `window`, 0 if it doesn't exist.
+static long xconn_event_mask(xconn *conn, Window window) {
+    ROUNDTRIP();
+    xcb_get_window_attributes_reply_t *reply = xcb_get_window_attributes_reply(
+        conn->c, xcb_get_window_attributes(conn->c, window), NULL);
+    long mask = reply != NULL ? (long) reply->your_event_mask : 0;
+    free(reply);
+    return mask;
+}
+
+static void xconn_set_selection_owner(xconn *conn,
+                                      Atom selection,
+                                      Window owner) {
+    xcb_set_selection_owner(conn->c, owner, selection, XCB_CURRENT_TIME);
+}
+
+static Window xconn_get_selection_owner(xconn *conn, Atom selection) {
+    ROUNDTRIP();
+    xcb_get_selection_owner_reply_t *reply = xcb_get_selection_owner_reply(
+        conn->c, xcb_get_selection_owner(conn->c, selection), NULL);
+    Window owner = reply != NULL ? reply->owner : None;
+    free(reply);
+    return owner;
+}
+
+// In 4 byte units, like XMaxRequestSize. Includes BIG-REQUESTS if the server
+// supports it.
+static long xconn_max_request_size(xconn *conn) {
+    return xcb_get_maximum_request_length(conn->c);
+}
+
+static void xconn_change_property(xconn *conn,
+                                  Window window,
+                                  Atom property,
+                                  Atom type,
+                                  int format,
+                                  const unsigned char *data,
+                                  int nelements) {
+    // Like Xlib we take format 32 data as an array of longs, but on the wire
+    // they're 32 bits each.
+    uint32_t *narrow = NULL;
+    if (format == 32 && sizeof(long) != sizeof(uint32_t)) {
+        narrow = malloc(nelements * sizeof(uint32_t) + 1);
+        if (narrow == NULL) {
+            return;
+        }
+        for (int i = 0; i < nelements; i++) {
+            narrow[i] = ((const long *) data)[i];
+        }
+        data = (const unsigned char *) narrow;
+    }
+
+    xcb_change_property(conn->c, XCB_PROP_MODE_REPLACE, window, property,
+                        type, format, nelements, data);
+    free(narrow);
+}
+
+static void xconn_delete_property(xconn *conn, Window window, Atom property) {
+    xcb_delete_property(conn->c, window, property);
+}
+
+// Returns Success, or something else if there was no reply. `*data_ret` points
+// into the reply itself, which is why it must be freed with xconn_free.
+static int xconn_get_property(xconn *conn,
+                              Window window,
+                              Atom property,
+                              long offset,
+                              long length,
+                              Bool delete,
+                              Atom req_type,
+                              Atom *type_ret,
+                              int *format_ret,
+                              unsigned long *nitems_ret,
+                              unsigned long *bytes_after_ret,
+                              unsigned char **data_ret) {
+    ROUNDTRIP();
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(
+        conn->c,
+        xcb_get_property(conn->c, delete, window, property, req_type,
+                         offset, length),
+        NULL);
+
+    *type_ret = None;
+    *format_ret = 0;
+    *nitems_ret = 0;
+    *bytes_after_ret = 0;
+    *data_ret = NULL;
+    if (reply == NULL) {
+        return BadImplementation;
+    }
+
+    *type_ret = reply->type;
+    *format_ret = reply->format;
+    *bytes_after_ret = reply->bytes_after;
+    if (reply->type == None) {
+        free(reply);
+        return Success;
+    }
+
+    // Xlib hands out format 32 data as longs, so we do too. We widen them in
+    // place, from the back so that we never overwrite one we have yet to read.
+    unsigned long n = reply->value_len;
+    if (reply->format == 32 && sizeof(long) != sizeof(uint32_t)) {
+        xcb_get_property_reply_t *wide =
+            realloc(reply, sizeof(*reply) + n * sizeof(long));
+        if (wide == NULL) {
+            free(reply);
+            *type_ret = None;
+            *format_ret = 0;
+            return BadAlloc;
+        }
+        reply = wide;
+        uint32_t *narrow = xcb_get_property_value(reply);
+        long *longs = xcb_get_property_value(reply);
+        for (unsigned long i = n; i-- > 0;) {
+            long value = narrow[i];
+            longs[i] = value;
+        }
+    }
+
+    *nitems_ret = n;
+    *data_ret = xcb_get_property_value(reply);
+    return Success;
+}
+
+// The data of a property reply sits right after the reply.
+static void xconn_free(void *data) {
+    if (data != NULL) {
+        free((xcb_get_property_reply_t *) data - 1);
+    }
+}
+
+static void xconn_send_selection_notify(xconn *conn,
+                                        Window requestor,
+                                        Atom selection,
+                                        Atom target,
+                                        Atom property,
+                                        Time time) {
+    xcb_selection_notify_event_t notify;
+    memset(&notify, 0, sizeof(notify));
+    notify.response_type = XCB_SELECTION_NOTIFY;
+    notify.time = time;
+    notify.requestor = requestor;
+    notify.selection = selection;
+    notify.target = target;
+    notify.property = property;
+    xcb_send_event(conn->c, True, requestor, 0, (const char *) &notify);
+}
+
+static void xconn_convert_selection(xconn *conn,
+                                    Atom selection,
+                                    Atom target,
+                                    Atom property,
+                                    Window requestor) {
+    xcb_convert_selection(conn->c, requestor, selection, target, property,
+                          XCB_CURRENT_TIME);
+}
+
+static void xconn_flush(xconn *conn) {
+    xcb_flush(conn->c);
+}
+
+// Waits for the server to have processed everything we've sent.
+static void xconn_sync(xconn *conn) {
+    ROUNDTRIP();
+    free(xcb_get_input_focus_reply(conn->c, xcb_get_input_focus(conn->c),
+                                   NULL));
+}
+
+// Like XEventsQueued with QueuedAfterReading, reads whatever the server has
+// sent without flushing our requests. Returns whether there's an event for
+// xconn_next_event.
+static int xconn_queued(xconn *conn) {
+    if (conn->next == NULL) {
+        conn->next = xcb_poll_for_event(conn->c);
+    }
+    return conn->next != NULL;
+}
+
+// Like XPending, flushes our requests first.
+static int xconn_pending(xconn *conn) {
+    if (conn->next == NULL) {
+        xcb_flush(conn->c);
+    }
+    return xconn_queued(conn);
+}
+
+// The rest of the library only looks at the events below, anything else
+// (errors included) is passed on with its type and nothing more.
+static void xconn_next_event(xconn *conn, XEvent *event_ret) {
+    xcb_generic_event_t *event = conn->next;
+    conn->next = NULL;
+    if (event == NULL) {
+        event = xcb_poll_for_queued_event(conn->c);
+    }
+    if (event == NULL) {
+        // Like XNextEvent, flush before we block.
+        xcb_flush(conn->c);
+        event = xcb_wait_for_event(conn->c);
+    }
+    if (event == NULL) {
+        // The connection is gone, like Xlib's default IO error handler there
+        // isn't much else to do.
+        exit(EXIT_FAILURE);
+    }
+
+    memset(event_ret, 0, sizeof(XEvent));
+    event_ret->type = event->response_type & ~0x80;
+    event_ret->xany.send_event = (event->response_type & 0x80) != 0;
+
+    if (event_ret->type == SelectionRequest) {
+        xcb_selection_request_event_t *e = (void *) event;
+        event_ret->xselectionrequest.owner = e->owner;
+        event_ret->xselectionrequest.requestor = e->requestor;
+        event_ret->xselectionrequest.selection = e->selection;
+        event_ret->xselectionrequest.target = e->target;
+        event_ret->xselectionrequest.property = e->property;
+        event_ret->xselectionrequest.time = e->time;
+    } else if (event_ret->type == SelectionNotify) {
+        xcb_selection_notify_event_t *e = (void *) event;
+        event_ret->xselection.requestor = e->requestor;
+        event_ret->xselection.selection = e->selection;
+        event_ret->xselection.target = e->target;
+        event_ret->xselection.property = e->property;
+        event_ret->xselection.time = e->time;
+    } else if (event_ret->type == SelectionClear) {
+        xcb_selection_clear_event_t *e = (void *) event;
+        event_ret->xselectionclear.window = e->owner;
+        event_ret->xselectionclear.selection = e->selection;
+        event_ret->xselectionclear.time = e->time;
+    } else if (event_ret->type == PropertyNotify) {
+        xcb_property_notify_event_t *e = (void *) event;
+        event_ret->xproperty.window = e->window;
+        event_ret->xproperty.atom = e->atom;
+        event_ret->xproperty.time = e->time;
+        event_ret->xproperty.state = e->state;
+    }
+
+    free(event);
+}
+
+#else
+
+typedef Display xconn;
+
+static xconn *xconn_open(Display *parent_display) {
+    return XOpenDisplay(XDisplayString(parent_display));
+}
+
+static void xconn_close(xconn *conn) {
+    XCloseDisplay(conn);
+}
+
+static int xconn_fd(xconn *conn) {
+    return ConnectionNumber(conn);
+}
+
+// One round trip for all of the atoms, instead of one each.
+static void xconn_intern_atoms(xconn *conn,
+                               char **names,
+                               int count,
+                               Atom *atoms_ret) {
+    ROUNDTRIP();
+    XInternAtoms(conn, names, count, False, atoms_ret);
+}
+
+static Window xconn_create_window(xconn *conn) {
+    return XCreateSimpleWindow(conn, DefaultRootWindow(conn),
+                               0, 0, 1, 1, 0, 0, 0);
+}
+
+static void xconn_destroy_window(xconn *conn, Window window) {
+    XDestroyWindow(conn, window);
+}
+
+static void xconn_select_input(xconn *conn, Window window, long event_mask) {
+    XSelectInput(conn, window, event_mask);
+}
+
+// The events we've selected on `window`, 0 if it doesn't exist.
+static long xconn_event_mask(xconn *conn, Window window) {
+    ROUNDTRIP();
+    XWindowAttributes attributes;
+    if (XGetWindowAttributes(conn, window, &attributes) == 0) {
+        return 0;
+    }
+    return attributes.your_event_mask;
+}
+
+static void xconn_set_selection_owner(xconn *conn,
+                                      Atom selection,
+                                      Window owner) {
+    XSetSelectionOwner(conn, selection, owner, CurrentTime);
+}
+
+static Window xconn_get_selection_owner(xconn *conn, Atom selection) {
+    ROUNDTRIP();
+    return XGetSelectionOwner(conn, selection);
+}
+
+// In 4 byte units. The extended-length encoding's maximum if the server
+// supports it, 0 if we couldn't find out.
+static long xconn_max_request_size(xconn *conn) {
+    long size = XExtendedMaxRequestSize(conn);
+    return size != 0 ? size : XMaxRequestSize(conn);
+}
+
+static void xconn_change_property(xconn *conn,
+                                  Window window,
+                                  Atom property,
+                                  Atom type,
+                                  int format,
+                                  const unsigned char *data,
+                                  int nelements) {
+    XChangeProperty(conn, window, property, type, format, PropModeReplace,
+                    data, nelements);
+}
+
+static void xconn_delete_property(xconn *conn, Window window, Atom property) {
+    XDeleteProperty(conn, window, property);
+}
+
+static int xconn_get_property(xconn *conn,
+                              Window window,
+                              Atom property,
+                              long offset,
+                              long length,
+                              Bool delete,
+                              Atom req_type,
+                              Atom *type_ret,
+                              int *format_ret,
+                              unsigned long *nitems_ret,
+                              unsigned long *bytes_after_ret,
+                              unsigned char **data_ret) {
+    ROUNDTRIP();
+    return XGetWindowProperty(conn, window, property, offset, length, delete,
+                              req_type, type_ret, format_ret, nitems_ret,
+                              bytes_after_ret, data_ret);
+}
+
+static void xconn_free(void *data) {
+    if (data != NULL) {
+        XFree(data);
+    }
+}
+
+static void xconn_send_selection_notify(xconn *conn,
+                                        Window requestor,
+                                        Atom selection,
+                                        Atom target,
+                                        Atom property,
+                                        Time time) {
+    XEvent notify;
+    notify.xselection.type      = SelectionNotify;
+    notify.xselection.display   = conn;
+    notify.xselection.requestor = requestor;
+    notify.xselection.selection = selection;
+    notify.xselection.target    = target;
+    notify.xselection.property  = property;
+    notify.xselection.time      = time;
+    XSendEvent(conn, requestor, True, 0, &notify);
+}
+
+static void xconn_convert_selection(xconn *conn,
+                                    Atom selection,
+                                    Atom target,
+                                    Atom property,
+                                    Window requestor) {
+    XConvertSelection(conn, selection, target, property, requestor,
+                      CurrentTime);
+}
+
+static void xconn_flush(xconn *conn) {
+    XFlush(conn);
+}
+
+static void xconn_sync(xconn *conn) {
+    ROUNDTRIP();
+    XSync(conn, False);
+}
+
+static int xconn_queued(xconn *conn) {
+    return XEventsQueued(conn, QueuedAfterReading) > 0;
+}
+
+static int xconn_pending(xconn *conn) {
+    return XPending(conn) > 0;
+}
+
+static void xconn_next_event(xconn *conn, XEvent *event_ret) {
+    XNextEvent(conn, event_ret);
+}
+
+#endif
 
 
 
@@ -52,7 +577,8 @@ struct libxclip_putopts {
  * which is like XNextEvent except with a timeout. Of note though is that
  * XNextEvent_timeout asks for an "absolute" point in time ("You should time-
  * out if the clocks strikes X") unlike a JS like setTimeout ("You should time-
- * out if X time passes")
+ * out if X time passes"). This way a single deadline can be carried through
+ * all of the waiting a library function does, INCR transfers included.
  */
 
 // With a long as the datatype we can specify a point in time almost 600 hours
@@ -69,13 +595,31 @@ static void x_millisecs_from_now(long millisecs, struct timespec *ts_return) {
     // Break up millisecs into seconds + nanoseconds
     ts_return->tv_sec += millisecs / 1000;
     ts_return->tv_nsec += (millisecs % 1000) * 1000000;
+
+    // Keep tv_nsec within [0, 1 second)
+    if (ts_return->tv_nsec >= 1000000000) {
+        ts_return->tv_sec += 1;
+        ts_return->tv_nsec -= 1000000000;
+    }
+}
+
+// Turns the timeout in `options` into a deadline. Returns NULL if there is no
+// timeout, and `deadline_ret` otherwise.
+static struct timespec *deadline_from_options(struct libxclip_getopts *options,
+                                              struct timespec *deadline_ret) {
+    if (options == NULL || options->timeout < 0) {
+        return NULL;
+    }
+
+    x_millisecs_from_now(options->timeout, deadline_ret);
+    return deadline_ret;
 }
 
 // Expects the `timeout` variable to have been generated by
 // `x_millisecs_from_now`
 //
 // Returns -1 if it timed out, 0 otherwise.
-static int XNextEvent_timeout(Display *display,
+static int XNextEvent_timeout(xconn *conn,
                        XEvent *event_ret,
                        struct timespec timeout) {
     // Are we compiling with POSIX real-time extensions? We need it for this
@@ -84,25 +628,35 @@ static int XNextEvent_timeout(Display *display,
     #error "Need POSIX real-time exension! (for instance -std=gnu99)"
     #endif
 
+    struct pollfd pfd;
+    pfd.fd = xconn_fd(conn);
+    pfd.events = POLLIN;
+
     struct timespec ts_current;
     while (True) {
-        // Is there an event in the queue now?
-        if (XPending(display) > 0) {
-            XNextEvent(display, event_ret);
+        // Is there an event in the queue now? XPending also flushes our output
+        // buffer and reads whatever the X server has sent us so far, so if it
+        // says there's nothing then there's nothing until the socket becomes
+        // readable again.
+        if (xconn_pending(conn)) {
+            xconn_next_event(conn, event_ret);
             return 0;
         }
 
         // No event in queue, should we timeout?
         clock_gettime(CLOCK_MONOTONIC, &ts_current);
-        if (ts_current.tv_sec > timeout.tv_sec) {
-            return -1;
-        } else if (ts_current.tv_sec == timeout.tv_sec
-            && ts_current.tv_nsec > timeout.tv_nsec) {
+        long long nanosecs_left =
+            (long long) (timeout.tv_sec - ts_current.tv_sec) * 1000000000
+            + (timeout.tv_nsec - ts_current.tv_nsec);
+        if (nanosecs_left <= 0) {
             return -1;
         }
 
-        // No we should not timeout, sleep for approx 1 microsecond.
-        usleep(1);
+        // No we should not timeout, sleep until the X server sends us
+        // something or the deadline passes, whichever comes first. We round
+        // up so that we don't wake up just before the deadline only to go
+        // back to sleep for 0 milliseconds.
+        poll(&pfd, 1, (int) ((nanosecs_left + 999999) / 1000000));
     }
 }
 
@@ -117,14 +671,11 @@ static int XNextEvent_timeout(Display *display,
  *
  * AS AN ASIDE, libxclip_get dynamically allocates one big buffer that can hold
  * the entire selections contents, this is not very efficent considering most
- * use-cases I imagine wouldn't need to hold on to any data. So some more
- * appropriate methods that I can think of instead would be to have the caller
- * supply a callback or a pipe where they can recive selection contents
- * incrementally. If there was a very simple builtin way of saying "take this
- * pipe and read all of it's content and give me one big buffer with the
- * contents" then I think I would have choosen pipes over dynamically allocated
- * buffer, because I imagine that's more efficent but still really convinient
- * for the caller to collect all of it in case they have a more niche use-case.
+ * use-cases I imagine wouldn't need to hold on to any data. Callers who don't
+ * need it all in one place can use libxclip_get_stream instead, which hands
+ * them the selection contents chunk by chunk through a callback as it arrives.
+ * libxclip_get is implemented on top of it with a callback that appends each
+ * chunk to a dynamic buffer.
  */
 
 // TODO: It would probably be wise to add error handling in case the buffer
@@ -139,12 +690,23 @@ struct DynamicBuffer {
     // remaining = capacity - size
 };
 
-// TODO: Have some more inteligent strategy than increasing the size by some
-//       fixed amount.
+// The smallest capacity we'll allocate.
 static const size_t DYNAMIC_BUFFER_BLOCK_SIZE = 4096 * 4;
 
-static void dynamic_buffer_new(struct DynamicBuffer *buffer_ret) {
-    char *ptr = calloc(DYNAMIC_BUFFER_BLOCK_SIZE, sizeof(char));
+// `size_hint` is how many bytes we expect to end up storing, or 0 if we have
+// no idea. In an INCR transfer the selection owner tells us a lower bound on
+// the size of the selection, and if we allocate that much up front we
+// (hopefully) never have to reallocate at all.
+static void dynamic_buffer_new(struct DynamicBuffer *buffer_ret,
+                               size_t size_hint) {
+    size_t capacity = DYNAMIC_BUFFER_BLOCK_SIZE;
+    if (size_hint > 0) {
+        capacity = size_hint;
+    }
+
+    // NB. not calloc, we're about to overwrite it anyway and there's no need
+    // to touch every page of a large buffer before we have to.
+    char *ptr = malloc(capacity);
     if (ptr == NULL) {
         // TODO: Do something with this.
         assert(False);
@@ -152,19 +714,29 @@ static void dynamic_buffer_new(struct DynamicBuffer *buffer_ret) {
 
     buffer_ret->ptr = ptr;
     buffer_ret->size = 0;
-    buffer_ret->capacity = DYNAMIC_BUFFER_BLOCK_SIZE;
+    buffer_ret->capacity = capacity;
 }
 
 // Append some data to our dynamic buffer, reallocating if we need more space
 static void dynamic_buffer_append(struct DynamicBuffer *buffer,
-                                  char *data,
+                                  const char *data,
                                   size_t len) {
     // Do we need to reallocate more space?
     if (buffer->size + len > buffer->capacity) {
-        // our new buffer will have enough space for the new data
-        // + DYNAMIC_BUFFER_BLOCK_SIZE.
-        const size_t NEW_CAPACITY =
-            buffer->size + len + DYNAMIC_BUFFER_BLOCK_SIZE;
+        // We grow geometrically, doubling the capacity (or more if that's not
+        // enough for the new data), so that appending N bytes one chunk at a
+        // time only copies O(N) bytes in total.
+        //
+        // For large buffers glibc's malloc uses mmap, and realloc of such a
+        // buffer is done with mremap which moves the pages rather than
+        // copying them. Any buffer larger than glibc's maximum mmap threshold
+        // (32 MiB on 64-bit systems) is guaranteed to be allocated this way,
+        // so very large pastes grow without copying at all. We can't mmap the
+        // buffer ourselves since the caller frees it with `free`.
+        size_t NEW_CAPACITY = buffer->capacity * 2;
+        if (NEW_CAPACITY < buffer->size + len) {
+            NEW_CAPACITY = buffer->size + len;
+        }
 
         char *new_ptr = realloc(buffer->ptr, NEW_CAPACITY);
         if (new_ptr == NULL) {
@@ -192,41 +764,114 @@ static void dynamic_buffer_append(struct DynamicBuffer *buffer,
 
 
 
-// The selection we hold may be so large we have to transfer it in chunks, in
-// which case we have to keep track of our ongoing transfers. We do this with
-// this struct, which forms a linked list.
+/*
+ * Transfer table
+ *
+ * The selection we hold may be so large we have to transfer it in chunks, in
+ * which case we have to keep track of our ongoing transfers. Every
+ * PropertyNotify we get while serving the selection has us look up the
+ * transfer (if any) it concerns, and with many requestors pasting at the same
+ * time that lookup had better be cheap. So we keep the transfers in a hash
+ * table with open addressing (linear probing) keyed on the requestor window
+ * and the property, since one requestor may very well have several transfers
+ * going on at once on different properties.
+ */
+
 struct transfer {
-    // The window associated with the requestor, this should be all that's
-    // needed to uniquely identify a requestor.
+    // The window associated with the requestor, together with the property
+    // this uniquely identifies a transfer. A slot whose requestor_window is
+    // None is empty.
     Window requestor_window;
     Atom property;  // The property where we're supposed "put" the chunk
     size_t bytes_transfered;
-    struct transfer *next;
+
+    // The size of the chunks we send. With LIBXCLIP_CHUNK_ADAPTIVE it changes
+    // as we learn how fast the requestor is, see owner_adapt_chunk_size.
+    size_t chunk_size;
+    Bool settled;           // Whether chunk_size stays as it is.
+    double best_rate;       // In bytes per second, 0 if we don't know yet.
+    struct timespec sent;   // When we sent the last chunk.
+    size_t last_chunk_size; // The size of the last chunk.
+    struct contents *contents;  // What we're sending, NULL for a stream.
+    const struct libxclip_target *target;  // In `contents`, NULL for a stream.
 };
 
-// Returns a transfer whose requestor_window is the one specified, or NULL of no
-// such transfer was found.
-static struct transfer *
-get_transfer(struct transfer **head, Window requestor_window) {
-    struct transfer *current = *head;
+struct transfer_table {
+    struct transfer *slots;
+    size_t capacity;  // Always a power of two.
+    size_t count;     // Number of ongoing transfers.
+};
+
+static const size_t TRANSFER_TABLE_INITIAL_CAPACITY = 16;
+
+static size_t transfer_hash(Window requestor_window, Atom property) {
+    // Window and Atom are both (at most) 32 bit identifiers, so combine them
+    // into one 64 bit integer and mix the bits around.
+    unsigned long long h =
+        ((unsigned long long) requestor_window << 32) ^ property;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t) h;
+}
+
+static void transfer_table_new(struct transfer_table *table_ret) {
+    table_ret->slots = calloc(TRANSFER_TABLE_INITIAL_CAPACITY,
+                              sizeof(struct transfer));
+    if (table_ret->slots == NULL) {  // couldn't allocate memory. Pretty fatal
+        #ifdef DEBUG
+        printf("COULDN'T ALLOCATE MEMORY");
+        assert(False);
+        #endif
 
-    while (current != NULL) {
-        if (current->requestor_window == requestor_window) {
-            return current;
+        // TODO: Is this the right way to do it?
+        exit(1);
+    }
+
+    table_ret->capacity = TRANSFER_TABLE_INITIAL_CAPACITY;
+    table_ret->count = 0;
+}
+
+// Returns the slot where the transfer (requestor_window, property) is, or the
+// empty slot where it would go if there is no such transfer.
+static struct transfer *transfer_table_slot(struct transfer_table *table,
+                                            Window requestor_window,
+                                            Atom property) {
+    const size_t mask = table->capacity - 1;
+    size_t i = transfer_hash(requestor_window, property) & mask;
+
+    // There is always at least one empty slot, so this terminates.
+    while (table->slots[i].requestor_window != None) {
+        if (table->slots[i].requestor_window == requestor_window
+            && table->slots[i].property == property) {
+            break;
         }
-        current = current->next;
+        i = (i + 1) & mask;
     }
 
-    return NULL;
+    return &table->slots[i];
+}
+
+// Returns the transfer identified by (requestor_window, property), or NULL if
+// no such transfer was found.
+static struct transfer *get_transfer(struct transfer_table *table,
+                                     Window requestor_window,
+                                     Atom property) {
+    struct transfer *t =
+        transfer_table_slot(table, requestor_window, property);
+    if (t->requestor_window == None) {
+        return NULL;
+    }
+    return t;
 }
 
-// Make a new transfer.
-// An invariant is that no existing transfer with that requestor_window property
-// exists already.
-static void new_transfer(struct transfer **head, Window window, Atom property) {
-    struct transfer *new_transfer = calloc(1, sizeof(struct transfer));
+// Doubles the capacity of the table, rehashing all transfers.
+static void transfer_table_grow(struct transfer_table *table) {
+    struct transfer_table old = *table;
 
-    if (new_transfer == NULL) {  // couldn't allocate memory. Pretty fatal
+    table->capacity = old.capacity * 2;
+    table->slots = calloc(table->capacity, sizeof(struct transfer));
+    if (table->slots == NULL) {  // couldn't allocate memory. Pretty fatal
         #ifdef DEBUG
         printf("COULDN'T ALLOCATE MEMORY");
         assert(False);
@@ -236,33 +881,207 @@ static void new_transfer(struct transfer **head, Window window, Atom property) {
         exit(1);
     }
 
-    new_transfer->requestor_window = window;
-    new_transfer->property = property;
-    new_transfer->bytes_transfered = 0;
-    new_transfer->next = *head;
-    *head = new_transfer;
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.slots[i].requestor_window != None) {
+            *transfer_table_slot(table,
+                                 old.slots[i].requestor_window,
+                                 old.slots[i].property) = old.slots[i];
+        }
+    }
+
+    free(old.slots);
 }
 
-static void delete_transfer(struct transfer **head, struct transfer *transfer) {
-    if ((*head)->requestor_window == transfer->requestor_window) {
-        *head = transfer->next;
-        free(transfer);
-        return;
+// Make a new transfer and return it. If there's already a transfer identified
+// by (window, property) then the requestor has given up on it and is starting
+// over, so we start over too.
+//
+// NB. The returned pointer is only valid until the next call to new_transfer.
+static struct transfer *new_transfer(struct transfer_table *table,
+                                     Window window,
+                                     Atom property) {
+    // Keep the load factor at most 1/2 so that probe sequences stay short.
+    if ((table->count + 1) * 2 > table->capacity) {
+        transfer_table_grow(table);
     }
 
-    struct transfer *past = NULL;
-    struct transfer *current = *head;
-    while (current != NULL) {
-        if (current->requestor_window == transfer->requestor_window) {
-            past->next = current->next;
-            free(current);
-            return;
+    struct transfer *t = transfer_table_slot(table, window, property);
+    if (t->requestor_window == None) {
+        table->count++;
+    }
+
+    t->requestor_window = window;
+    t->property = property;
+    t->bytes_transfered = 0;
+    return t;
+}
+
+static void delete_transfer(struct transfer_table *table,
+                            struct transfer *transfer) {
+    const size_t mask = table->capacity - 1;
+    size_t hole = (size_t) (transfer - table->slots);
+
+    // Rather than leaving a tombstone we shift back any transfer further
+    // along the probe sequence that would rather be in the hole we just made,
+    // that way lookups never have to skip over deleted slots.
+    size_t i = hole;
+    while (True) {
+        i = (i + 1) & mask;
+        struct transfer *t = &table->slots[i];
+        if (t->requestor_window == None) {
+            break;
+        }
+
+        size_t home = transfer_hash(t->requestor_window, t->property) & mask;
+        // Can `t` move into the hole? Only if its home slot doesn't lie
+        // (cyclically) strictly between the hole and where it is now.
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->slots[hole] = *t;
+            hole = i;
         }
-        past = current;
-        current = current->next;
     }
 
-    assert(False);
+    table->slots[hole].requestor_window = None;
+    table->slots[hole].property = None;
+    table->count--;
+}
+
+// The windows an embedded owner has INCR transfers to, together with what the
+// caller had selected on each before we added PropertyChangeMask, see
+// owner_select_requestor. A slot whose window is None is empty.
+struct watched_window {
+    Window window;
+    long saved_mask;
+    size_t refs;  // The number of transfers to the window.
+};
+
+struct window_table {
+    struct watched_window *slots;  // NULL until the first window.
+    size_t capacity;  // Always a power of two, or 0.
+    size_t count;
+};
+
+// Returns the slot where `window` is, or the empty slot where it would go.
+static struct watched_window *window_table_slot(struct window_table *table,
+                                                Window window) {
+    const size_t mask = table->capacity - 1;
+    size_t i = transfer_hash(window, None) & mask;
+    while (table->slots[i].window != None
+           && table->slots[i].window != window) {
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+// Returns the slot of `window`, adding it with no references if it isn't in
+// the table yet.
+//
+// NB. The returned pointer is only valid until the next call to
+// window_table_add.
+static struct watched_window *window_table_add(struct window_table *table,
+                                               Window window) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        struct window_table old = *table;
+        table->capacity = old.capacity > 0
+                          ? old.capacity * 2
+                          : TRANSFER_TABLE_INITIAL_CAPACITY;
+        table->slots = calloc(table->capacity, sizeof(struct watched_window));
+        if (table->slots == NULL) {  // couldn't allocate memory. Pretty fatal
+            #ifdef DEBUG
+            printf("COULDN'T ALLOCATE MEMORY");
+            assert(False);
+            #endif
+
+            // TODO: Is this the right way to do it?
+            exit(1);
+        }
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (old.slots[i].window != None) {
+                *window_table_slot(table, old.slots[i].window) = old.slots[i];
+            }
+        }
+        free(old.slots);
+    }
+
+    struct watched_window *w = window_table_slot(table, window);
+    if (w->window == None) {
+        table->count++;
+        w->window = window;
+        w->refs = 0;
+    }
+    return w;
+}
+
+// Like delete_transfer.
+static void window_table_delete(struct window_table *table,
+                                struct watched_window *window) {
+    const size_t mask = table->capacity - 1;
+    size_t hole = (size_t) (window - table->slots);
+    size_t i = hole;
+    while (True) {
+        i = (i + 1) & mask;
+        struct watched_window *w = &table->slots[i];
+        if (w->window == None) {
+            break;
+        }
+
+        size_t home = transfer_hash(w->window, None) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->slots[hole] = *w;
+            hole = i;
+        }
+    }
+
+    table->slots[hole].window = None;
+    table->count--;
+}
+
+
+
+/*
+ * Atoms
+ *
+ * Both the selection owner (the child process in libxclip_put) and the
+ * requestor (libxclip_get and friends) need a handful of atoms. Interning them
+ * one at a time with XInternAtom costs one round trip to the X server each, so
+ * instead we intern all of them at once with `intern_atoms` and afterwards
+ * only ever look them up in the resulting table.
+ */
+
+// Index the table filled in by `intern_atoms` with these.
+enum {
+    ATOM_CLIPBOARD,
+    ATOM_TARGETS,
+    ATOM_UTF8_STRING,
+    ATOM_INCR,
+    ATOM_ATOM,
+    ATOM_LIBXCLIP_OUT,
+    ATOM_MULTIPLE,
+    ATOM_ATOM_PAIR,
+    ATOM_LIBXCLIP_TARGETS,
+    ATOM_NET_WM_PID,
+    ATOM_LIBXCLIP_ZLIB,
+    ATOM_LIBXCLIP_SHM,
+    ATOM_COUNT,
+};
+
+static char *ATOM_NAMES[ATOM_COUNT] = {
+    [ATOM_CLIPBOARD]    = "CLIPBOARD",
+    [ATOM_TARGETS]      = "TARGETS",
+    [ATOM_UTF8_STRING]  = "UTF8_STRING",
+    [ATOM_INCR]         = "INCR",
+    [ATOM_ATOM]         = "ATOM",
+    [ATOM_LIBXCLIP_OUT] = "LIBXCLIP_OUT",
+    [ATOM_MULTIPLE]     = "MULTIPLE",
+    [ATOM_ATOM_PAIR]    = "ATOM_PAIR",
+    [ATOM_LIBXCLIP_TARGETS] = "LIBXCLIP_TARGETS",
+    [ATOM_NET_WM_PID]   = "_NET_WM_PID",
+    [ATOM_LIBXCLIP_ZLIB] = "application/x-libxclip-zlib",
+    [ATOM_LIBXCLIP_SHM] = "application/x-libxclip-shm",
+};
+
+static void intern_atoms(xconn *conn, Atom atoms_ret[ATOM_COUNT]) {
+    xconn_intern_atoms(conn, ATOM_NAMES, ATOM_COUNT, atoms_ret);
 }
 
 
@@ -274,16 +1093,18 @@ void libxclip_getopts_initialize(struct libxclip_getopts *options) {
     options->selection = None;  // None = CLIPBOARD
     options->target = None;     // None = UTF8_STRING
     options->timeout = -1;      // -1   = no timeout
+    options->preferred = NULL;  // NULL = just `target`
+    options->npreferred = 0;
+    options->chosen = None;
 }
 
 
 
-static void xclipboard_respond(XEvent request,
+static void xclipboard_respond(xconn *conn,
+                               XEvent request,
                                Atom property,
                                Atom selection,
                                Atom target) {
-    XEvent response;
-
     //  Perhaps FIXME: According to ICCCM section 2.5, we should
     //  confirm that XChangeProperty succeeded without any Alloc
     //  errors before replying with SelectionNotify. However, doing
@@ -291,933 +1112,4505 @@ static void xclipboard_respond(XEvent request,
     //  variable, plus doing XSync after each XChangeProperty.
 
     if (request.type == SelectionRequest) {
-        response.xselection.property  = property;
-        response.xselection.type      = SelectionNotify;
-        response.xselection.display   = request.xselectionrequest.display;
-        response.xselection.requestor = request.xselectionrequest.requestor;
-        response.xselection.selection = selection;
-        response.xselection.target    = target;
-        response.xselection.time      = request.xselectionrequest.time;
-
-        XSendEvent(request.xselectionrequest.display,
-                   request.xselectionrequest.requestor,
-                   True,
-                   0,
-                   &response);
+        xconn_send_selection_notify(conn,
+                                    request.xselectionrequest.requestor,
+                                    selection,
+                                    target,
+                                    property,
+                                    request.xselectionrequest.time);
     } else if (request.type == PropertyNotify) {
-        response.xselection.property  = property;
-        response.xselection.type      = SelectionNotify;
-        response.xselection.display   = request.xproperty.display;
-        response.xselection.requestor = request.xproperty.window;
-        response.xselection.selection = selection;
-        response.xselection.target    = target;
-        response.xselection.time      = request.xproperty.time;
-
-        XSendEvent(request.xproperty.display,
-                   request.xproperty.window,
-                   True,
-                   0,
-                   &response);
+        xconn_send_selection_notify(conn,
+                                    request.xproperty.window,
+                                    selection,
+                                    target,
+                                    property,
+                                    request.xproperty.time);
     } else {
         assert(False);
     }
 
-    XFlush(request.xselectionrequest.display);
+    // Not flushed here: the owner's event loop flushes once it has handled
+    // every event that has arrived, answering all of them with one write.
     // TODO what errors can this generate?
 }
 
-int libxclip_put(Display *display,
-                 char *data,
-                 size_t len,
-                 libxclip_putopts *options) {
-    // The first thing we do, in an attempt to avoid race conditions,
-    // missed events, and so on, is to create the child process and then have
-    // the parent process freeze until the child process has performed all it's
-    // setup.
-
-    // NB. The selections contents are stored in `data` and the child process
-    // will of course read from this. What happens though in the case that the
-    // parent process exits before the child process is finished? One might
-    // think that all data allocated by the parent process is freed, including
-    // what `data` points to. This is true in some sense, but `fork` performs a
-    // copy-on-write duplication on all of the heap contents from the parent
-    // process to the child process. This means:
-    // 1) If the parent process never writes to `data` after having called
-    //    `xlipboard_persit` then no copies are made of that data, yet the child
-    //    process still has acess to it after the parent process exited. COOL!
-    // 2) If the parent process does write then the `data` is copied, and the
-    //    child process will continue to acess the original contents.
-    // See:
-    // https://unix.stackexchange.com/questions/155017/does-fork-immediately-copy-the-entire-process-heap-in-linux
-    // THAT'S SO COOL
-
-    // We'll use these pipes for the child process to thell the parent that it
-    // can resume.
-    int pipefd[2];
-    int ret = pipe(pipefd);
-    if (ret == -1) {
-        assert(False);
-    }
-
-    pid_t pid = fork();
-    if (pid != 0) {
-        #ifdef DEBUG
-        printf("Waiting for child process to setup before returning to "
-               "caller\n");
-        #endif
+/*
+ * Stream source
+ *
+ * libxclip_put_stream lets the caller put something on the clipboard without
+ * having all of it in memory, the contents are instead produced by a callback
+ * (or read from a file descriptor) as they're needed. Of course a callback
+ * can only be asked for its contents once, so a stream can only be pasted
+ * once -- unless it turns out to be small enough to send in one chunk, in
+ * which case we hold on to that chunk and it behaves just like libxclip_put.
+ *
+ * To not make the requestor wait for the callback every time it asks for a
+ * chunk a producer thread keeps a small ring of chunks filled ahead of time,
+ * from which the selection owner takes one chunk every time the requestor
+ * deletes the property.
+ */
 
-        char buf;
-        int ret = read(pipefd[0], &buf, 1);
+// Number of chunks the producer thread reads ahead.
+enum { STREAM_RING_SLOTS = 4 };
+
+struct stream {
+    libxclip_source source;
+    void *userdata;
+    size_t chunk_size;     // The size of each slot.
+    pthread_t producer;
+    Bool started;          // Whether `producer` was started.
+    int fd;                // A file descriptor we own and close, or -1.
+
+    // Everything below is protected by `lock`, and `cond` is broadcasted
+    // whenever any of it changes.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *slots[STREAM_RING_SLOTS];
+    size_t lens[STREAM_RING_SLOTS];
+    // Slot number `head % STREAM_RING_SLOTS` is the next one the consumer
+    // takes and `tail % STREAM_RING_SLOTS` is the next one the producer
+    // fills, `tail - head` slots are filled.
+    size_t head;
+    size_t tail;
+    Bool eof;     // The source has nothing more after slot `tail`.
+    Bool failed;  // The source reported an error.
+    Bool stop;    // The owner is done with the stream, stop reading.
+};
 
-        if (ret == -1) {  // indactes an error occured and errno has been set
-            #ifdef DEBUG
-            printf("Error occured reading from pipe :-(\n");
-            assert(False);
-            #endif
+static void *stream_producer(void *arg) {
+    struct stream *stream = arg;
 
-            // TODO: do something to indicate an error occured?
+    while (True) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->tail - stream->head == STREAM_RING_SLOTS
+               && !stream->stop) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        if (stream->stop) {
+            pthread_mutex_unlock(&stream->lock);
+            return NULL;
+        }
+        char *slot = stream->slots[stream->tail % STREAM_RING_SLOTS];
+        pthread_mutex_unlock(&stream->lock);
+
+        // Fill the slot, the source may give us less than we ask for so keep
+        // asking until the slot is full or the source is done.
+        size_t filled = 0;
+        Bool eof = False;
+        Bool failed = False;
+        while (filled < stream->chunk_size) {
+            ssize_t n = stream->source(slot + filled,
+                                       stream->chunk_size - filled,
+                                       stream->userdata);
+            if (n < 0) {
+                failed = True;
+                break;
+            }
+            if (n == 0) {
+                eof = True;
+                break;
+            }
+            filled += (size_t) n;
         }
 
-        #ifdef DEBUG
-        printf("Child process is done with setup\n");
-        #endif
-
-        close(pipefd[0]);
-        close(pipefd[1]);
+        pthread_mutex_lock(&stream->lock);
+        if (filled > 0) {
+            stream->lens[stream->tail % STREAM_RING_SLOTS] = filled;
+            stream->tail++;
+        }
+        stream->eof = eof;
+        stream->failed = failed;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
 
-        return 0;
+        if (eof || failed) {
+            return NULL;
+        }
     }
+}
 
-    // Now that we're in the child process we re-open the connection to the
-    // display I'm not sure how this all works, if this is the correct thing to
-    // do. All I know is if I don't have this I run into problems and
-    // StackOverflow comments suggest that you "need one XOpenDisplay per
-    // thread", and that almost what  we're doing here.
-    Display *parent_display = display;
-    display = XOpenDisplay(XDisplayString(parent_display));
-
-    // Intern some atoms
-    const Atom A_CLIPBOARD = XInternAtom(display, "CLIPBOARD", False);
-    const Atom A_TARGETS = XInternAtom(display, "TARGETS", False);
-    const Atom A_UTF8_STRING = XInternAtom(display, "UTF8_STRING", False);
-    const Atom A_INCR = XInternAtom(display, "INCR", False);
-
-    // A dummy window that exists only for us to intercept `SelectionRequest`
-    // events.
-    Window window = XCreateSimpleWindow(display,
-                                        DefaultRootWindow(display),
-                                        0, 0, 1, 1, 0, 0, 0);
-    // TODO: XCreateSimpleWindow can generate BadAlloc, BadMatch, BadValue, and
-    // BadWindow errors.
-    // https://tronche.com/gui/x/xlib/window/XCreateWindow.html
-
-    // take control of the selection so that we receive
-    // `SelectionRequest` events from other windows
-    // FIXME: Should not use CurrentTime, according to ICCCM section 2.1
-    XSetSelectionOwner(display, A_CLIPBOARD, window, CurrentTime);
-    // TODO: What errorrs can this generate?
-
-    // Double-check SetSelectionOwner did not "merely appear to succeed"
-    if (XGetSelectionOwner(display, A_CLIPBOARD) != window) {
-        assert(False);
-        // TODO handle error
+// Allocates the ring and starts the producer thread. Returns -1 on failure.
+static int stream_start(struct stream *stream, size_t chunk_size) {
+    stream->chunk_size = chunk_size;
+    stream->head = 0;
+    stream->tail = 0;
+    stream->eof = False;
+    stream->failed = False;
+    stream->stop = False;
+
+    for (int i = 0; i < STREAM_RING_SLOTS; i++) {
+        stream->slots[i] = malloc(chunk_size);
+        if (stream->slots[i] == NULL) {
+            return -1;
+        }
     }
-    // TODO: Can XGetSelectionOwner generate an error.
-
-    // As long as we are the selection owner the child process waits for more
-    // SelectionRequest's. However, as soon as we know we're no longer the owner
-    // we stop accepting new SelectionRequest, only sticking around so that we
-    // can complete transfers already in progress.
-    Bool selection_owner = True;
 
-    XSelectInput(display, window, PropertyChangeMask);
-    // TODO: XSelectInput() can generate a BadWindow error.
-    // https://tronche.com/gui/x/xlib/event-handling/XSelectInput.html
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (pthread_create(&stream->producer, NULL, stream_producer, stream)
+        != 0) {
+        return -1;
+    }
+    stream->started = True;
+    return 0;
+}
 
-    // when fork() creates the child process it copies the stack and the heap
-    // from the parent process, including the stdout buffer. This means that
-    // the (copied) stdout buffer is flushed when the child process terminates,
-    // in some cases resulting in mysterious "double printing". So the child
-    // process starts by clearing the outout buffer to avoid this.
-    __fpurge(stdout);
-
-    // Move into root, so that we don't cause any problems in case the
-    // directory we're currently in needs to be unmounted
-    int sucess = chdir("/");
-    if (sucess == -1) {
-        #ifdef DEBUG
-        printf("Failed to move child process into root directory!?\n");
-        #endif
+// Stops the producer thread and frees the ring. The child process never
+// bothers with this since exiting takes care of it, but an owner thread has to
+// clean up after itself.
+//
+// NB. If the producer is stuck in a call to the source we have to wait for
+// that call to return.
+static void stream_stop(struct stream *stream) {
+    if (stream->started) {
+        pthread_mutex_lock(&stream->lock);
+        stream->stop = True;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->producer, NULL);
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->cond);
     }
 
-    // Determine chunk_size
-    // In the case that the selections contents is very large we may
-    // have to send the clipboard selection in multiple chunks,
-    // and the maximum chink size is defined by X11
-    //
-    // We consider selections larger than a quarter of the maximum
-    // request size to be "large". See ICCCM section 2.5
-    // FIXME: I think the chunk_size should be ~16x the size of what we
-    //        currently do.
-    //
-    // First see if X supports extended-length encoding, it returns 0 if not
-    size_t chunk_size = XExtendedMaxRequestSize(display) / 4;
-    // Otherwise, try the normal encoding
-    if (!chunk_size) {
-        chunk_size = XMaxRequestSize(display) / 4;
+    for (int i = 0; i < STREAM_RING_SLOTS; i++) {
+        free(stream->slots[i]);
     }
-    // If this fails for some reason, we fallback to this
-    if (!chunk_size) {
-        chunk_size = 4096;
+
+    if (stream->fd != -1) {
+        close(stream->fd);
     }
+}
 
-    // The head of the linked list that keeps track of all ongoing INCR
-    // transfers.
-    struct transfer *transfers = NULL;
+// Blocks until there are at least `n` filled slots, or the source is done.
+// Returns the number of filled slots (which is less than `n` only if the
+// source is done).
+static size_t stream_wait(struct stream *stream, size_t n) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->tail - stream->head < n
+           && !stream->eof
+           && !stream->failed) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+    size_t filled = stream->tail - stream->head;
+    pthread_mutex_unlock(&stream->lock);
+    return filled;
+}
 
-    // Now we're ready for the parent process to return to the caller
-    // TODO: We can probably let the parent resume earlier than this, but let's
-    // stay safe for now
-    XSync(display, False);
-    ret = write(pipefd[1], "1", 1);  // Notify parent
-    close(pipefd[0]);
-    close(pipefd[1]);
+// Sum of the lengths of the filled slots. Only call this while the producer
+// can't change them, i.e. right after `stream_wait`.
+static size_t stream_buffered(struct stream *stream) {
+    size_t total = 0;
+    pthread_mutex_lock(&stream->lock);
+    for (size_t i = stream->head; i != stream->tail; i++) {
+        total += stream->lens[i % STREAM_RING_SLOTS];
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return total;
+}
 
-    if (ret == -1) {  // inducates an error occured an errno has been set
-        #ifdef DEBUG
-        printf("Error occured writing to pipe :-(\n");
-        #endif
+// Hands the first filled slot back to the producer.
+static void stream_pop(struct stream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->head++;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+}
 
-        // TODO: If this happens it means we cannot communicate to the parent
-        // process?? What do we do then?
+// Writes all of `len` bytes to `fd`. Returns -1 on failure.
+static int write_all(int fd, const void *data, size_t len) {
+    for (size_t written = 0; written < len;) {
+        ssize_t n = write(fd, (const char *) data + written, len - written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        written += (size_t) n;
     }
+    return 0;
+}
 
-    XEvent event;
+// The source behind libxclip_put_fd, `userdata` is the file descriptor.
+static ssize_t fd_source(char *buf, size_t len, void *userdata) {
+    int fd = (int) (intptr_t) userdata;
     while (True) {
-        // We are no longer the selection owner and we have no ongoing
-        // transfers, time to exit this child process.
-        if (selection_owner == False && transfers == NULL) {
-            #ifdef DEBUG
-            printf("Exiting child process.\n");
-            #endif
-            _Exit(3);
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
         }
+        return n;
+    }
+}
 
-        XNextEvent(display, &event);
-        #ifdef DEBUG
-        printf("Got an event\n");
-        #endif
 
-        // Someone is making a SelectionRequest but we're no longer the
-        // selection's owner. Refuse the request.
-        if (selection_owner == False && event.type == SelectionRequest) {
-            #ifdef DEBUG
-            printf("Got a SelectionRequest when we're no longer the owner, "
-                   "refusing.\n");
-            #endif
 
-            xclipboard_respond(event,
-                               None,
-                               A_CLIPBOARD,
-                               event.xselection.target);
+#ifdef LIBXCLIP_SHM
+/*
+ * Shared memory
+ *
+ * An owner and a requestor on the same host don't need the X server to move
+ * the contents between them, the requestor can just as well map them. So when
+ * built with LIBXCLIP_SHM an owner with a large UTF8_STRING puts it in a
+ * sealed memfd the first time someone asks for application/x-libxclip-shm,
+ * and answers with a `struct shm_descriptor` of the memfd instead (see
+ * owner_shared). When libxclip_get finds a large UTF8_STRING and the owner
+ * has that target, it asks for that first (see ctx_receive_text), and if the
+ * descriptor says the memfd is on our host it opens it through /proc.
+ * Anything else, or anything going wrong, and it falls back to the next way.
+ */
 
-            continue;
-        }
+static const uint32_t SHM_DESCRIPTOR_MAGIC = 0x6c786331;  // "lxc1"
+
+// The memfd is the owner's file descriptor `fd` in the process `pid`, which
+// only means something on the host with the boot ID `boot_id`, and which is
+// verified by its device and inode numbers. Every put that gets as far as
+// making one has a memfd (and so an inode) of its own.
+struct shm_descriptor {
+    uint32_t magic;
+    char boot_id[40];
+    uint64_t pid;
+    uint64_t fd;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+};
 
-        // FIXME: ICCCM 2.2: check evt.time and refuse requests from
-        // outside the period of time we have owned the selection.
+// Reads the host's boot ID, which tells it apart from every other host (and
+// from itself after a reboot). Returns -1 on failure.
+static int read_boot_id(char boot_id[40]) {
+    memset(boot_id, 0, 40);
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, boot_id, 39);
+    close(fd);
+    return n > 0 ? 0 : -1;
+}
+#endif
 
-        // We have lost ownership of the selection (for instance the user did a
-        // CTRL-C in some other application).  There is nothing more for us to
-        // do, except complete any ongoing transfers.
-        if (event.type == SelectionClear) {
-            #ifdef DEBUG
-            printf("Got a SelectionClear\n");
-            #endif
 
-            selection_owner = False;
-            continue;
-        }
 
-        int target = 0;  // Initialized only to avoid -Wmaybe-uninitialized
-        #ifdef DEBUG
-        char *target_name = "";
-        #endif
-        if (event.type == SelectionRequest) {
-            target = event.xselectionrequest.target;
+/*
+ * Statistics
+ *
+ * With putopts.handle_ret the caller gets a handle on what the owner has been
+ * up to: how many requests it has answered and for which targets, how many
+ * bytes it has served, how long requestors take to come back for the next
+ * INCR chunk, and who those requestors are. The owner keeps all of this in a
+ * small block of shared memory (a memfd) that the caller maps as well, so it
+ * works the same whether the owner is a thread, a child process or the
+ * daemon, and the caller can look at it without bothering the owner.
+ *
+ * The owner is the only one writing to the block. It bumps `seq` before and
+ * after every update, so a reader that finds `seq` odd, or changed once it's
+ * done copying, knows it raced an update and tries again.
+ */
 
-            #ifdef DEBUG
-            target_name = XGetAtomName(display,
-                                       event.xselectionrequest.target);
-            // this is a memory leak but whatever we're in debug
-            #endif
-        }
+struct stats_block {
+    unsigned long seq;
+    struct libxclip_stats stats;
+};
 
-        // Some program asked us what kinds of formats (i.e. targets) we can
-        // send the selection contents in (like utf8, html, png, etc.). This can
-        // happen for instance when a user does CTRL-V in an application,
-        // usually the application wants to know what format the content is in,
-        // for instance if we support a png target maybe the application would
-        // like to insert an image instead of text for the user.
-        if (event.type == SelectionRequest
-            && target == A_TARGETS) {
-            #ifdef DEBUG
-            printf("Got a selection request with target = TARGETS\n");
-            #endif
+struct libxclip_put_handle {
+    struct stats_block *block;
+};
 
-            // This is the contents of our resonse.
-            // We supports two targets
-            // 1) The TARGETS target (duh)
-            // 2) UTF8_STRING
-            // TODO: Should we support more targets by default?
-            // Some reasonable targets could be:
-            // - STRING
-            // - TEXT
-            // - text/plain
-            // - text/plain;charset=utf-8
-            Atom types[2] = {
-                A_TARGETS,
-                A_UTF8_STRING,
-            };
-
-            // put the response contents into the request's property
-            XChangeProperty(display,
-                            event.xselectionrequest.requestor,
-                            event.xselectionrequest.property,
-                            XInternAtom(display, "ATOM", False),
-                            32,
-                            PropModeReplace,
-                            (unsigned char *) types,
-                            (int) (sizeof(types) / sizeof(Atom)));
-            // TODO: XChangeProperty() can generate BadAlloc, BadAtom, BadMatch,
-            //       BadValue, and BadWindow errors.
-
-            // Now we send the response
-            xclipboard_respond(event,
-                               event.xselectionrequest.property,
-                               A_CLIPBOARD,
-                               XInternAtom(display, "TARGETS", False));
+// Maps the block at `offset` in `fd`, or returns NULL if that fails.
+static struct stats_block *stats_map(int fd, off_t offset) {
+    void *mapped = mmap(NULL, sizeof(struct stats_block),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    return mapped != MAP_FAILED ? mapped : NULL;
+}
 
-            continue;
-        }
+static void stats_unmap(struct stats_block *block) {
+    if (block != NULL) {
+        munmap(block, sizeof(struct stats_block));
+    }
+}
 
-        // The requestor asked us the send the contents of the selection as a
-        // UTF8 string, and we can send the contents in one chunk
-        if (event.type == SelectionRequest
-            && target == XInternAtom(display, "UTF8_STRING", False)
-            && len <= chunk_size) {
-            #ifdef DEBUG
-            printf("Got a selection request with target = %s and we can send"
-                   "the response in one chunk\n",
-                   target_name);
-            #endif
+// Starts an update of `block`, which is NULL if no one asked for statistics.
+// Returns the statistics to update, or NULL if there are none.
+static struct libxclip_stats *stats_begin(struct stats_block *block) {
+    if (block == NULL) {
+        return NULL;
+    }
+    __atomic_store_n(&block->seq, block->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return &block->stats;
+}
 
-            XChangeProperty(display,
-                            event.xselectionrequest.requestor,
-                            event.xselectionrequest.property,
-                            XInternAtom(display, "UTF8_STRING", False),
-                            8,
-                            PropModeReplace,
-                            (unsigned char *) data,
-                            (int) len);
-            // TODO: XChangeProperty() can generate BadAlloc, BadAtom, BadMatch,
-            //       BadValue, and BadWindow errors.
-
-            xclipboard_respond(event,
-                               event.xselectionrequest.property,
-                               A_CLIPBOARD,
-                               XInternAtom(display, "UTF8_STRING", False));
+static void stats_end(struct stats_block *block) {
+    if (block != NULL) {
+        __atomic_store_n(&block->seq, block->seq + 1, __ATOMIC_RELEASE);
+    }
+}
 
-            continue;
+// The entry for `target`, which is claimed if it doesn't have one yet. NULL
+// if every entry is taken, the target then only shows up in the totals.
+static struct libxclip_stats_target *stats_target(
+        struct libxclip_stats *stats, Atom target) {
+    for (size_t i = 0; i < LIBXCLIP_STATS_TARGETS; i++) {
+        struct libxclip_stats_target *e = &stats->targets[i];
+        if (e->target == target || e->target == None) {
+            e->target = target;
+            return e;
         }
+    }
+    return NULL;
+}
 
-        // The requestor asked us the send the contents of the selection as a
-        // UTF8 string, and we have to send it in multiple chunks.
-        if (event.type == SelectionRequest
-            && target == XInternAtom(display, "UTF8_STRING", False)
-            && len > chunk_size) {
-            #ifdef DEBUG
-            printf("Got a selection request with target = %s but we can't send"
-                   "the response in one chunk\n",
-                   target_name);
-            #endif
+// Like stats_target but for requestors, which are only ever looked up.
+static struct libxclip_stats_requestor *stats_requestor(
+        struct libxclip_stats *stats, Window window) {
+    for (size_t i = 0; i < LIBXCLIP_STATS_REQUESTORS; i++) {
+        if (stats->requestors[i].window == window) {
+            return &stats->requestors[i];
+        }
+    }
+    return NULL;
+}
 
-            // FIXME: instead of sending zero items we should send an integer
-            //        representing the lower bound on the number of bytes to
-            //        send ICCCM 2.7.2 INCR Properties.
-            XChangeProperty(display,
-                            event.xselectionrequest.requestor,
-                            event.xselectionrequest.property,
-                            A_INCR,
-                            32,
-                            PropModeReplace,
-                            0,
-                            0);
-
-            // With the INCR mechanism, we need to know
-            // when the requestor window changes (deletes)
-            // its properties.
-            XSelectInput(display,
-                         event.xselectionrequest.requestor,
-                         PropertyChangeMask);
-
-            xclipboard_respond(event,
-                               event.xselectionrequest.property,
-                               A_CLIPBOARD,
-                               XInternAtom(display, "UTF8_STRING", False));
-
-            // Do we have an ongoing transfer already?
-            struct transfer *t =
-                get_transfer(&transfers, event.xselectionrequest.requestor);
-            if (t != NULL) {
-                // TODO: handle somehow
-                assert(False);
-            }
+// Counts `len` bytes of `target` sent to `requestor`.
+static void stats_served(struct libxclip_stats *stats,
+                         Window requestor,
+                         Atom target,
+                         size_t len) {
+    stats->bytes_served += len;
+    struct libxclip_stats_target *t = stats_target(stats, target);
+    if (t != NULL) {
+        t->bytes += len;
+    }
+    struct libxclip_stats_requestor *r = stats_requestor(stats, requestor);
+    if (r != NULL) {
+        r->bytes += len;
+    }
+}
 
-            // We don't have an ongoig transfer already, so register this one
-            new_transfer(&transfers,
-                         event.xselectionrequest.requestor,
-                         event.xselectionrequest.property);
+// Files a chunk turnaround of `seconds` under its histogram bucket.
+static void stats_turnaround(struct libxclip_stats *stats, double seconds) {
+    const double us = seconds * 1e6;
+    size_t bucket = 0;
+    while (bucket + 1 < LIBXCLIP_STATS_BUCKETS
+           && us >= (double) (2UL << bucket)) {
+        bucket++;
+    }
+    stats->chunk_turnaround[bucket]++;
+}
 
+int libxclip_put_stats(libxclip_put_handle *handle,
+                       struct libxclip_stats *stats_ret) {
+    if (handle == NULL || handle->block == NULL) {
+        return -1;
+    }
+    struct stats_block *block = handle->block;
+    while (True) {
+        const unsigned long seq = __atomic_load_n(&block->seq,
+                                                  __ATOMIC_ACQUIRE);
+        if (seq % 2 == 1) {
+            sched_yield();
             continue;
         }
+        memcpy(stats_ret, &block->stats, sizeof(*stats_ret));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&block->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+}
 
-        // It _may_ be the case that some requestor is asking us to send another
-        // chunk
-        if (event.type == PropertyNotify
-            && event.xproperty.state == PropertyDelete) {
-            #ifdef DEBUG
-            printf("Got a PropertyNotify and it's state field is"
-                   "PropertyDelete\n");
-            #endif
-
-            struct transfer *t = get_transfer(&transfers,
-                                              event.xproperty.window);
-            if (t == NULL) {
-                #ifdef DEBUG
-                printf("PropertyNotify is not concearning an ongoing transfer"
-                       "of ours, not interested.\n");
-                #endif
-                continue;
-            }
+void libxclip_put_handle_destroy(libxclip_put_handle *handle) {
+    if (handle != NULL) {
+        stats_unmap(handle->block);
+        free(handle);
+    }
+}
 
-            // This should never happen
-            if (len < t->bytes_transfered) {
-                assert(False);
-            }
 
-            size_t left_to_transfer = len - t->bytes_transfered;
-            size_t this_chunk_size = chunk_size;
-            unsigned char *this_data =
-                (unsigned char*) data + t->bytes_transfered;
-
-            // We have no data left to transfer, and we should send one last
-            // empty chunk to signal to the requestor that the transfer is
-            // complete.
-            if (left_to_transfer == 0) {
-                this_chunk_size = 0;
-                this_data = 0;
-                // At the end of this block we also do `delete_transfer`
-            } else if (left_to_transfer < chunk_size) {
-                this_chunk_size = left_to_transfer;
-            }
+/*
+ * Selection owner
+ *
+ * libxclip_put creates a child process that takes ownership of the selection
+ * and then serves SelectionRequest's for it until some other application
+ * takes ownership and all ongoing transfers have completed. Everything that
+ * child process needs to keep track of lives in a `struct owner`.
+ */
 
-            XChangeProperty(display,
-                            event.xproperty.window,
-                            t->property,
-                            XInternAtom(display, "UTF8_STRING", False),
-                            8,
-                            PropModeReplace,
-                            this_data,
-                            (int) this_chunk_size);
+// What the owner serves: a set of targets, each with its own data. Requestors
+// ask for a target by its atom, which we look up in a hash table (open
+// addressing, linear probing) of indices into `targets`.
+//
+// Every INCR transfer holds a reference to the contents it's sending, since in
+// daemon mode a put may replace the owner's contents while requestors are
+// still receiving the old ones. The contents are freed once the last reference
+// is released.
+struct contents {
+    struct libxclip_target *targets;
+    size_t ntargets;
+    size_t *index;      // 0 is an empty slot, otherwise 1 + index in targets.
+    size_t index_mask;  // The size of `index` (a power of two) minus one.
+
+    // What to unmap or free along with the contents, if anything.
+    void *mappings[2];
+    size_t mapping_lens[2];
+    char *copy;
+    char **converted;  // What each target's convert callback gave us.
+
+    // How the owner sizes its chunks, from libxclip_putopts.
+    int chunk_policy;
+    size_t chunk_size;
+
+    // Where we keep statistics on serving the contents, NULL if no one asked
+    // for them.
+    struct stats_block *stats;
+
+    // UTF8_STRING compressed for other libxclips, made the first time one of
+    // them asks for it, see owner_compressed.
+    struct libxclip_target compressed;
+
+    // The same for UTF8_STRING in shared memory, see owner_shared. The target
+    // is a `struct shm_descriptor` of `shared_fd`, which is -1 until made.
+    struct libxclip_target shared;
+    int shared_fd;
+
+    size_t refs;
+};
 
-            t->bytes_transfered = t->bytes_transfered + this_chunk_size;
+static size_t atom_hash(Atom atom) {
+    unsigned long long h = atom;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t) h;
+}
 
-            xclipboard_respond(event,
-                               t->property,
-                               A_CLIPBOARD,
-                               XInternAtom(display, "UTF8_STRING", False));
+// Makes contents out of a (shallow) copy of `targets`, which aren't indexed
+// until `contents_index` has been called. Returns NULL on failure.
+static struct contents *contents_new(const struct libxclip_target *targets,
+                                     size_t ntargets) {
+    struct contents *contents = calloc(1, sizeof(struct contents));
+    if (contents == NULL) {
+        return NULL;
+    }
 
-            if (left_to_transfer == 0) {
-                delete_transfer(&transfers, t);
-            }
+    size_t capacity = 4;
+    while (capacity < ntargets * 2) {
+        capacity *= 2;
+    }
+    contents->targets = malloc((ntargets + 1) * sizeof(*targets));
+    contents->index = calloc(capacity, sizeof(size_t));
+    contents->converted = calloc(ntargets + 1, sizeof(char *));
+    if (contents->targets == NULL
+        || contents->index == NULL
+        || contents->converted == NULL) {
+        free(contents->targets);
+        free(contents->index);
+        free(contents->converted);
+        free(contents);
+        return NULL;
+    }
+    contents->ntargets = ntargets;
+    contents->index_mask = capacity - 1;
+    contents->shared_fd = -1;
+    contents->refs = 1;
+    memcpy(contents->targets, targets, ntargets * sizeof(*targets));
+    return contents;
+}
 
-            continue;
+// Fills in the index. The data passed to libxclip_put has no target until we
+// get here, so the target None stands for UTF8_STRING, whose atom the caller
+// may not have. Should the same target appear more than once the last one
+// wins.
+static void contents_index(struct contents *contents, Atom utf8_string) {
+    for (size_t i = 0; i < contents->ntargets; i++) {
+        struct libxclip_target *t = &contents->targets[i];
+        if (t->target == None) {
+            t->target = utf8_string;
         }
 
-        // The target is not something that we support
-        if (event.type == SelectionRequest
-            && event.xselectionrequest.target != A_TARGETS
-            && event.xselectionrequest.target != A_UTF8_STRING) {
-            #ifdef DEBUG
-            printf("Got a selection request with target = %s. We do not support"
-                   "this target\n", target_name);
-            #endif
-
-            xclipboard_respond(event,
-                               None,
-                               A_CLIPBOARD,
-                               event.xselection.target);
+        size_t slot = atom_hash(t->target) & contents->index_mask;
+        while (contents->index[slot] != 0
+               && contents->targets[contents->index[slot] - 1].target
+                  != t->target) {
+            slot = (slot + 1) & contents->index_mask;
+        }
+        contents->index[slot] = i + 1;
+    }
+}
 
-            continue;
+// Returns the data for `target`, or NULL if we don't have the target.
+static struct libxclip_target *contents_find(struct contents *contents,
+                                             Atom target) {
+    if (contents == NULL) {
+        return NULL;
+    }
+    size_t slot = atom_hash(target) & contents->index_mask;
+    while (contents->index[slot] != 0) {
+        struct libxclip_target *t =
+            &contents->targets[contents->index[slot] - 1];
+        if (t->target == target) {
+            return t;
         }
+        slot = (slot + 1) & contents->index_mask;
+    }
+    return NULL;
+}
 
-        #ifdef DEBUG
-        const char *evtstr[36] = {
-            "ProtocolError", "ProtocolReply", "KeyPress", "KeyRelease",
-            "ButtonPress", "ButtonRelease", "MotionNotify", "EnterNotify",
-            "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose",
-            "GraphicsExpose", "NoExpose", "VisibilityNotify", "CreateNotify",
-            "DestroyNotify", "UnmapNotify", "MapNotify", "MapRequest",
-            "ReparentNotify", "ConfigureNotify", "ConfigureRequest",
-            "GravityNotify", "ResizeRequest", "CirculateNotify",
-            "CirculateRequest", "PropertyNotify", "SelectionClear",
-            "SelectionRequest", "SelectionNotify", "ColormapNotify",
-            "ClientMessage", "MappingNotify", "GenericEvent", };
-        printf("We got an unexpected %s event\n", evtstr[event.type]);
-        #endif
+// Calls `target`'s convert callback the first time the target is asked for,
+// and keeps what it gives us for every request after that. Failures aren't
+// kept, the callback gets another go next time. Returns -1 on failure.
+static int contents_convert(struct contents *contents,
+                            struct libxclip_target *target) {
+    if (target->convert == NULL) {
+        return 0;
     }
 
-    // Let everyone know that we're no longer taking care of the selection
-    XSetSelectionOwner(display, A_CLIPBOARD, None, CurrentTime);
+    char *data = NULL;
+    size_t len = 0;
+    if (target->convert(target->target, &data, &len, target->userdata) != 0) {
+        return -1;
+    }
 
+    contents->converted[target - contents->targets] = data;
+    target->data = data;
+    target->len = len;
+    target->convert = NULL;
     return 0;
 }
 
-int libxclip_targets(Display *display,
-                     Atom **targets_ret,
-                     unsigned long *nitems_ret,
-                     struct libxclip_getopts *options) {
-    // re-open the connextion to X. I'm not sure we need this, we're not doing
-    // multithreading or anything, by I _think_ getting a new connection is wise
-    // because we only want xevents related to us.
-    display = XOpenDisplay(XDisplayString(display));
+// Gives the targets (from `first` on) their own copy of their data, all in one
+// allocation. Targets that are converted on demand have no data to copy.
+// Returns -1 on failure.
+static int contents_copy(struct contents *contents, size_t first) {
+    size_t total = 0;
+    for (size_t i = first; i < contents->ntargets; i++) {
+        if (contents->targets[i].convert == NULL) {
+            total += contents->targets[i].len;
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
 
-    // A dummy window to which we can attach a property where the selection
-    // owner can place their response.
-    Window window = XCreateSimpleWindow(display,
-                                        DefaultRootWindow(display),
-                                        0, 0, 1, 1, 0, 0, 0);
+    contents->copy = malloc(total);
+    if (contents->copy == NULL) {
+        return -1;
+    }
+    char *p = contents->copy;
+    for (size_t i = first; i < contents->ntargets; i++) {
+        if (contents->targets[i].convert != NULL) {
+            continue;
+        }
+        memcpy(p, contents->targets[i].data, contents->targets[i].len);
+        contents->targets[i].data = p;
+        p += contents->targets[i].len;
+    }
+    return 0;
+}
 
-    // The property where the selection owner can place their response.
-    Atom property = XInternAtom(display, "LIBXCLIP_OUT", False);
+static struct contents *contents_ref(struct contents *contents) {
+    if (contents != NULL) {
+        contents->refs++;
+    }
+    return contents;
+}
 
-    Atom selection;
-    if (options == NULL || options->selection == 0) {
-        selection = XInternAtom(display, "CLIPBOARD", False);
-    } else {
-        selection = options->selection;
+static void contents_release(struct contents *contents) {
+    if (contents == NULL || --contents->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (contents->mappings[i] != NULL) {
+            munmap(contents->mappings[i], contents->mapping_lens[i]);
+        }
+    }
+    stats_unmap(contents->stats);
+    free((char *) contents->compressed.data);
+    free((char *) contents->shared.data);
+    if (contents->shared_fd != -1) {
+        close(contents->shared_fd);
     }
+    free(contents->copy);
+    for (size_t i = 0; i < contents->ntargets; i++) {
+        free(contents->converted[i]);
+    }
+    free(contents->converted);
+    free(contents->targets);
+    free(contents->index);
+    free(contents);
+}
 
-    // Make the request
-    XConvertSelection(display,
-                      selection,
-                      XInternAtom(display, "TARGETS", False),
-                      property,
-                      window,
-                      CurrentTime);
+// The mode of an in-process owner, which uses the caller's connection and
+// window and is driven by the caller's event loop, see libxclip_owner_create.
+// libxclip_put never starts one.
+enum { OWNER_EMBEDDED = LIBXCLIP_PUT_DAEMON + 1 };
 
-    #ifdef DEBUG
-    printf("Called XConvertSelection, waiting for an XEvent.\n");
-    #endif
+struct owner {
+    xconn *conn;       // The child process' own connection to X.
+    Window window;     // Our dummy window which owns the selection.
+    Atom atoms[ATOM_COUNT];
 
-    // Wait for a response
-    XEvent event;
-    if (options == NULL || options->timeout == 0) {
-        XNextEvent(display, &event);
-    } else {
-        struct timespec timeout;
-        x_millisecs_from_now(options->timeout, &timeout);
-        int ret = XNextEvent_timeout(display, &event, timeout);
+    // As long as we are the selection owner the child process waits for more
+    // SelectionRequest's. However, as soon as we know we're no longer the
+    // owner we stop accepting new SelectionRequest, only sticking around so
+    // that we can complete transfers already in progress.
+    Bool selection_owner;
+
+    // The largest amount of data we can send in one go, i.e. the largest
+    // request the X server accepts less the ChangeProperty request's own
+    // header. How much we actually send in one go is up to the contents'
+    // chunk policy, see owner_chunk_size.
+    size_t max_chunk_size;
+
+    // Keeps track of all ongoing INCR transfers.
+    struct transfer_table transfers;
+    // And, for an embedded owner, of the windows they're to.
+    struct window_table watched;
+
+    // What we serve. The `contents`, and if `stream` isn't NULL whatever the
+    // stream produces as UTF8_STRING.
+    struct contents *contents;
+    struct stream *stream;
+    // Set once a requestor has started receiving the stream, after which no
+    // one else can.
+    Bool stream_taken;
+
+    // The rest is only needed to get the owner going, and to clean up after
+    // an owner thread. A child process leaves the cleaning up to exit.
+    int mode;                  // One of LIBXCLIP_PUT_*, or OWNER_EMBEDDED.
+    Display *parent_display;   // Only valid until setup is done.
+    int notify_fd;             // Where to tell `put` how setup went.
+    int file_fd;               // The file to map as the first target, or -1.
+    struct stream stream_storage;
+
+    // The request with which an embedded owner last took the selection, see
+    // owner_handle_event.
+    unsigned long acquired;
+};
 
-        // Did we timeout?
-        if (ret == -1) {
-            return -1;
-        }
+// Gets `owner` ready to send things over its connection.
+static void owner_init_transfers(struct owner *owner) {
+    // Determine max_chunk_size
+    // In the case that the selections contents is very large we may
+    // have to send the clipboard selection in multiple chunks,
+    // and the maximum chink size is defined by X11
+    //
+    // The extended-length encoding's maximum if X supports it, and the normal
+    // encoding's otherwise. Either way it's in 4 byte units, and includes the
+    // 24 byte header of ChangeProperty (28 with the extended-length encoding).
+    const long max_request_size = xconn_max_request_size(owner->conn);
+    owner->max_chunk_size = max_request_size > 1024
+                            ? (size_t) max_request_size * 4 - 28
+                            : 0;
+    // If this fails for some reason, we fallback to this
+    if (!owner->max_chunk_size) {
+        owner->max_chunk_size = 4096;
     }
 
-    #ifdef DEBUG
-    printf("We got an XEvent.\n");
-    #endif
+    transfer_table_new(&owner->transfers);
+}
 
-    if (event.type != SelectionNotify) {
+// Opens the owner's connection to X and creates its window. Returns -1 if we
+// can't connect.
+static int owner_init(struct owner *owner, Display *parent_display) {
+    // Now that we're in the child process we re-open the connection to the
+    // display I'm not sure how this all works, if this is the correct thing to
+    // do. All I know is if I don't have this I run into problems and
+    // StackOverflow comments suggest that you "need one XOpenDisplay per
+    // thread", and that almost what  we're doing here.
+    xconn *conn = xconn_open(parent_display);
+    if (conn == NULL) {
         #ifdef DEBUG
-        printf("We got an event with type %d which is not a SelectionNotify, "
-               "returning error.\n", event.type);
+        printf("Failed to connect to the display!\n");
         #endif
         return -1;
     }
+    owner->conn = conn;
 
-    if (event.xselection.property == None) {
-        #ifdef DEBUG
-        printf("The SelectionNotify response we got gave None as a property, "
-               "maybe there is no selection owner, or the selection owner is "
-               "unhappy with our request. Return with error.\n");
-        #endif
-        return -1;
-    }
+    // Intern every atom we'll need up front, so that serving requests never
+    // has to make a round trip to the X server just to learn an atom.
+    intern_atoms(conn, owner->atoms);
 
-    if (event.xselection.property != property) {
-        #ifdef DEBUG
-        printf("The SelectionNotify response we got does not pertain to our "
-               "prpoerty. Returning with error.\n");
-        #endif
-        return -1;
-    }
-
-    Atom property_type;
-    int format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    unsigned char *out_buffer;
-
-    // find the size and format of the data in property
-    XGetWindowProperty(display,
-                       window,
-                       property,
-                       0,
-                       0,
-                       False,
-                       AnyPropertyType,
-                       &property_type,
-                       &format,
-                       &nitems,
-                       &bytes_after,
-                       &out_buffer);
-
-    if (property_type != XInternAtom(display, "ATOM", False)) {
-        #ifdef DEBUG
-        printf("Unexpected property_type atom \"%s\".\n",
-               XGetAtomName(display, property_type));
-        #endif
-        return -1;
-    }
-
-    if (format != 32) {
-        #ifdef DEBUG
-        printf("Unexpected format %d.\n", format);
-        #endif
-        return -1;
-    }
-
-    // Actually retrive the data
-    XGetWindowProperty(display,
-                       window,
-                       property,
-                       0,
-                       bytes_after / 4,
-                       False,
-                       AnyPropertyType,
-                       &property_type,
-                       &format,
-                       &nitems,
-                       &bytes_after,
-                       &out_buffer);
-
-    assert(bytes_after == 0);
-
-    // Copy the retrived data to a memory block for the caller to access.
-    unsigned char *copied_buffer = calloc(nitems, sizeof(long));
-    memcpy(copied_buffer, out_buffer, nitems * sizeof(long));
-    XFree(out_buffer);
+    // A dummy window that exists only for us to intercept `SelectionRequest`
+    // events.
+    Window window = xconn_create_window(conn);
+    owner->window = window;
+    // TODO: XCreateSimpleWindow can generate BadAlloc, BadMatch, BadValue, and
+    // BadWindow errors.
+    // https://tronche.com/gui/x/xlib/window/XCreateWindow.html
 
-    *targets_ret = (Atom *) copied_buffer;
-    *nitems_ret = nitems;
+    xconn_select_input(conn, window, PropertyChangeMask);
+    // TODO: XSelectInput() can generate a BadWindow error.
+    // https://tronche.com/gui/x/xlib/event-handling/XSelectInput.html
 
+    owner_init_transfers(owner);
     return 0;
 }
 
-int libxclip_get(Display *display,
-                 char **data_ret,
-                 size_t *size_ret,
-                 struct libxclip_getopts *options) {
-    // re-open the connextion to X. I'm not sure we need this, we're not doing
-    // multithreading or anything, by I _think_ getting a new connection is wise
-    // because we only want xevents related to us.
-    display = XOpenDisplay(XDisplayString(display));
-
-    // A dummy window to which we can attach a property where the selection
-    // owner can place their response.
-    Window window = XCreateSimpleWindow(display,
-                                        DefaultRootWindow(display),
-                                        0, 0, 1, 1, 0, 0, 0);
-
-    // The property where the selection owner can place their response.
-    Atom property = XInternAtom(display, "LIBXCLIP_OUT", False);
-
-    Atom selection;
-    if (options == NULL || options->selection == None) {
-        selection = XInternAtom(display, "CLIPBOARD", False);
+// Where LIBXCLIP_CHUNK_ADAPTIVE starts out, and the smallest it goes.
+static const size_t ADAPTIVE_FIRST_CHUNK_SIZE = 64 * 1024;
+
+// The size of the chunks we send `contents` in, and with LIBXCLIP_CHUNK_FIXED
+// also the most we send without INCR.
+static size_t owner_chunk_size(const struct owner *owner,
+                               const struct contents *contents) {
+    const size_t max = owner->max_chunk_size;
+    size_t size;
+    if (contents->chunk_policy == LIBXCLIP_CHUNK_SERVER_MAX) {
+        size = max;
+    } else if (contents->chunk_policy == LIBXCLIP_CHUNK_ADAPTIVE) {
+        size = ADAPTIVE_FIRST_CHUNK_SIZE;
+    } else if (contents->chunk_size > 0) {
+        size = contents->chunk_size;
     } else {
-        selection = options->selection;
+        // We consider selections larger than a quarter of the maximum
+        // request size to be "large". See ICCCM section 2.5
+        size = max / 4;
     }
+    return size < max ? size : max;
+}
 
-    Atom target;
-    if (options == NULL || options->target == None) {
-        target = XInternAtom(display, "UTF8_STRING", False);
-    } else {
-        target = options->target;
+// Anything larger than this is sent with INCR. Unless the caller fixed the
+// chunk size that's everything that doesn't fit in one request, as one
+// request is as fast as it gets.
+static size_t owner_single_shot_size(const struct owner *owner,
+                                     const struct contents *contents) {
+    if (contents->chunk_policy == LIBXCLIP_CHUNK_FIXED) {
+        return owner_chunk_size(owner, contents);
     }
+    return owner->max_chunk_size;
+}
 
-    // Make the request
-    XConvertSelection(display,
-                      selection,
-                      target,
-                      property,
-                      window,
-                      CurrentTime);
-
-    #ifdef DEBUG
-    printf("Called XConvertSelection, waiting for an XEvent.\n");
-    #endif
-
+// LIBXCLIP_CHUNK_ADAPTIVE: Called when the requestor is ready for the chunk
+// after the one we last sent in `t`. The time that took tells us how many
+// bytes per second it gets through at the current chunk size, and we keep
+// doubling the chunk size for as long as that goes up. Once it doesn't we go
+// back to the last size that did better, and stay there. `elapsed` is how long
+// the requestor took, in seconds.
+static void owner_adapt_chunk_size(const struct owner *owner,
+                                   struct transfer *t,
+                                   double elapsed) {
+    // Only full chunks say anything about the chunk size.
+    if (t->settled || t->last_chunk_size != t->chunk_size) {
+        return;
+    }
 
-    // In the case that the caller specified a timeout we will use this
-    // struct to define the point in time where if we pass it we should
-    // timeout.
-    // TODO: Should we set the timeout at the start of the function?
-    struct timespec timeout;
+    if (elapsed <= 0) {
+        return;
+    }
 
-    // Wait for a response
-    XEvent event;
-    if (options == NULL || options->timeout == -1) {
-        XNextEvent(display, &event);
+    const double rate = t->last_chunk_size / elapsed;
+    if (rate > t->best_rate && t->chunk_size < owner->max_chunk_size) {
+        t->best_rate = rate;
+        t->chunk_size = t->chunk_size * 2 < owner->max_chunk_size
+                        ? t->chunk_size * 2
+                        : owner->max_chunk_size;
     } else {
-        x_millisecs_from_now(options->timeout, &timeout);
-        int ret = XNextEvent_timeout(display, &event, timeout);
-
-        // Did we timeout?
-        if (ret == -1) {
-            return -1;
+        if (rate <= t->best_rate && t->chunk_size > ADAPTIVE_FIRST_CHUNK_SIZE) {
+            t->chunk_size /= 2;
         }
+        t->settled = True;
     }
+}
 
-    #ifdef DEBUG
-    printf("We got an XEvent.\n");
-    #endif
+#if defined(LIBXCLIP_SHM) || defined(LIBXCLIP_ZLIB)
+// Our UTF8_STRING if it's worth offering to other libxclips some faster way
+// than through the X server, or NULL. It isn't when we serve a stream, and when
+// UTF8_STRING fits in one request anyway.
+static const struct libxclip_target *owner_large_text(struct owner *owner) {
+    struct contents *contents = owner->contents;
+    const struct libxclip_target *plain =
+        contents_find(contents, owner->atoms[ATOM_UTF8_STRING]);
+    if (plain == NULL
+        || plain->convert != NULL
+        || plain->len <= owner_single_shot_size(owner, contents)) {
+        return NULL;
+    }
+    return plain;
+}
+#endif
+
+// The compressed copy of UTF8_STRING we offer other libxclips, or NULL if we
+// have none to offer: without zlib, and when owner_large_text says it isn't
+// worth it. The copy is only made once `make` is True, i.e. once someone asks
+// for it.
+//
+// The compressed target is the size of UTF8_STRING as 8 little-endian bytes,
+// followed by UTF8_STRING as a zlib stream, see ctx_receive_compressed.
+static struct libxclip_target *owner_compressed(struct owner *owner,
+                                                Bool make) {
+    #ifdef LIBXCLIP_ZLIB
+    struct contents *contents = owner->contents;
+    const struct libxclip_target *plain = owner_large_text(owner);
+    if (plain == NULL) {
+        return NULL;
+    }
+    if (contents->compressed.data != NULL || !make) {
+        return &contents->compressed;
+    }
 
-    if (event.type != SelectionNotify) {
+    uLongf len = compressBound(plain->len);
+    unsigned char *data = malloc(8 + len);
+    if (data == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < 8; i++) {
+        data[i] = (unsigned char) ((unsigned long long) plain->len >> (8 * i));
+    }
+    // Level 1: we're racing the X server, which is fast.
+    if (compress2(data + 8, &len, (const Bytef *) plain->data, plain->len,
+                  Z_BEST_SPEED) != Z_OK) {
         #ifdef DEBUG
-        printf("We got an event with type %d which is not a SelectionNotify, "
-               "returning error.\n", event.type);
+        printf("Failed to compress UTF8_STRING.\n");
         #endif
-        return -1;
+        free(data);
+        return NULL;
     }
+    contents->compressed.target = owner->atoms[ATOM_LIBXCLIP_ZLIB];
+    contents->compressed.data = (char *) data;
+    contents->compressed.len = 8 + len;
+    return &contents->compressed;
+    #else
+    (void) owner;
+    (void) make;
+    return NULL;
+    #endif
+}
 
-    if (event.xselection.property == None) {
+// Like owner_compressed, but offers UTF8_STRING in a sealed memfd which
+// libxclips on the same host can map, see ctx_receive_shared. Only with
+// LIBXCLIP_SHM.
+static struct libxclip_target *owner_shared(struct owner *owner, Bool make) {
+    #ifdef LIBXCLIP_SHM
+    struct contents *contents = owner->contents;
+    const struct libxclip_target *plain = owner_large_text(owner);
+    if (plain == NULL) {
+        return NULL;
+    }
+    if (contents->shared.data != NULL || !make) {
+        return &contents->shared;
+    }
+
+    struct shm_descriptor *d = calloc(1, sizeof(struct shm_descriptor));
+    int fd = memfd_create("libxclip-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    struct stat st;
+    if (d == NULL
+        || fd == -1
+        || write_all(fd, plain->data, plain->len) == -1
+        || fcntl(fd, F_ADD_SEALS,
+                 F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+           == -1
+        || fstat(fd, &st) == -1
+        || read_boot_id(d->boot_id) == -1) {
         #ifdef DEBUG
-        printf("The SelectionNotify response we got gave None as a property, "
-               "somehow they're not happy with our request. Returning with "
-               "error.\n");
+        printf("Failed to put UTF8_STRING in shared memory.\n");
         #endif
-        return -1;
+        free(d);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
     }
+    d->magic = SHM_DESCRIPTOR_MAGIC;
+    d->pid = (uint64_t) getpid();
+    d->fd = (uint64_t) fd;
+    d->dev = (uint64_t) st.st_dev;
+    d->ino = (uint64_t) st.st_ino;
+    d->size = (uint64_t) plain->len;
+
+    contents->shared_fd = fd;
+    contents->shared.target = owner->atoms[ATOM_LIBXCLIP_SHM];
+    contents->shared.data = (char *) d;
+    contents->shared.len = sizeof(*d);
+    return &contents->shared;
+    #else
+    (void) owner;
+    (void) make;
+    return NULL;
+    #endif
+}
 
-    if (event.xselection.property != property) {
+// Takes ownership of the selection. Returns -1 on failure.
+static int owner_acquire(struct owner *owner) {
+    xconn *conn = owner->conn;
+
+    // take control of the selection so that we receive
+    // `SelectionRequest` events from other windows
+    // FIXME: Should not use CurrentTime, according to ICCCM section 2.1
+    xconn_set_selection_owner(conn,
+                              owner->atoms[ATOM_CLIPBOARD],
+                              owner->window);
+    // TODO: What errorrs can this generate?
+
+    // Double-check SetSelectionOwner did not "merely appear to succeed"
+    if (xconn_get_selection_owner(conn, owner->atoms[ATOM_CLIPBOARD])
+        != owner->window) {
         #ifdef DEBUG
-        printf("The SelectionNotify response we got does not pertain to our "
-               "property. Returning with error.\n");
+        printf("Failed to take ownership of the selection!\n");
         #endif
         return -1;
     }
+    // TODO: Can XGetSelectionOwner generate an error.
 
-    Atom property_type;
-    int format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    unsigned char *out_buffer;
+    owner->selection_owner = True;
+    return 0;
+}
+
+// The statistics on what `t` is sending, or on the contents we serve if `t`
+// is NULL. NULL if no one asked for any.
+static struct stats_block *owner_stats(const struct owner *owner,
+                                       const struct transfer *t) {
+    const struct contents *contents =
+        t != NULL && t->contents != NULL ? t->contents : owner->contents;
+    return contents != NULL ? contents->stats : NULL;
+}
 
-    // find the size and format of the data in property
-    XGetWindowProperty(display,
+// The _NET_WM_PID of `window`, or 0 if it doesn't have one.
+static long owner_requestor_pid(struct owner *owner, Window window) {
+    Atom type = None;
+    int format = 0;
+    unsigned long nitems = 0;
+    unsigned long bytes_after;
+    unsigned char *data = NULL;
+    xconn_get_property(owner->conn,
                        window,
-                       property,
-                       0,
+                       owner->atoms[ATOM_NET_WM_PID],
                        0,
+                       1,
                        False,
                        AnyPropertyType,
-                       &property_type,
+                       &type,
                        &format,
                        &nitems,
                        &bytes_after,
-                       &out_buffer);
+                       &data);
+    long pid = 0;
+    if (data != NULL) {
+        if (format == 32 && nitems == 1) {
+            pid = *(long *) data;
+        }
+        xconn_free(data);
+    }
+    return pid;
+}
 
-    // The selection owner says the selection is too large to send in one go,
-    // we got to do incermental transfers.
-    if (property_type == XInternAtom(display, "INCR", False)) {
-        // This is the buffer where we'll add data as we recive chunks.
-        struct DynamicBuffer dynamic_buffer;
-        dynamic_buffer_new(&dynamic_buffer);
+// Counts the SelectionRequest `event`. A requestor we haven't seen before gets
+// an entry of its own while there are any left, which costs us a round trip
+// to look up its _NET_WM_PID. That's once per requestor, after that the pid
+// is in its entry, and only when the put asked for statistics.
+static void owner_count_request(struct owner *owner, XEvent *event) {
+    struct stats_block *block = owner_stats(owner, NULL);
+    if (block == NULL) {
+        return;
+    }
+    const Window requestor = event->xselectionrequest.requestor;
+    Bool known = stats_requestor(&block->stats, requestor) != NULL;
+    Bool room = stats_requestor(&block->stats, None) != NULL;
+    const long pid = !known && room ? owner_requestor_pid(owner, requestor)
+                                    : 0;
+
+    struct libxclip_stats *stats = stats_begin(block);
+    stats->requests++;
+    struct libxclip_stats_requestor *r = stats_requestor(stats, requestor);
+    if (r == NULL && room) {
+        r = stats_requestor(stats, None);
+        if (r != NULL) {
+            r->window = requestor;
+            r->pid = pid;
+        }
+    }
+    if (r != NULL) {
+        r->requests++;
+    }
+    stats_end(block);
+}
 
-        while (True) {
-            // We signal to the selection owner that we're ready to recive a
-            // chunk  by deleting the contents of the property were we've told
-            // the selection owner to put their response data into.
-            XDeleteProperty(display, window, property);
-
-            // Wait for a response
-            XEvent event;
-            if (options == NULL || options->timeout == 0) {
-                XNextEvent(display, &event);
-            } else {
-                int ret = XNextEvent_timeout(display, &event, timeout);
+// Counts a conversion to `target` for `requestor`, `len` being how much of
+// the target we've sent so far.
+static void owner_count_conversion(struct owner *owner,
+                                   Window requestor,
+                                   Atom target,
+                                   size_t len) {
+    struct stats_block *block = owner_stats(owner, NULL);
+    struct libxclip_stats *stats = stats_begin(block);
+    if (stats != NULL) {
+        struct libxclip_stats_target *t = stats_target(stats, target);
+        if (t != NULL) {
+            t->requests++;
+        }
+        stats_served(stats, requestor, target, len);
+    }
+    stats_end(block);
+}
 
-                // Did we timeout?
-                if (ret == -1) {
-                    free(dynamic_buffer.ptr);
-                    return -1;
-                }
-            }
+// Counts `delta` more INCR transfers of what `t` sends.
+static void owner_count_transfer(struct owner *owner,
+                                 const struct transfer *t,
+                                 int delta) {
+    struct stats_block *block = owner_stats(owner, t);
+    struct libxclip_stats *stats = stats_begin(block);
+    if (stats != NULL) {
+        stats->active_transfers += delta;
+    }
+    stats_end(block);
+}
 
-            #ifdef DEBUG
-            printf("INCR loop: We got an XEvent.\n");
-            #endif
+// Refuses the SelectionRequest `event`.
+static void owner_refuse(struct owner *owner, XEvent *event) {
+    struct stats_block *block = owner_stats(owner, NULL);
+    struct libxclip_stats *stats = stats_begin(block);
+    if (stats != NULL) {
+        stats->refused++;
+    }
+    stats_end(block);
 
-            // Is the response a SelectionNotify?
-            if (event.type != SelectionNotify) {
-                #ifdef DEBUG
-                printf("INCR loop: We got an event with type %d which is not a "
-                       "SelectionNotify, returning error.\n",
-                       event.type);
-                #endif
-                free(dynamic_buffer.ptr);
-                return -1;
-            }
+    xclipboard_respond(owner->conn,
+                       *event,
+                       None,
+                       owner->atoms[ATOM_CLIPBOARD],
+                       event->xselectionrequest.target);
+}
 
-            // Does the response have a propert?
-            if (event.xselection.property == None) {
-                #ifdef DEBUG
-                printf("INCR loop: The SelectionNotify response we got gave "
-                       "None as a property, somehow they're not happy with our "
-                       "request. Returning with error.\n");
-                #endif
-                free(dynamic_buffer.ptr);
-                return -1;
-            }
+// Has the X server tell us whenever `requestor`, which we're starting an INCR
+// transfer to, deletes one of its window's properties.
+//
+// Which events we get on a window is up to each client, so on a connection of
+// our own we can simply select PropertyChangeMask. An embedded owner shares
+// the caller's connection though, where that would replace whatever the
+// caller selected on the window itself, e.g. when it pastes into one of its
+// own. So there the first transfer to a window looks up what's selected on it
+// and adds PropertyChangeMask to that, and the last one to end puts it back.
+static void owner_select_requestor(struct owner *owner, Window requestor) {
+    xconn *conn = owner->conn;
+    if (owner->mode != OWNER_EMBEDDED) {
+        xconn_select_input(conn, requestor, PropertyChangeMask);
+        // TODO: XSelectInput() can generate a BadWindow error.
+        return;
+    }
+    struct watched_window *w = window_table_add(&owner->watched, requestor);
+    if (w->refs++ > 0) {
+        return;
+    }
+    w->saved_mask = xconn_event_mask(conn, requestor);
+    if ((w->saved_mask & PropertyChangeMask) == 0) {
+        xconn_select_input(conn, requestor,
+                           w->saved_mask | PropertyChangeMask);
+    }
+}
 
-            // Is the response property our property?
-            if (event.xselection.property != property) {
+// Undoes owner_select_requestor once a transfer to `requestor` ends.
+static void owner_unselect_requestor(struct owner *owner, Window requestor) {
+    if (owner->mode != OWNER_EMBEDDED) {
+        return;
+    }
+    struct watched_window *w = window_table_slot(&owner->watched, requestor);
+    if (w->window == None || --w->refs > 0) {
+        return;
+    }
+    // TODO: The requestor may have destroyed the window by now, which makes
+    //       for a BadWindow error.
+    if ((w->saved_mask & PropertyChangeMask) == 0) {
+        xconn_select_input(owner->conn, requestor, w->saved_mask);
+    }
+    window_table_delete(&owner->watched, w);
+}
+
+// Deletes the transfer `t`, letting go of what it was sending.
+static void owner_end_transfer(struct owner *owner, struct transfer *t) {
+    owner_unselect_requestor(owner, t->requestor_window);
+    owner_count_transfer(owner, t, -1);
+    contents_release(t->contents);
+    delete_transfer(&owner->transfers, t);
+}
+
+// Write the next chunk of the transfer `t` into the requestor's property. Once
+// everything has been sent this sends the final empty chunk and deletes the
+// transfer.
+static void owner_send_chunk(struct owner *owner,
+                             XEvent *event,
+                             struct transfer *t) {
+    xconn *conn = owner->conn;
+    const char *this_data;
+    size_t this_chunk_size;
+    Bool stream_chunk = False;
+
+    // How long the requestor took to get back to us for this chunk.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double turnaround = (now.tv_sec - t->sent.tv_sec)
+                              + (now.tv_nsec - t->sent.tv_nsec) / 1e9;
+
+    if (owner->stream != NULL) {
+        // Take the next chunk from the ring, waiting for the producer thread
+        // if it hasn't read it yet.
+        if (stream_wait(owner->stream, 1) == 0) {
+            if (owner->stream->failed) {
+                // There's no way to tell the requestor something went wrong,
+                // the best we can do is not to pretend that what it has got
+                // so far is all there is. So we just stop.
                 #ifdef DEBUG
-                printf("INCR loop: The SelectionNotify response we got does not"
-                       "pertain to our property. Returning with error.\n");
-               #endif
-                free(dynamic_buffer.ptr);
-                return -1;
+                printf("The stream's source failed, abandoning transfer.\n");
+                #endif
+                owner_end_transfer(owner, t);
+                return;
             }
+            this_data = NULL;
+            this_chunk_size = 0;
+        } else {
+            const size_t slot = owner->stream->head % STREAM_RING_SLOTS;
+            this_data = owner->stream->slots[slot];
+            this_chunk_size = owner->stream->lens[slot];
+            stream_chunk = True;
+        }
+    } else {
+        // This should never happen
+        if (t->target->len < t->bytes_transfered) {
+            assert(False);
+        }
 
-            // find the size and format of the data in property
-            XGetWindowProperty(display,
-                               window,
-                               property,
-                               0,
-                               0,
-                               False,
-                               AnyPropertyType,
-                               &property_type,
-                               &format,
-                               &nitems,
-                               &bytes_after,
-                               &out_buffer);
+        owner_adapt_chunk_size(owner, t, turnaround);
 
-            // Did we get an "empty" response? If so this is the selection owner
-            // signaling that the transfer is over.
-            if (bytes_after == 0) {
-                // If this isn't true then me the programmer has made some
-                // misstake
-                assert(nitems == 0);
+        size_t left_to_transfer = t->target->len - t->bytes_transfered;
+        this_chunk_size = t->chunk_size;
+        this_data = t->target->data + t->bytes_transfered;
 
-                #ifdef DEBUG
-                printf("INCR loop: We got the final response indication a "
-                       "complted transfer, returning.\n");
-                #endif
+        // We have no data left to transfer, and we should send one last
+        // empty chunk to signal to the requestor that the transfer is
+        // complete.
+        if (left_to_transfer == 0) {
+            this_chunk_size = 0;
+            this_data = 0;
+        } else if (left_to_transfer < t->chunk_size) {
+            this_chunk_size = left_to_transfer;
+        }
+    }
 
-                *data_ret = dynamic_buffer.ptr;
-                *size_ret = dynamic_buffer.size;
-                // TODO realloc to shrink the buffer
+    const Atom type = t->target != NULL ? t->target->target
+                                        : owner->atoms[ATOM_UTF8_STRING];
+    xconn_change_property(conn,
+                          event->xproperty.window,
+                          t->property,
+                          type,
+                          8,
+                          (unsigned char *) this_data,
+                          (int) this_chunk_size);
+
+    // Xlib (and XCB) is done with the chunk once xconn_change_property
+    // returns, so its slot can be refilled.
+    if (stream_chunk) {
+        stream_pop(owner->stream);
+    }
 
-                return 0;
-            }
+    t->bytes_transfered = t->bytes_transfered + this_chunk_size;
+    clock_gettime(CLOCK_MONOTONIC, &t->sent);
+    t->last_chunk_size = this_chunk_size;
 
-            if (property_type != target) {
-                #ifdef DEBUG
-                printf("INCR loop: Unexpected property_type atom \"%s\".\n",
-                       XGetAtomName(display, property_type));
-                #endif
-                free(dynamic_buffer.ptr);
-                return -1;
-            }
+    struct stats_block *block = owner_stats(owner, t);
+    struct libxclip_stats *stats = stats_begin(block);
+    if (stats != NULL) {
+        stats_served(stats, t->requestor_window, type, this_chunk_size);
+        stats_turnaround(stats, turnaround);
+    }
+    stats_end(block);
 
-            // TODO: should we be able to handle cases when format is 16 and 32?
-            if (format != 8) {
-                #ifdef DEBUG
-                printf("INCR loop: Unexpected format %d for property data",
-                       format);
-                #endif
-                free(dynamic_buffer.ptr);
-                return -1;
-            }
+    // ICCCM 2.7.2 has the requestor learn about each chunk from the
+    // PropertyNotify for its property, so unlike the reply to the request
+    // itself there's no SelectionNotify to send.
 
-            // Actually retrive the data
-            XGetWindowProperty(display,
-                               window,
-                               property,
-                               0,
-                               bytes_after,
-                               False,
-                               AnyPropertyType,
-                               &property_type,
-                               &format,
-                               &nitems,
-                               &bytes_after,
-                               &out_buffer);
+    if (this_chunk_size == 0) {
+        owner_end_transfer(owner, t);
+    }
+}
 
-            assert(bytes_after == 0);
+// Writes `target`, or the stream if `target` is NULL, into `property` on the
+// `requestor` window. In one go if the data is small enough and by starting an
+// INCR transfer otherwise. Returns False if we have to refuse.
+static Bool owner_write_target(struct owner *owner,
+                               Window requestor,
+                               Atom property,
+                               const struct libxclip_target *target) {
+    xconn *conn = owner->conn;
+    const char *data = NULL;
+    size_t len = 0;
+    Atom type = owner->atoms[ATOM_UTF8_STRING];
+    if (target != NULL) {
+        data = target->data;
+        len = target->len;
+        type = target->target;
+    }
 
-            dynamic_buffer_append(&dynamic_buffer, (char *) out_buffer, nitems);
+    if (target == NULL) {
+        // Wait until we either know the stream fits in one chunk, or that it
+        // doesn't. This blocks the event loop, but only until the producer
+        // thread has read (at most) two chunks.
+        size_t filled = 0;
+        if (!owner->stream_taken) {
+            filled = stream_wait(owner->stream, 2);
+        }
 
+        if (owner->stream_taken || owner->stream->failed) {
+            // Someone else has (had) the stream, or it's broken.
             #ifdef DEBUG
-            printf("Did an INCR loop iteration!\n");
+            printf("The stream is not available, refusing.\n");
             #endif
+            return False;
         }
-    }
 
-    if (property_type != target) {
-        #ifdef DEBUG
-        printf("Unexpected property_type atom \"%s\".\n",
-               XGetAtomName(display, property_type));
-        #endif
-        return -1;
+        if (filled <= 1 && owner->stream->eof) {
+            // It all fits in the one chunk, which we hold on to so that this
+            // can be pasted any number of times.
+            data = filled == 0 ? NULL : owner->stream->slots[0];
+            len = filled == 0 ? 0 : owner->stream->lens[0];
+        } else {
+            // We don't know how much there is, but we know there's at least
+            // as much as what we've already buffered, which is more than one
+            // chunk.
+            len = stream_buffered(owner->stream);
+            owner->stream_taken = True;
+        }
     }
 
-    // TODO: should we be able to handle cases when format is 16 and 32?
-    if (format != 8) {
+    // We can send the contents in one chunk
+    // A stream that didn't fit in one of its chunks is always sent with INCR.
+    const size_t single_shot_size =
+        target != NULL ? owner_single_shot_size(owner, owner->contents)
+                       : owner->stream->chunk_size;
+    if (len <= single_shot_size) {
         #ifdef DEBUG
-        printf("Unexpected format %d for property data",
-               format);
+        printf("We can send the response in one chunk\n");
         #endif
-        return -1;
+
+        xconn_change_property(conn,
+                              requestor,
+                              property,
+                              type,
+                              8,
+                              (unsigned char *) data,
+                              (int) len);
+        // TODO: XChangeProperty() can generate BadAlloc, BadAtom, BadMatch,
+        //       BadValue, and BadWindow errors.
+        owner_count_conversion(owner, requestor, type, len);
+        return True;
     }
 
-    // Actually retrive the data
-    XGetWindowProperty(display,
-                       window,
-                       property,
-                       0,
-                       bytes_after,
-                       False,
-                       AnyPropertyType,
-                       &property_type,
-                       &format,
-                       &nitems,
-                       &bytes_after,
-                       &out_buffer);
+    // We have to send the contents in multiple chunks.
+    #ifdef DEBUG
+    printf("We can't send the response in one chunk\n");
+    #endif
 
-    // Copy the retrived data to a memory block for the caller to access.
-    unsigned char *copied_buffer = calloc(nitems, sizeof(unsigned char));
-    memcpy(copied_buffer, out_buffer, nitems);
-    XFree(out_buffer);
+    // The INCR property's value is a lower bound on the number of
+    // bytes we're going to send, ICCCM 2.7.2 INCR Properties. It's
+    // only 32 bits so for (very) large selections we send the
+    // largest lower bound we can.
+    long lower_bound = len > 0xFFFFFFFF ? 0xFFFFFFFF : (long) len;
+    xconn_change_property(conn,
+                          requestor,
+                          property,
+                          owner->atoms[ATOM_INCR],
+                          32,
+                          (unsigned char *) &lower_bound,
+                          1);
+
+    // With the INCR mechanism, we need to know
+    // when the requestor window changes (deletes)
+    // its properties.
+    owner_select_requestor(owner, requestor);
+
+    // Register the transfer, owner_convert has ended any other the requestor
+    // had going on with this property.
+    struct transfer *t = new_transfer(&owner->transfers, requestor, property);
+    t->contents = target != NULL ? contents_ref(owner->contents) : NULL;
+    t->target = target;
+    t->chunk_size = owner_chunk_size(owner, owner->contents);
+    t->settled = owner->contents->chunk_policy != LIBXCLIP_CHUNK_ADAPTIVE
+                 || target == NULL;
+    t->best_rate = 0;
+    t->last_chunk_size = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t->sent);
+    owner_count_transfer(owner, t, 1);
+    owner_count_conversion(owner, requestor, type, 0);
+    return True;
+}
 
-    *data_ret = (char *) copied_buffer;
-    *size_ret = nitems;
+// Writes the list of targets we have into `property` on the `requestor`
+// window. Returns False if we have to refuse.
+static Bool owner_write_targets(struct owner *owner,
+                                Window requestor,
+                                Atom property) {
+    // This is the contents of our resonse: The TARGETS target (duh), MULTIPLE,
+    // UTF8_STRING if we're serving a stream, and every target we have data
+    // for.
+    // TODO: Should we support more targets by default?
+    // Some reasonable targets could be:
+    // - STRING
+    // - TEXT
+    // - text/plain
+    // - text/plain;charset=utf-8
+    struct contents *contents = owner->contents;
+    size_t ntargets = contents != NULL ? contents->ntargets : 0;
+    Atom *types = malloc((ntargets + 5) * sizeof(Atom));
+    if (types == NULL) {
+        return False;
+    }
+    size_t ntypes = 0;
+    types[ntypes++] = owner->atoms[ATOM_TARGETS];
+    types[ntypes++] = owner->atoms[ATOM_MULTIPLE];
+    if (owner->stream != NULL) {
+        types[ntypes++] = owner->atoms[ATOM_UTF8_STRING];
+    }
+    for (size_t i = 0; i < ntargets; i++) {
+        // Skip targets that were given more than once, but for the last time.
+        const Atom t = contents->targets[i].target;
+        if (contents_find(contents, t) == &contents->targets[i]) {
+            types[ntypes++] = t;
+        }
+    }
+    if (contents != NULL && owner_compressed(owner, False) != NULL) {
+        types[ntypes++] = owner->atoms[ATOM_LIBXCLIP_ZLIB];
+    }
+    if (contents != NULL && owner_shared(owner, False) != NULL) {
+        types[ntypes++] = owner->atoms[ATOM_LIBXCLIP_SHM];
+    }
 
-    return 0;
+    // put the response contents into the request's property
+    xconn_change_property(owner->conn,
+                          requestor,
+                          property,
+                          owner->atoms[ATOM_ATOM],
+                          32,
+                          (unsigned char *) types,
+                          (int) ntypes);
+    // TODO: XChangeProperty() can generate BadAlloc, BadAtom, BadMatch,
+    //       BadValue, and BadWindow errors.
+    free(types);
+    owner_count_conversion(owner, requestor, owner->atoms[ATOM_TARGETS], 0);
+    return True;
 }
+
+// Converts the selection into `target`, writing the result into `property` on
+// the `requestor` window. Returns False if we don't have the target (or
+// otherwise have to refuse).
+static Bool owner_convert(struct owner *owner,
+                          Window requestor,
+                          Atom property,
+                          Atom target) {
+    // Should the requestor have an INCR transfer going on with this property
+    // it has given up on it, and asks for something else instead.
+    struct transfer *t = get_transfer(&owner->transfers, requestor, property);
+    if (t != NULL) {
+        owner_end_transfer(owner, t);
+    }
+
+    // Some program asked us what kinds of formats (i.e. targets) we can
+    // send the selection contents in (like utf8, html, png, etc.). This can
+    // happen for instance when a user does CTRL-V in an application,
+    // usually the application wants to know what format the content is in,
+    // for instance if we support a png target maybe the application would
+    // like to insert an image instead of text for the user.
+    if (target == owner->atoms[ATOM_TARGETS]) {
+        return owner_write_targets(owner, requestor, property);
+    }
+
+    // The requestor asked us the send the contents of the selection as a
+    // UTF8 string, and what we have is a stream.
+    if (target == owner->atoms[ATOM_UTF8_STRING] && owner->stream != NULL) {
+        return owner_write_target(owner, requestor, property, NULL);
+    }
+
+    // The requestor asked us the send the contents of the selection as one of
+    // the targets we have. If it's one we convert on demand and haven't yet,
+    // now's the time.
+    struct libxclip_target *found = contents_find(owner->contents, target);
+    if (found == NULL && target == owner->atoms[ATOM_LIBXCLIP_ZLIB]) {
+        found = owner_compressed(owner, True);
+    }
+    if (found == NULL && target == owner->atoms[ATOM_LIBXCLIP_SHM]) {
+        found = owner_shared(owner, True);
+    }
+    if (found == NULL) {
+        return False;
+    }
+    if (contents_convert(owner->contents, found) == -1) {
+        #ifdef DEBUG
+        printf("Failed to convert to the target, refusing.\n");
+        #endif
+        return False;
+    }
+    return owner_write_target(owner, requestor, property, found);
+}
+
+// Answers a request for MULTIPLE, ICCCM 2.6.2. The requestor's property holds
+// a list of (target, property) pairs, each of which we convert like it was a
+// request of its own. Those we can't convert have their property replaced
+// with None, and then we answer them all at once.
+static void owner_send_multiple(struct owner *owner, XEvent *event) {
+    xconn *conn = owner->conn;
+    const Window requestor = event->xselectionrequest.requestor;
+    const Atom property = event->xselectionrequest.property;
+
+    Atom type = None;
+    int format = 0;
+    unsigned long nitems = 0;
+    unsigned long bytes_after;
+    unsigned char *pairs = NULL;
+    if (property != None) {
+        xconn_get_property(conn,
+                           requestor,
+                           property,
+                           0,
+                           0x1FFFFFFF,
+                           False,
+                           AnyPropertyType,
+                           &type,
+                           &format,
+                           &nitems,
+                           &bytes_after,
+                           &pairs);
+    }
+
+    if (type != owner->atoms[ATOM_ATOM_PAIR] || format != 32
+        || nitems % 2 != 0) {
+        #ifdef DEBUG
+        printf("Got a malformed MULTIPLE request, refusing.\n");
+        #endif
+        xconn_free(pairs);
+        owner_refuse(owner, event);
+        return;
+    }
+
+    // Xlib hands us 32 bit items as longs, i.e. as Atoms.
+    Atom *atoms = (Atom *) pairs;
+    for (unsigned long i = 0; i < nitems; i += 2) {
+        if (atoms[i] == owner->atoms[ATOM_MULTIPLE]
+            || atoms[i + 1] == None
+            || !owner_convert(owner, requestor, atoms[i + 1], atoms[i])) {
+            atoms[i + 1] = None;
+        }
+    }
+
+    xconn_change_property(conn,
+                          requestor,
+                          property,
+                          owner->atoms[ATOM_ATOM_PAIR],
+                          32,
+                          pairs,
+                          (int) nitems);
+    xconn_free(pairs);
+
+    xclipboard_respond(conn,
+                       *event,
+                       property,
+                       owner->atoms[ATOM_CLIPBOARD],
+                       owner->atoms[ATOM_MULTIPLE]);
+}
+
+static void owner_handle_event(struct owner *owner, XEvent *event) {
+    xconn *conn = owner->conn;
+    const Atom A_CLIPBOARD = owner->atoms[ATOM_CLIPBOARD];
+
+    if (event->type == SelectionRequest) {
+        owner_count_request(owner, event);
+    }
+
+    // Someone is making a SelectionRequest but we're no longer the
+    // selection's owner. Refuse the request.
+    if (owner->selection_owner == False && event->type == SelectionRequest) {
+        #ifdef DEBUG
+        printf("Got a SelectionRequest when we're no longer the owner, "
+               "refusing.\n");
+        #endif
+
+        owner_refuse(owner, event);
+        return;
+    }
+
+    // FIXME: ICCCM 2.2: check evt.time and refuse requests from
+    // outside the period of time we have owned the selection.
+
+    // We have lost ownership of the selection (for instance the user did a
+    // CTRL-C in some other application).  There is nothing more for us to
+    // do, except complete any ongoing transfers.
+    if (event->type == SelectionClear) {
+        #ifdef DEBUG
+        printf("Got a SelectionClear\n");
+        #endif
+
+        // A daemon takes the selection back on every put, and may do so
+        // before it gets around to the SelectionClear from having lost it
+        // previously. So make sure we really did lose it.
+        if (owner->mode == LIBXCLIP_PUT_DAEMON
+            && xconn_get_selection_owner(conn, owner->atoms[ATOM_CLIPBOARD])
+               == owner->window) {
+            return;
+        }
+
+        // So does an embedded owner, which can't make a round trip in the
+        // caller's event loop. The event's time is when the new owner took
+        // the selection, which we can't compare with a put at CurrentTime,
+        // but its serial is the last of our requests the X server had
+        // processed by then: if it hadn't got to our latest put yet, that put
+        // took the selection back.
+        if (owner->mode == OWNER_EMBEDDED
+            && (event->xselectionclear.window != owner->window
+                || event->xselectionclear.serial < owner->acquired)) {
+            return;
+        }
+
+        owner->selection_owner = False;
+        return;
+    }
+
+    Atom target = None;
+    if (event->type == SelectionRequest) {
+        target = event->xselectionrequest.target;
+    }
+
+    if (event->type == SelectionRequest
+        && target == owner->atoms[ATOM_MULTIPLE]) {
+        #ifdef DEBUG
+        printf("Got a selection request with target = MULTIPLE\n");
+        #endif
+
+        owner_send_multiple(owner, event);
+        return;
+    }
+
+    if (event->type == SelectionRequest) {
+        // Obsolete requestors leave out the property, in which case the
+        // target is to be used as the property, ICCCM 2.2.
+        Atom property = event->xselectionrequest.property;
+        if (property == None) {
+            property = target;
+        }
+
+        if (owner_convert(owner,
+                          event->xselectionrequest.requestor,
+                          property,
+                          target)) {
+            #ifdef DEBUG
+            printf("Got a selection request with target = %lu\n",
+                   target);
+            #endif
+
+            xclipboard_respond(conn, *event, property, A_CLIPBOARD, target);
+            return;
+        }
+    }
+
+    // It _may_ be the case that some requestor is asking us to send another
+    // chunk
+    if (event->type == PropertyNotify
+        && event->xproperty.state == PropertyDelete) {
+        #ifdef DEBUG
+        printf("Got a PropertyNotify and it's state field is"
+               "PropertyDelete\n");
+        #endif
+
+        struct transfer *t = get_transfer(&owner->transfers,
+                                          event->xproperty.window,
+                                          event->xproperty.atom);
+        if (t == NULL) {
+            #ifdef DEBUG
+            printf("PropertyNotify is not concearning an ongoing transfer"
+                   "of ours, not interested.\n");
+            #endif
+            return;
+        }
+
+        owner_send_chunk(owner, event, t);
+        return;
+    }
+
+    // The target is not something that we support
+    if (event->type == SelectionRequest) {
+        #ifdef DEBUG
+        printf("Got a selection request with target = %lu. We do not support"
+               "this target\n", target);
+        #endif
+
+        owner_refuse(owner, event);
+        return;
+    }
+
+    #ifdef DEBUG
+    const char *evtstr[36] = {
+        "ProtocolError", "ProtocolReply", "KeyPress", "KeyRelease",
+        "ButtonPress", "ButtonRelease", "MotionNotify", "EnterNotify",
+        "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose",
+        "GraphicsExpose", "NoExpose", "VisibilityNotify", "CreateNotify",
+        "DestroyNotify", "UnmapNotify", "MapNotify", "MapRequest",
+        "ReparentNotify", "ConfigureNotify", "ConfigureRequest",
+        "GravityNotify", "ResizeRequest", "CirculateNotify",
+        "CirculateRequest", "PropertyNotify", "SelectionClear",
+        "SelectionRequest", "SelectionNotify", "ColormapNotify",
+        "ClientMessage", "MappingNotify", "GenericEvent", };
+    printf("We got an unexpected %s event\n", evtstr[event->type]);
+    #endif
+}
+
+// Serves the selection until we're no longer its owner and all ongoing
+// transfers have completed.
+static void owner_run(struct owner *owner) {
+    XEvent event;
+    while (True) {
+        // Every event that has already arrived is handled before we flush, so
+        // that a burst of them (PropertyDelete's from several INCR transfers
+        // at once, say) is answered with one write to the X server rather
+        // than one each.
+        if (!xconn_queued(owner->conn)) {
+            xconn_flush(owner->conn);
+
+            // We are no longer the selection owner and we have no ongoing
+            // transfers, time to stop.
+            if (owner->selection_owner == False
+                && owner->transfers.count == 0) {
+                return;
+            }
+        }
+
+        xconn_next_event(owner->conn, &event);
+        #ifdef DEBUG
+        printf("Got an event\n");
+        #endif
+
+        owner_handle_event(owner, &event);
+    }
+}
+
+// Tells `put`, which is waiting for it, whether setup went well. An owner
+// thread shares our file descriptors, so whatever happens `notify_fd` is
+// closed here.
+static void owner_notify(struct owner *owner, Bool ok) {
+    int ret = write(owner->notify_fd, ok ? "1" : "0", 1);
+    close(owner->notify_fd);
+
+    if (ret == -1) {  // inducates an error occured an errno has been set
+        #ifdef DEBUG
+        printf("Error occured writing to pipe :-(\n");
+        #endif
+
+        // TODO: If this happens it means we cannot communicate to the parent
+        // process?? What do we do then?
+    }
+}
+
+// Everything the owner does before it starts serving the selection, the
+// outcome of which it reports to `put` through `owner->notify_fd`.
+//
+// Returns -1 on failure.
+static int owner_setup(struct owner *owner) {
+    // Serving a file we map it into memory rather than reading it, that way
+    // the contents stay in the page cache (shared with everyone else, and
+    // reclaimable) instead of being copied into memory of our own.
+    struct libxclip_target *file_target = &owner->contents->targets[0];
+    if (owner->file_fd != -1 && file_target->len > 0) {
+        void *mapped = mmap(NULL, file_target->len, PROT_READ, MAP_SHARED,
+                            owner->file_fd, 0);
+        if (mapped == MAP_FAILED) {
+            #ifdef DEBUG
+            printf("Failed to mmap the file!\n");
+            #endif
+            owner_notify(owner, False);
+            return -1;
+        }
+        // We (mostly) read the file from start to end.
+        madvise(mapped, file_target->len, MADV_SEQUENTIAL);
+        owner->contents->mappings[0] = mapped;
+        owner->contents->mapping_lens[0] = file_target->len;
+        file_target->data = mapped;
+    }
+    // The child process got a copy of the file descriptor of its own, but an
+    // owner thread shares it with the caller.
+    if (owner->file_fd != -1 && owner->mode == LIBXCLIP_PUT_FORK) {
+        close(owner->file_fd);
+    }
+
+    if (owner_init(owner, owner->parent_display) == -1) {
+        owner_notify(owner, False);
+        return -1;
+    }
+    contents_index(owner->contents, owner->atoms[ATOM_UTF8_STRING]);
+    if (owner_acquire(owner) == -1) {
+        owner_notify(owner, False);
+        return -1;
+    }
+
+    // Threads don't survive fork, so the stream's producer thread is started
+    // here in the child. It gets going on reading ahead right away so that
+    // the first chunk is (hopefully) ready by the time someone pastes.
+    if (owner->stream != NULL
+        && stream_start(owner->stream,
+                        owner_chunk_size(owner, owner->contents)) == -1) {
+        #ifdef DEBUG
+        printf("Failed to start the stream's producer thread!\n");
+        #endif
+        owner_notify(owner, False);
+        return -1;
+    }
+
+    // Now we're ready for the parent process to return to the caller
+    // TODO: We can probably let the parent resume earlier than this, but let's
+    // stay safe for now
+    xconn_sync(owner->conn);
+    owner_notify(owner, True);
+    return 0;
+}
+
+// Releases everything an owner thread holds on to.
+static void owner_destroy(struct owner *owner) {
+    if (owner->conn != NULL) {
+        xconn_destroy_window(owner->conn, owner->window);
+        xconn_close(owner->conn);
+        free(owner->transfers.slots);
+    }
+    if (owner->stream != NULL) {
+        stream_stop(owner->stream);
+    }
+    contents_release(owner->contents);
+    free(owner);
+}
+
+// Where an owner thread starts. It takes care of the selection until some
+// other application takes it, after which it cleans up and exits.
+static void *owner_thread(void *arg) {
+    struct owner *owner = arg;
+
+    if (owner_setup(owner) == 0) {
+        owner_run(owner);
+    }
+
+    #ifdef DEBUG
+    printf("Exiting owner thread.\n");
+    #endif
+    owner_destroy(owner);
+    return NULL;
+}
+
+/*
+ * Owner daemon
+ *
+ * Every libxclip_put in fork mode creates a child process which opens a new
+ * connection to X, creates a window, interns atoms and so on, all of which
+ * adds up when the user copies things in rapid succession. In daemon mode we
+ * instead start one long-lived child process per display, the daemon, which
+ * keeps its connection and window around and takes the selection back on
+ * every put.
+ *
+ * The daemon and the process that started it talk over a socket pair. For
+ * each put we hand the daemon a file descriptor it can map the contents from
+ * (a memfd, or the file itself with libxclip_put_file) together with their
+ * length, the daemon swaps the contents it serves and answers "1" once it
+ * owns the selection, or "0" if something went wrong. Transfers that are in
+ * progress finish sending the contents they started with.
+ *
+ * Once the process that started the daemon goes away (and the socket with
+ * it) the daemon behaves like any other child process: it serves the
+ * selection until someone else takes it.
+ */
+
+// The daemons started by this process, one per display.
+//
+// `daemons_lock` only guards the list, and every daemon's `refs` and `gone`.
+// A put holds its daemon's own `lock` for as long as it waits for the daemon
+// to answer, so that a slow daemon only holds up puts to the same display.
+struct daemon {
+    char *display_name;
+    int sock;
+    struct daemon *next;
+
+    pthread_mutex_t lock;  // Taken for the whole of a daemon_send.
+    size_t refs;           // The number of puts using the daemon.
+    Bool gone;             // Whether it's no longer in the list.
+};
+
+static struct daemon *daemons = NULL;
+static pthread_mutex_t daemons_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Our child processes inherit our ends of the daemons' sockets, and as long
+// as any of them holds on to one the daemon won't notice we're gone. So they
+// close them first thing.
+static void daemons_close_inherited(void) {
+    for (struct daemon *d = daemons; d != NULL; d = d->next) {
+        close(d->sock);
+    }
+}
+
+// How the daemon finds a target in the memfd, see below. An offset of
+// DAEMON_IN_FILE means the target is the file passed along with the memfd.
+// What the memfd starts with.
+struct daemon_header {
+    size_t ntargets;
+    int chunk_policy;
+    size_t chunk_size;
+    size_t stats_offset;  // Where the statistics are, 0 if there are none.
+};
+
+struct daemon_target {
+    Atom target;
+    size_t offset;
+    size_t len;
+};
+
+static const size_t DAEMON_IN_FILE = (size_t) -1;
+
+// Maps `len` bytes of `fd`, or returns NULL if that fails.
+static void *daemon_map(int fd, size_t len) {
+    if (fd == -1 || len == 0) {
+        return NULL;
+    }
+    void *mapped = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(mapped, len, MADV_SEQUENTIAL);
+    return mapped;
+}
+
+// Makes contents out of the memfd (and file) we've been handed, or returns
+// NULL if there's something wrong with them.
+static struct contents *daemon_contents(int fds[2], size_t lens[2]) {
+    char *memory = daemon_map(fds[0], lens[0]);
+    char *file = daemon_map(fds[1], lens[1]);
+
+    size_t ntargets = 0;
+    struct libxclip_target *targets = NULL;
+    struct contents *contents = NULL;
+    if (memory == NULL || (lens[1] > 0 && file == NULL)
+        || lens[0] < sizeof(struct daemon_header)) {
+        goto out;
+    }
+
+    struct daemon_header dh;
+    memcpy(&dh, memory, sizeof(dh));
+    ntargets = dh.ntargets;
+    const size_t header = sizeof(dh)
+                          + ntargets * sizeof(struct daemon_target);
+    if (ntargets > lens[0] / sizeof(struct daemon_target)
+        || header > lens[0]) {
+        goto out;
+    }
+    targets = malloc((ntargets + 1) * sizeof(struct libxclip_target));
+    if (targets == NULL) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < ntargets; i++) {
+        struct daemon_target dt;
+        memcpy(&dt,
+               memory + sizeof(dh) + i * sizeof(struct daemon_target),
+               sizeof(dt));
+
+        targets[i].target = dt.target;
+        targets[i].len = dt.len;
+        if (dt.offset == DAEMON_IN_FILE) {
+            if (dt.len > lens[1]) {
+                goto out;
+            }
+            targets[i].data = file;
+        } else {
+            if (dt.offset < header || dt.offset > lens[0]
+                || dt.len > lens[0] - dt.offset) {
+                goto out;
+            }
+            targets[i].data = memory + dt.offset;
+        }
+    }
+
+    // The statistics are past the end of the contents, at the start of a
+    // page, so that we can map them (for writing) on their own.
+    if (dh.stats_offset != 0
+        && (dh.stats_offset < lens[0]
+            || dh.stats_offset % (size_t) sysconf(_SC_PAGESIZE) != 0)) {
+        goto out;
+    }
+
+    contents = contents_new(targets, ntargets);
+    if (contents != NULL) {
+        contents->chunk_policy = dh.chunk_policy;
+        contents->chunk_size = dh.chunk_size;
+        if (dh.stats_offset != 0) {
+            contents->stats = stats_map(fds[0], (off_t) dh.stats_offset);
+        }
+        contents->mappings[0] = memory;
+        contents->mapping_lens[0] = lens[0];
+        contents->mappings[1] = file;
+        contents->mapping_lens[1] = lens[1];
+        memory = NULL;
+        file = NULL;
+    }
+
+out:
+    free(targets);
+    if (memory != NULL) {
+        munmap(memory, lens[0]);
+    }
+    if (file != NULL) {
+        munmap(file, lens[1]);
+    }
+    return contents;
+}
+
+// Takes contents from `sock`, see above. Returns -1 if the socket is closed.
+static int daemon_receive(struct owner *owner, int sock) {
+    size_t lens[2];
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { lens, sizeof(lens) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n == -1 && errno == EINTR) {
+        return 0;
+    }
+    if (n != sizeof(lens)) {
+        return -1;
+    }
+
+    int fds[2] = { -1, -1 };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL
+        && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), (nfds > 2 ? 2 : nfds) * sizeof(int));
+    }
+
+    char ok = '0';
+    struct contents *contents = daemon_contents(fds, lens);
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+
+    if (contents != NULL) {
+        contents_index(contents, owner->atoms[ATOM_UTF8_STRING]);
+        contents_release(owner->contents);
+        owner->contents = contents;
+        ok = owner_acquire(owner) == 0 ? '1' : '0';
+    }
+
+    #ifdef DEBUG
+    printf("Daemon got %zu + %zu bytes of new contents (%c)\n",
+           lens[0], lens[1], ok);
+    #endif
+
+    send(sock, &ok, 1, MSG_NOSIGNAL);
+    return 0;
+}
+
+// The daemon's event loop. Like owner_run, except that it also waits on
+// `sock` and doesn't stop for as long as it's open.
+static void daemon_run(struct owner *owner, int sock) {
+    xconn *conn = owner->conn;
+    Bool connected = True;
+    XEvent event;
+
+    while (True) {
+        if (!connected
+            && owner->selection_owner == False
+            && owner->transfers.count == 0) {
+            return;
+        }
+
+        // Xlib may already have read events that poll can't know about. Like
+        // owner_run we handle all of them before flushing.
+        while (xconn_queued(conn)) {
+            xconn_next_event(conn, &event);
+            owner_handle_event(owner, &event);
+        }
+        xconn_flush(conn);
+
+        struct pollfd fds[2] = {
+            { xconn_fd(conn), POLLIN, 0 },
+            { connected ? sock : -1, POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+
+        if (fds[1].revents != 0 && daemon_receive(owner, sock) == -1) {
+            #ifdef DEBUG
+            printf("The daemon's socket was closed.\n");
+            #endif
+            close(sock);
+            connected = False;
+        }
+    }
+}
+
+// Starts a daemon for `display`. Returns NULL on failure.
+static struct daemon *daemon_spawn(Display *display) {
+    struct daemon *d = calloc(1, sizeof(struct daemon));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->display_name = strdup(XDisplayString(display));
+    if (d->display_name == NULL) {
+        free(d);
+        return NULL;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        free(d->display_name);
+        free(d);
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        __fpurge(stdout);  // See put.
+        daemons_close_inherited();
+        int sucess = chdir("/");
+        if (sucess == -1) {
+            #ifdef DEBUG
+            printf("Failed to move daemon into root directory!?\n");
+            #endif
+        }
+
+        // Any error here shows up as a closed socket in the parent.
+        struct owner *owner = calloc(1, sizeof(struct owner));
+        if (owner == NULL) {
+            _Exit(1);
+        }
+        owner->mode = LIBXCLIP_PUT_DAEMON;
+        owner->file_fd = -1;
+        if (owner_init(owner, display) == -1) {
+            _Exit(1);
+        }
+        daemon_run(owner, sv[1]);
+
+        #ifdef DEBUG
+        printf("Exiting daemon.\n");
+        #endif
+        _Exit(3);
+    }
+
+    close(sv[1]);
+    if (pid == -1) {
+        close(sv[0]);
+        free(d->display_name);
+        free(d);
+        return NULL;
+    }
+
+    d->sock = sv[0];
+    pthread_mutex_init(&d->lock, NULL);
+    return d;
+}
+
+// Lets go of the daemon `d`, which a put took from the list. If the put found
+// it `dead` it's taken off the list, and once no put is using it anymore it's
+// freed.
+static void daemon_release(struct daemon *d, Bool dead) {
+    pthread_mutex_lock(&daemons_lock);
+    if (dead && !d->gone) {
+        struct daemon **dp = &daemons;
+        while (*dp != d) {
+            dp = &(*dp)->next;
+        }
+        *dp = d->next;
+        d->gone = True;
+    }
+    const Bool free_it = --d->refs == 0 && d->gone;
+    pthread_mutex_unlock(&daemons_lock);
+
+    if (free_it) {
+        close(d->sock);
+        pthread_mutex_destroy(&d->lock);
+        free(d->display_name);
+        free(d);
+    }
+}
+
+// Hands the daemon `d` its new contents, see above. Returns 0 on success, -1
+// on failure, and -2 if the daemon is gone.
+static int daemon_send(struct daemon *d, int fds[2], size_t lens[2]) {
+    const int nfds = fds[1] == -1 ? 1 : 2;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { lens, 2 * sizeof(size_t) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(d->sock, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        return errno == EPIPE || errno == ECONNRESET ? -2 : -1;
+    }
+
+    char ok;
+    do {
+        n = recv(d->sock, &ok, 1, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return -2;
+    }
+    return ok == '1' ? 0 : -1;
+}
+
+// Puts `contents` on the clipboard through the daemon for `display`, starting
+// it if need be. If `file_fd` isn't -1 the first target is that file. If
+// `handle` isn't NULL it gets the statistics the daemon keeps on the contents.
+static int daemon_put(Display *display,
+                      struct contents *contents,
+                      int file_fd,
+                      libxclip_put_handle *handle) {
+    // The daemon maps the contents from a memfd, which holds how many targets
+    // there are (and how to chunk them), a `struct daemon_target` for each,
+    // and then their data. This
+    // is the only copy of the data we make. A file is handed over as is.
+    // Statistics, if any, go in a page of their own after the data.
+    int fds[2] = { memfd_create("libxclip", MFD_CLOEXEC), file_fd };
+    size_t lens[2] = { 0, 0 };
+    if (fds[0] == -1) {
+        return -1;
+    }
+
+    const size_t ntargets = contents->ntargets;
+    struct daemon_header dh;
+    memset(&dh, 0, sizeof(dh));  // Padding included.
+    dh.ntargets = ntargets;
+    dh.chunk_policy = contents->chunk_policy;
+    dh.chunk_size = contents->chunk_size;
+    size_t offset = sizeof(dh) + ntargets * sizeof(struct daemon_target);
+    if (handle != NULL) {
+        size_t end = offset;
+        for (size_t i = file_fd != -1 ? 1 : 0; i < ntargets; i++) {
+            end += contents->targets[i].len;
+        }
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        dh.stats_offset = (end + page - 1) / page * page;
+    }
+    int ret = write_all(fds[0], &dh, sizeof(dh));
+    for (size_t i = 0; i < ntargets && ret == 0; i++) {
+        struct daemon_target dt = {
+            contents->targets[i].target, offset, contents->targets[i].len
+        };
+        if (i == 0 && file_fd != -1) {
+            dt.offset = DAEMON_IN_FILE;
+            lens[1] = dt.len;
+        } else {
+            offset += dt.len;
+        }
+        ret = write_all(fds[0], &dt, sizeof(dt));
+    }
+    for (size_t i = file_fd != -1 ? 1 : 0; i < ntargets && ret == 0; i++) {
+        ret = write_all(fds[0], contents->targets[i].data,
+                        contents->targets[i].len);
+    }
+    lens[0] = offset;
+    if (ret == 0 && handle != NULL) {
+        ret = ftruncate(fds[0], (off_t) (dh.stats_offset
+                                         + sizeof(struct stats_block)));
+        handle->block = stats_map(fds[0], (off_t) dh.stats_offset);
+        if (handle->block == NULL) {
+            ret = -1;
+        }
+    }
+    if (ret == -1) {
+        close(fds[0]);
+        return -1;
+    }
+
+    const char *display_name = XDisplayString(display);
+    ret = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        pthread_mutex_lock(&daemons_lock);
+        struct daemon **dp = &daemons;
+        while (*dp != NULL
+               && strcmp((*dp)->display_name, display_name) != 0) {
+            dp = &(*dp)->next;
+        }
+        if (*dp == NULL) {
+            *dp = daemon_spawn(display);
+        }
+        struct daemon *d = *dp;
+        if (d != NULL) {
+            d->refs++;
+        }
+        pthread_mutex_unlock(&daemons_lock);
+        if (d == NULL) {
+            break;
+        }
+
+        // Another put that found the daemon dead may have taken it off the
+        // list while we waited for it.
+        pthread_mutex_lock(&d->lock);
+        ret = d->gone ? -2 : daemon_send(d, fds, lens);
+        pthread_mutex_unlock(&d->lock);
+        daemon_release(d, ret == -2);
+        if (ret != -2) {
+            break;
+        }
+
+        // The daemon died on us, so we forget about it and start a new one.
+        #ifdef DEBUG
+        printf("The daemon is gone, starting a new one.\n");
+        #endif
+        ret = -1;
+    }
+
+    close(fds[0]);
+    return ret;
+}
+
+
+
+/*
+ * Putting things on the clipboard
+ *
+ * Depending on the mode the selection is served by a child process, a thread
+ * in our own process, or the daemon, see above.
+ */
+
+// Makes the contents for a put: `data` as UTF8_STRING (target None for now,
+// see contents_index) followed by the caller's targets. There's no `data` if
+// we serve a stream, or if the caller only gave us targets (and NULL for
+// `data`). If `file_fd` isn't -1 the first target is the file.
+static struct contents *put_contents(const char *data,
+                                     size_t len,
+                                     Bool from_stream,
+                                     int file_fd,
+                                     libxclip_putopts *options) {
+    const Bool has_data = !from_stream
+        && (data != NULL || file_fd != -1 || options->ntargets == 0);
+    const size_t ntargets = options->ntargets + (has_data ? 1 : 0);
+
+    struct libxclip_target *targets =
+        malloc((ntargets + 1) * sizeof(struct libxclip_target));
+    if (targets == NULL) {
+        return NULL;
+    }
+    if (has_data) {
+        targets[0].target = None;
+        targets[0].data = data;
+        targets[0].len = len;
+    }
+    if (options->ntargets > 0) {
+        memcpy(targets + (has_data ? 1 : 0),
+               options->targets,
+               options->ntargets * sizeof(struct libxclip_target));
+    }
+
+    struct contents *contents = contents_new(targets, ntargets);
+    free(targets);
+    if (contents != NULL) {
+        contents->chunk_policy = options->chunk_policy;
+        contents->chunk_size = options->chunk_size;
+    }
+    return contents;
+}
+
+// Creates a block of statistics, mapped once for `handle` and once for the
+// owner. Returns -1 on failure.
+static int stats_create(libxclip_put_handle *handle,
+                        struct stats_block **block_ret) {
+    int fd = memfd_create("libxclip-stats", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct stats_block)) == 0) {
+        handle->block = stats_map(fd, 0);
+        *block_ret = stats_map(fd, 0);
+    }
+    close(fd);
+    return handle->block != NULL && *block_ret != NULL ? 0 : -1;
+}
+
+// See put. Statistics go to `handle`, unless it's NULL.
+static int put_owner(Display *display,
+                     const char *data,
+                     size_t len,
+                     struct stream *stream,
+                     int file_fd,
+                     libxclip_putopts *options,
+                     libxclip_put_handle *handle) {
+    struct contents *contents = put_contents(data, len, stream != NULL,
+                                             file_fd, options);
+    if (contents == NULL) {
+        return -1;
+    }
+
+    // A daemon is handed its contents through a file descriptor, which a
+    // stream doesn't have, and it can't call convert callbacks in our process.
+    // So those are always served by a child process.
+    Bool has_convert = False;
+    for (size_t i = 0; i < contents->ntargets; i++) {
+        has_convert = has_convert || contents->targets[i].convert != NULL;
+    }
+    int mode = options->mode;
+    if (mode == LIBXCLIP_PUT_DAEMON) {
+        if (stream == NULL && !has_convert) {
+            int ret = daemon_put(display, contents, file_fd, handle);
+            contents_release(contents);
+            return ret;
+        }
+        mode = LIBXCLIP_PUT_FORK;
+    } else if (mode != LIBXCLIP_PUT_THREAD) {
+        mode = LIBXCLIP_PUT_FORK;
+    }
+
+    if (handle != NULL && stats_create(handle, &contents->stats) == -1) {
+        contents_release(contents);
+        return -1;
+    }
+
+    struct owner *owner = calloc(1, sizeof(struct owner));
+    if (owner == NULL) {
+        contents_release(contents);
+        return -1;
+    }
+    owner->contents = contents;
+    owner->mode = mode;
+    owner->parent_display = display;
+    owner->file_fd = file_fd;
+    if (stream != NULL) {
+        owner->stream_storage = *stream;
+        owner->stream = &owner->stream_storage;
+    }
+
+    // We'll use these pipes for the child process (or thread) to thell the
+    // parent that it can resume.
+    int pipefd[2];
+    int ret = pipe(pipefd);
+    if (ret == -1) {
+        assert(False);
+    }
+    owner->notify_fd = pipefd[1];
+
+    if (owner->mode == LIBXCLIP_PUT_THREAD) {
+        // The thread serves the selection from our own memory, which the
+        // caller is free to do whatever they want with once we return. So
+        // the thread gets a copy of its own.
+        if (contents_copy(owner->contents, file_fd != -1 ? 1 : 0) == -1) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            contents_release(owner->contents);
+            free(owner);
+            return -1;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, owner_thread, owner);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            contents_release(owner->contents);
+            free(owner);
+            return -1;
+        }
+    } else {
+        // The first thing we do, in an attempt to avoid race conditions,
+        // missed events, and so on, is to create the child process and then
+        // have the parent process freeze until the child process has performed
+        // all it's setup.
+
+        // NB. The selections contents are stored in `data` and the child
+        // process will of course read from this. What happens though in the
+        // case that the parent process exits before the child process is
+        // finished? One might think that all data allocated by the parent
+        // process is freed, including what `data` points to. This is true in
+        // some sense, but `fork` performs a copy-on-write duplication on all of
+        // the heap contents from the parent process to the child process. This
+        // means:
+        // 1) If the parent process never writes to `data` after having called
+        //    `xlipboard_persit` then no copies are made of that data, yet the
+        //    child process still has acess to it after the parent process
+        //    exited. COOL!
+        // 2) If the parent process does write then the `data` is copied, and
+        //    the child process will continue to acess the original contents.
+        // See:
+        // https://unix.stackexchange.com/questions/155017/does-fork-immediately-copy-the-entire-process-heap-in-linux
+        // THAT'S SO COOL
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+
+            // when fork() creates the child process it copies the stack and
+            // the heap from the parent process, including the stdout buffer.
+            // This means that the (copied) stdout buffer is flushed when the
+            // child process terminates, in some cases resulting in mysterious
+            // "double printing". So the child process starts by clearing the
+            // outout buffer to avoid this.
+            __fpurge(stdout);
+            daemons_close_inherited();
+
+            // Move into root, so that we don't cause any problems in case the
+            // directory we're currently in needs to be unmounted
+            int sucess = chdir("/");
+            if (sucess == -1) {
+                #ifdef DEBUG
+                printf("Failed to move child process into root directory!?\n");
+                #endif
+            }
+
+            if (owner_setup(owner) == -1) {
+                _Exit(1);
+            }
+
+            owner_run(owner);
+
+            // We are no longer the selection owner and we have no ongoing
+            // transfers, time to exit this child process.
+            #ifdef DEBUG
+            printf("Exiting child process.\n");
+            #endif
+            _Exit(3);
+        }
+
+        // The child process has its own copy of all of this.
+        if (owner->stream != NULL && owner->stream->fd != -1) {
+            close(owner->stream->fd);
+        }
+        contents_release(owner->contents);
+        free(owner);
+
+        // Close our end of the pipe, so that if the child process exits
+        // without telling us anything read returns instead of blocking
+        // forever.
+        close(pipefd[1]);
+
+        if (pid == -1) {
+            close(pipefd[0]);
+            return -1;
+        }
+    }
+
+    #ifdef DEBUG
+    printf("Waiting for child process to setup before returning to "
+           "caller\n");
+    #endif
+
+    char buf = '0';
+    ret = read(pipefd[0], &buf, 1);
+    close(pipefd[0]);
+
+    if (ret == -1) {  // indactes an error occured and errno has been set
+        #ifdef DEBUG
+        printf("Error occured reading from pipe :-(\n");
+        assert(False);
+        #endif
+
+        // TODO: do something to indicate an error occured?
+    }
+
+    // The child process writes "1" once it's done with its setup, if we
+    // got anything else (or nothing at all) the setup failed.
+    if (buf != '1') {
+        #ifdef DEBUG
+        printf("Child process failed to setup\n");
+        #endif
+        return -1;
+    }
+
+    #ifdef DEBUG
+    printf("Child process is done with setup\n");
+    #endif
+
+    return 0;
+}
+
+// Does the work of libxclip_put, libxclip_put_stream and libxclip_put_file.
+// If `stream` isn't NULL it's what we serve as UTF8_STRING, if `file_fd` isn't
+// -1 we serve the first `len` bytes of that file, and otherwise we serve
+// `data`. Plus whatever targets are in `options`.
+static int put(Display *display,
+               const char *data,
+               size_t len,
+               struct stream *stream,
+               int file_fd,
+               libxclip_putopts *options) {
+    struct libxclip_putopts default_options;
+    if (options == NULL) {
+        libxclip_putopts_initialize(&default_options);
+        options = &default_options;
+    }
+    if (options->handle_ret == NULL) {
+        return put_owner(display, data, len, stream, file_fd, options, NULL);
+    }
+
+    *options->handle_ret = NULL;
+    libxclip_put_handle *handle = calloc(1, sizeof(libxclip_put_handle));
+    if (handle == NULL) {
+        return -1;
+    }
+    if (put_owner(display, data, len, stream, file_fd, options, handle)
+        == -1) {
+        libxclip_put_handle_destroy(handle);
+        return -1;
+    }
+    *options->handle_ret = handle;
+    return 0;
+}
+
+/*
+ * Initializer for libxclip_putopts
+ */
+void libxclip_putopts_initialize(libxclip_putopts *options) {
+    options->mode = LIBXCLIP_PUT_FORK;
+    options->targets = NULL;
+    options->ntargets = 0;
+    options->chunk_policy = LIBXCLIP_CHUNK_FIXED;
+    options->chunk_size = 0;  // 0 = a quarter of the largest request
+    options->handle_ret = NULL;  // NULL = no statistics
+}
+
+int libxclip_put(Display *display,
+                 char *data,
+                 size_t len,
+                 libxclip_putopts *options) {
+    return put(display, data, len, NULL, -1, options);
+}
+
+int libxclip_put_stream(Display *display,
+                        libxclip_source source,
+                        void *userdata,
+                        libxclip_putopts *options) {
+    struct stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.source = source;
+    stream.userdata = userdata;
+    stream.fd = -1;
+    return put(display, NULL, 0, &stream, -1, options);
+}
+
+int libxclip_put_fd(Display *display, int fd, libxclip_putopts *options) {
+    struct stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.source = fd_source;
+    // An owner thread (unlike a child process) shares our file descriptors,
+    // so it gets one of its own that the caller can't close from under it.
+    stream.fd = -1;
+    if (options != NULL && options->mode == LIBXCLIP_PUT_THREAD) {
+        stream.fd = dup(fd);
+        if (stream.fd == -1) {
+            return -1;
+        }
+        fd = stream.fd;
+    }
+    stream.userdata = (void *) (intptr_t) fd;
+    return put(display, NULL, 0, &stream, -1, options);
+}
+
+int libxclip_put_file_fd(Display *display,
+                         int fd,
+                         libxclip_putopts *options) {
+    // We can only map regular files, anything else (pipes, sockets, ...) has
+    // to go through libxclip_put_fd.
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+
+    return put(display, NULL, (size_t) st.st_size, NULL, fd, options);
+}
+
+int libxclip_put_file(Display *display,
+                      const char *path,
+                      libxclip_putopts *options) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int ret = libxclip_put_file_fd(display, fd, options);
+    close(fd);
+    return ret;
+}
+
+
+
+/*
+ * Requestor context
+ *
+ * Both libxclip_get and libxclip_targets need a connection of their own (so
+ * that we only ever see XEvents related to us), a dummy window to which the
+ * selection owner can attach its response, and a handful of atoms. Setting
+ * these up costs a new socket plus several round trips to the X server, so
+ * instead of paying that on every call we keep them in a `libxclip_ctx` which
+ * the caller can hold on to and pass to `libxclip_ctx_get` and
+ * `libxclip_ctx_targets` as many times as they like.
+ *
+ * `libxclip_get` and `libxclip_targets` are just thin wrappers that create a
+ * context, use it once and destroy it again.
+ */
+
+struct libxclip_ctx {
+    xconn *conn;            // Our private connection to X.
+    Window window;          // Where the selection owner puts its responses.
+    Atom atoms[ATOM_COUNT];
+
+    // Set once we've stopped listening to an owner before it was done
+    // answering us, see ctx_begin.
+    Bool abandoned;
+    // Set while a get started with libxclip_ctx_get_start is under way.
+    Bool busy;
+};
+
+// Makes the dummy window to which the selection owner can attach its
+// response.
+static void ctx_create_window(libxclip_ctx *ctx) {
+    ctx->window = xconn_create_window(ctx->conn);
+
+    // INCR chunks (ICCCM 2.7.2) are announced by the PropertyNotify for the
+    // property they're written into, and we can't afford to miss any.
+    xconn_select_input(ctx->conn, ctx->window, PropertyChangeMask);
+}
+
+libxclip_ctx *libxclip_ctx_create(Display *display) {
+    libxclip_ctx *ctx = calloc(1, sizeof(libxclip_ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    // Open a connection of our own. I _think_ getting a new connection is
+    // wise because we only want xevents related to us.
+    ctx->conn = xconn_open(display);
+    if (ctx->conn == NULL) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx_create_window(ctx);
+    intern_atoms(ctx->conn, ctx->atoms);
+
+    return ctx;
+}
+
+void libxclip_ctx_destroy(libxclip_ctx *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    xconn_destroy_window(ctx->conn, ctx->window);
+    xconn_close(ctx->conn);
+    free(ctx);
+}
+
+// Called when we give up on a request before the owner is done answering it:
+// it timed out, or the sink asked us to stop in the middle of an INCR
+// transfer. The owner may well go on writing into our property, and answer a
+// request we've stopped waiting for.
+static void ctx_abandon(libxclip_ctx *ctx) {
+    ctx->abandoned = True;
+}
+
+// Gets `ctx` ready for a new request, or returns -1 with errno set to EBUSY if
+// an asynchronous get is still under way on it: that get reads (and drops)
+// every event on the connection, and its answer goes into the same property
+// as ours.
+//
+// If the last request was abandoned the owner
+// might still write into our window's properties, and answer the request we
+// gave up on, so we move on to a new window it knows nothing about. Whatever
+// turns up for the old one is skipped, see ctx_answers_us. (New properties
+// would do too, but the X server never forgets an atom, so a long-lived
+// context would keep adding to them.)
+static int ctx_begin(libxclip_ctx *ctx) {
+    if (ctx->busy) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!ctx->abandoned) {
+        return 0;
+    }
+    ctx->abandoned = False;
+    xconn_destroy_window(ctx->conn, ctx->window);
+    ctx_create_window(ctx);
+
+    // Nothing that has already arrived is for the new window.
+    XEvent event;
+    while (xconn_queued(ctx->conn)) {
+        xconn_next_event(ctx->conn, &event);
+    }
+    return 0;
+}
+
+// Whether the SelectionNotify `event` answers a request we made from our
+// current window. Anything else is an answer to an abandoned request.
+static Bool ctx_answers_us(const libxclip_ctx *ctx,
+                           const XSelectionEvent *event) {
+    return event->requestor == ctx->window;
+}
+
+// Waits for the SelectionNotify which answers our XConvertSelection of
+// `selection` into `target`.
+//
+// Because the context is reused a SelectionNotify meant for an earlier call
+// (one that timed out, say) may still turn up, so we skip over any event that
+// isn't an answer to the request we just made, see ctx_begin.
+//
+// If `timeout` is NULL we wait forever, otherwise it's expected to have been
+// generated by `x_millisecs_from_now` (or `deadline_from_options`).
+//
+// Returns -1 if it timed out (abandoning the request), 0 otherwise.
+static int ctx_wait_selection_notify(libxclip_ctx *ctx,
+                                     Atom selection,
+                                     Atom target,
+                                     struct timespec *timeout,
+                                     XEvent *event_ret) {
+    while (True) {
+        if (timeout == NULL) {
+            xconn_next_event(ctx->conn, event_ret);
+        } else if (XNextEvent_timeout(ctx->conn, event_ret, *timeout)
+                   == -1) {
+            ctx_abandon(ctx);
+            return -1;
+        }
+
+        if (event_ret->type == SelectionNotify
+            && event_ret->xselection.selection == selection
+            && event_ret->xselection.target == target
+            && ctx_answers_us(ctx, &event_ret->xselection)) {
+            return 0;
+        }
+
+        #ifdef DEBUG
+        printf("Skipping an event with type %d that isn't an answer to our "
+               "request.\n", event_ret->type);
+        #endif
+    }
+}
+
+// Waits for the owner to write the next INCR chunk into `property` on our
+// window. Returns -1 if it timed out (abandoning the request), 0 otherwise.
+static int ctx_wait_new_value(libxclip_ctx *ctx,
+                              Atom property,
+                              struct timespec *timeout) {
+    XEvent event;
+    while (True) {
+        if (timeout == NULL) {
+            xconn_next_event(ctx->conn, &event);
+        } else if (XNextEvent_timeout(ctx->conn, &event, *timeout) == -1) {
+            ctx_abandon(ctx);
+            return -1;
+        }
+
+        if (event.type == PropertyNotify
+            && event.xproperty.window == ctx->window
+            && event.xproperty.atom == property
+            && event.xproperty.state == PropertyNewValue) {
+            return 0;
+        }
+    }
+}
+
+// Reads and deletes `property` on our window, all of it in the one request
+// since we ask for more than any property can hold. Deleting it is also what
+// tells the owner we're ready for the next INCR chunk. `*data_ret` is to be
+// freed with xconn_free.
+static void ctx_take_property(libxclip_ctx *ctx,
+                              Atom property,
+                              Atom *type_ret,
+                              int *format_ret,
+                              unsigned long *nitems_ret,
+                              unsigned char **data_ret) {
+    unsigned long bytes_after;
+    xconn_get_property(ctx->conn,
+                       ctx->window,
+                       property,
+                       0,
+                       0x1FFFFFFF,
+                       True,
+                       AnyPropertyType,
+                       type_ret,
+                       format_ret,
+                       nitems_ret,
+                       &bytes_after,
+                       data_ret);
+}
+
+int libxclip_targets(Display *display,
+                     Atom **targets_ret,
+                     unsigned long *nitems_ret,
+                     struct libxclip_getopts *options) {
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    int ret = libxclip_ctx_targets(ctx, targets_ret, nitems_ret, options);
+    libxclip_ctx_destroy(ctx);
+    return ret;
+}
+
+int libxclip_get(Display *display,
+                 char **data_ret,
+                 size_t *size_ret,
+                 struct libxclip_getopts *options) {
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    int ret = libxclip_ctx_get(ctx, data_ret, size_ret, options);
+    libxclip_ctx_destroy(ctx);
+    return ret;
+}
+
+int libxclip_ctx_targets(libxclip_ctx *ctx,
+                         Atom **targets_ret,
+                         unsigned long *nitems_ret,
+                         struct libxclip_getopts *options) {
+    if (ctx_begin(ctx) == -1) {
+        return -1;
+    }
+    xconn *conn = ctx->conn;
+    Window window = ctx->window;
+
+    // In the case that the caller specified a timeout this is the point in
+    // time where if we pass it we should timeout, otherwise NULL.
+    struct timespec deadline;
+    struct timespec *timeout = deadline_from_options(options, &deadline);
+
+    // The property where the selection owner can place their response.
+    Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+
+    Atom selection;
+    if (options == NULL || options->selection == 0) {
+        selection = ctx->atoms[ATOM_CLIPBOARD];
+    } else {
+        selection = options->selection;
+    }
+
+    // Make the request
+    xconn_convert_selection(conn,
+                            selection,
+                            ctx->atoms[ATOM_TARGETS],
+                            property,
+                            window);
+
+    #ifdef DEBUG
+    printf("Called XConvertSelection, waiting for an XEvent.\n");
+    #endif
+
+    // Wait for a response
+    XEvent event;
+    int ret = ctx_wait_selection_notify(ctx,
+                                        selection,
+                                        ctx->atoms[ATOM_TARGETS],
+                                        timeout,
+                                        &event);
+
+    // Did we timeout?
+    if (ret == -1) {
+        return -1;
+    }
+
+    #ifdef DEBUG
+    printf("We got an XEvent.\n");
+    #endif
+
+    if (event.xselection.property == None) {
+        #ifdef DEBUG
+        printf("The SelectionNotify response we got gave None as a property, "
+               "maybe there is no selection owner, or the selection owner is "
+               "unhappy with our request. Return with error.\n");
+        #endif
+        return -1;
+    }
+
+    if (event.xselection.property != property) {
+        #ifdef DEBUG
+        printf("The SelectionNotify response we got does not pertain to our "
+               "prpoerty. Returning with error.\n");
+        #endif
+        return -1;
+    }
+
+    Atom property_type;
+    int format;
+    unsigned long nitems;
+    unsigned char *out_buffer;
+
+    // Retrive the data
+    ctx_take_property(ctx, property, &property_type, &format, &nitems,
+                      &out_buffer);
+
+    if (property_type != ctx->atoms[ATOM_ATOM]) {
+        #ifdef DEBUG
+        printf("Unexpected property_type atom %lu.\n", property_type);
+        #endif
+        xconn_free(out_buffer);
+        return -1;
+    }
+
+    if (format != 32) {
+        #ifdef DEBUG
+        printf("Unexpected format %d.\n", format);
+        #endif
+        xconn_free(out_buffer);
+        return -1;
+    }
+
+    // Copy the retrived data to a memory block for the caller to access.
+    unsigned char *copied_buffer = calloc(nitems, sizeof(long));
+    memcpy(copied_buffer, out_buffer, nitems * sizeof(long));
+    xconn_free(out_buffer);
+
+    *targets_ret = (Atom *) copied_buffer;
+    *nitems_ret = nitems;
+
+    return 0;
+}
+
+// Sends our requests for TARGETS, into LIBXCLIP_TARGETS, and for `target`,
+// into LIBXCLIP_OUT, in one go and waits for both answers. That way learning
+// what else the owner has costs no extra exchange with it.
+//
+// `targets_answer_ret` gets the property the owner answered TARGETS in (None
+// if it refused), and `event_ret` its answer for `target`. Returns -1 if it
+// timed out.
+static int ctx_convert_with_targets(libxclip_ctx *ctx,
+                                    Atom selection,
+                                    Atom target,
+                                    struct timespec *timeout,
+                                    Atom *targets_answer_ret,
+                                    XEvent *event_ret) {
+    xconn *conn = ctx->conn;
+    const Atom A_TARGETS = ctx->atoms[ATOM_TARGETS];
+
+    xconn_convert_selection(conn,
+                            selection,
+                            A_TARGETS,
+                            ctx->atoms[ATOM_LIBXCLIP_TARGETS],
+                            ctx->window);
+    xconn_convert_selection(conn,
+                            selection,
+                            target,
+                            ctx->atoms[ATOM_LIBXCLIP_OUT],
+                            ctx->window);
+
+    // Owners normally answer in order, but nothing says they have to.
+    Bool got_targets = False;
+    Bool got_target = False;
+    while (!got_targets || !got_target) {
+        XEvent event;
+        if (timeout == NULL) {
+            xconn_next_event(conn, &event);
+        } else if (XNextEvent_timeout(conn, &event, *timeout) == -1) {
+            ctx_abandon(ctx);
+            return -1;
+        }
+
+        if (event.type != SelectionNotify
+            || event.xselection.selection != selection
+            || !ctx_answers_us(ctx, &event.xselection)) {
+            continue;
+        }
+        if (event.xselection.target == A_TARGETS && !got_targets) {
+            *targets_answer_ret = event.xselection.property;
+            got_targets = True;
+        } else if (event.xselection.target == target && !got_target) {
+            *event_ret = event;
+            got_target = True;
+        }
+    }
+    return 0;
+}
+
+// Reads and deletes the owner's answer to ctx_convert_with_targets' request
+// for TARGETS. Returns the targets, to be freed with xconn_free, and their
+// number in `n_ret`. NULL if there are none.
+static Atom *ctx_take_targets(libxclip_ctx *ctx, unsigned long *n_ret) {
+    Atom type;
+    int format;
+    unsigned long nitems = 0;
+    unsigned long bytes_after;
+    unsigned char *data = NULL;
+    xconn_get_property(ctx->conn,
+                       ctx->window,
+                       ctx->atoms[ATOM_LIBXCLIP_TARGETS],
+                       0,
+                       0x1FFFFFFF,
+                       True,
+                       ctx->atoms[ATOM_ATOM],
+                       &type,
+                       &format,
+                       &nitems,
+                       &bytes_after,
+                       &data);
+    if (format != 32) {
+        nitems = 0;
+    }
+
+    // Xlib hands us 32 bit items as longs, i.e. as Atoms.
+    *n_ret = nitems;
+    return (Atom *) data;
+}
+
+// Whether `target` is one of the `n` in `targets`.
+static Bool targets_contain(const Atom *targets,
+                            unsigned long n,
+                            Atom target) {
+    for (unsigned long i = 0; i < n; i++) {
+        if (targets[i] == target) {
+            return True;
+        }
+    }
+    return False;
+}
+
+// Gets the first of the `n` targets in `preferred` that the selection owner
+// has, returning it in `target_ret` and the SelectionNotify answering our
+// request for it in `event_ret`.
+//
+// Asking for TARGETS, picking a target and then asking for that one would
+// cost two exchanges with the owner one after the other. Usually though the
+// owner has the target we'd like the most, so we ask for both TARGETS and that
+// target right away, in one go. Only if the owner refuses the latter do we
+// consult TARGETS and make a second request.
+//
+// Returns -1 if it timed out or the owner has none of the targets.
+static int ctx_negotiate(libxclip_ctx *ctx,
+                         Atom selection,
+                         const Atom *preferred,
+                         size_t n,
+                         struct timespec *timeout,
+                         Atom *target_ret,
+                         XEvent *event_ret) {
+    Atom targets_answer = None;
+    if (ctx_convert_with_targets(ctx, selection, preferred[0], timeout,
+                                 &targets_answer, event_ret) == -1) {
+        return -1;
+    }
+
+    *target_ret = preferred[0];
+    if (event_ret->xselection.property != None
+        || targets_answer == None) {
+        // Either we've got the target we like the most, or the owner
+        // doesn't tell us what else it has. Either way we're done.
+        xconn_delete_property(ctx->conn, ctx->window,
+                              ctx->atoms[ATOM_LIBXCLIP_TARGETS]);
+        return 0;
+    }
+
+    unsigned long ntargets;
+    Atom *targets = ctx_take_targets(ctx, &ntargets);
+    Atom chosen = None;
+    for (size_t i = 1; i < n && chosen == None; i++) {
+        if (targets_contain(targets, ntargets, preferred[i])) {
+            chosen = preferred[i];
+        }
+    }
+    xconn_free(targets);
+
+    if (chosen == None) {
+        #ifdef DEBUG
+        printf("The selection owner has none of the preferred targets.\n");
+        #endif
+        return -1;
+    }
+
+    *target_ret = chosen;
+    xconn_convert_selection(ctx->conn,
+                            selection,
+                            chosen,
+                            ctx->atoms[ATOM_LIBXCLIP_OUT],
+                            ctx->window);
+    return ctx_wait_selection_notify(ctx, selection, chosen, timeout,
+                                     event_ret);
+}
+
+// Where ctx_receive hands the selection contents as it arrives.
+struct receiver {
+    libxclip_sink sink;
+    // Called once, before any data is handed to `sink`, with (a lower bound
+    // on) the number of bytes that are coming. May be NULL.
+    void (*size_hint)(size_t size_hint, void *userdata);
+    void *userdata;
+};
+
+// Does the rest of ctx_read once we've read (and deleted) the owner's answer,
+// which is `nitems` of `format` in `out_buffer`, of type `property_type`.
+// Takes care of freeing `out_buffer`.
+static int ctx_read_value(libxclip_ctx *ctx,
+                          const struct receiver *receiver,
+                          Atom target,
+                          Atom property_type,
+                          int format,
+                          unsigned long nitems,
+                          unsigned char *out_buffer,
+                          struct timespec *timeout) {
+    const Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+
+    // The selection owner says the selection is too large to send in one go,
+    // we got to do incermental transfers.
+    if (property_type == ctx->atoms[ATOM_INCR]) {
+        // The INCR property holds a lower bound on the size of the selection,
+        // which we use to size our buffer. Owners aren't very good at setting
+        // it though, so if there is none we'll make do without.
+        size_t size_hint = 0;
+        if (format == 32 && nitems == 1) {
+            // Xlib hands us 32 bit items as longs
+            size_hint = (unsigned long) *(long *) out_buffer & 0xFFFFFFFF;
+        }
+        xconn_free(out_buffer);
+
+        if (receiver->size_hint != NULL) {
+            receiver->size_hint(size_hint, receiver->userdata);
+        }
+
+        // Having deleted the INCR property we've told the selection owner
+        // we're ready for the first chunk, and every chunk we read (and
+        // delete) asks for the next one. So it's one request per chunk.
+        while (True) {
+            // Wait for the owner to write the next chunk, the deadline is the
+            // same one as for the whole call.
+            if (ctx_wait_new_value(ctx, property, timeout) == -1) {
+                return -1;
+            }
+
+            #ifdef DEBUG
+            printf("INCR loop: We got a new chunk.\n");
+            #endif
+
+            ctx_take_property(ctx, property, &property_type, &format, &nitems,
+                              &out_buffer);
+
+            // Gone already, this wasn't about the chunk we're waiting for.
+            if (property_type == None) {
+                continue;
+            }
+
+            // Did we get an "empty" response? If so this is the selection owner
+            // signaling that the transfer is over.
+            if (nitems == 0) {
+                xconn_free(out_buffer);
+
+                #ifdef DEBUG
+                printf("INCR loop: We got the final response indication a "
+                       "complted transfer, returning.\n");
+                #endif
+
+                return 0;
+            }
+
+            if (property_type != target) {
+                #ifdef DEBUG
+                printf("INCR loop: Unexpected property_type atom %lu.\n",
+                       property_type);
+                #endif
+                xconn_free(out_buffer);
+                ctx_abandon(ctx);
+                return -1;
+            }
+
+            // TODO: should we be able to handle cases when format is 16 and 32?
+            if (format != 8) {
+                #ifdef DEBUG
+                printf("INCR loop: Unexpected format %d for property data",
+                       format);
+                #endif
+                xconn_free(out_buffer);
+                ctx_abandon(ctx);
+                return -1;
+            }
+
+            int stop = receiver->sink((char *) out_buffer,
+                                      nitems,
+                                      receiver->userdata);
+            xconn_free(out_buffer);
+
+            if (stop != 0) {
+                #ifdef DEBUG
+                printf("INCR loop: The sink asked us to stop, returning.\n");
+                #endif
+                ctx_abandon(ctx);
+                return -1;
+            }
+
+            #ifdef DEBUG
+            printf("Did an INCR loop iteration!\n");
+            #endif
+        }
+    }
+
+    if (property_type != target) {
+        #ifdef DEBUG
+        printf("Unexpected property_type atom %lu.\n", property_type);
+        #endif
+        xconn_free(out_buffer);
+        return -1;
+    }
+
+    // TODO: should we be able to handle cases when format is 16 and 32?
+    if (format != 8) {
+        #ifdef DEBUG
+        printf("Unexpected format %d for property data",
+               format);
+        #endif
+        xconn_free(out_buffer);
+        return -1;
+    }
+
+    if (receiver->size_hint != NULL) {
+        receiver->size_hint(nitems, receiver->userdata);
+    }
+
+    int stop = 0;
+    if (nitems > 0) {
+        stop = receiver->sink((char *) out_buffer, nitems, receiver->userdata);
+    }
+    xconn_free(out_buffer);
+
+    return stop == 0 ? 0 : -1;
+}
+
+// Reads the selection in `target` from our property, given the owner's answer
+// `event` to our request for it. See ctx_receive.
+static int ctx_read(libxclip_ctx *ctx,
+                    const struct receiver *receiver,
+                    Atom target,
+                    const XEvent *event,
+                    struct timespec *timeout) {
+    // The property where the selection owner can place their response.
+    Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+
+    if (event->xselection.property == None) {
+        #ifdef DEBUG
+        printf("The SelectionNotify response we got gave None as a property, "
+               "somehow they're not happy with our request. Returning with "
+               "error.\n");
+        #endif
+        return -1;
+    }
+
+    if (event->xselection.property != property) {
+        #ifdef DEBUG
+        printf("The SelectionNotify response we got does not pertain to our "
+               "property. Returning with error.\n");
+        #endif
+        return -1;
+    }
+
+    Atom property_type;
+    int format;
+    unsigned long nitems;
+    unsigned char *out_buffer;
+
+    // Whatever the response turns out to be, one request reads it.
+    ctx_take_property(ctx, property, &property_type, &format, &nitems,
+                      &out_buffer);
+    return ctx_read_value(ctx, receiver, target, property_type, format, nitems,
+                          out_buffer, timeout);
+}
+
+
+
+#ifdef LIBXCLIP_ZLIB
+/*
+ * Compression
+ *
+ * Large contents go through the X server in chunks, one round trip each, which
+ * is the slowest way to paste there is. Text (JSON, CSV, ...) compresses
+ * well though, so when built with zlib an owner with a large UTF8_STRING also
+ * offers it compressed as application/x-libxclip-zlib (see owner_compressed),
+ * and libxclip_get asks for that once it knows the owner has it and
+ * UTF8_STRING is large, see ctx_receive_text. Other clients never ask for it
+ * and keep getting UTF8_STRING as before.
+ *
+ * We inflate each chunk as it arrives and hand the result to the receiver,
+ * which never knows the difference.
+ */
+
+// How much we inflate at a time.
+enum { INFLATE_BUFFER_SIZE = 1 << 18 };
+
+struct inflater {
+    z_stream z;
+    const struct receiver *receiver;  // Where the inflated data goes.
+    char *out;                        // INFLATE_BUFFER_SIZE bytes.
+    unsigned char header[8];          // The size of the inflated data.
+    size_t header_len;
+    Bool done;                        // Whether the zlib stream has ended.
+};
+
+// The sink for the compressed target, which inflates `data` into the
+// receiver's sink.
+static int inflater_sink(const char *data, size_t len, void *userdata) {
+    struct inflater *inflater = userdata;
+    const struct receiver *receiver = inflater->receiver;
+
+    // Once we know how much is coming we can tell the receiver.
+    while (inflater->header_len < 8 && len > 0) {
+        inflater->header[inflater->header_len++] = (unsigned char) *data++;
+        len--;
+        if (inflater->header_len == 8 && receiver->size_hint != NULL) {
+            unsigned long long size = 0;
+            for (int i = 7; i >= 0; i--) {
+                size = size << 8 | inflater->header[i];
+            }
+            receiver->size_hint((size_t) size, receiver->userdata);
+        }
+    }
+
+    // A chunk is never larger than a request, so it fits in a uInt.
+    inflater->z.next_in = (Bytef *) data;
+    inflater->z.avail_in = (uInt) len;
+    while (!inflater->done) {
+        inflater->z.next_out = (Bytef *) inflater->out;
+        inflater->z.avail_out = INFLATE_BUFFER_SIZE;
+        int ret = inflate(&inflater->z, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR) {
+            break;  // It needs more than we have.
+        }
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            return -1;
+        }
+        inflater->done = ret == Z_STREAM_END;
+
+        const size_t produced = INFLATE_BUFFER_SIZE - inflater->z.avail_out;
+        if (produced > 0
+            && receiver->sink(inflater->out, produced, receiver->userdata)
+               != 0) {
+            return -1;
+        }
+        if (inflater->z.avail_in == 0 && inflater->z.avail_out > 0) {
+            break;
+        }
+    }
+
+    // Anything after the end of the stream is garbage.
+    return inflater->z.avail_in == 0 ? 0 : -1;
+}
+
+// Asks the owner of `selection` for the compressed target and, if it has it,
+// hands what it inflates to `receiver`. Returns 1 if the owner doesn't have
+// the compressed target, otherwise like ctx_receive.
+static int ctx_receive_compressed(libxclip_ctx *ctx,
+                                  const struct receiver *receiver,
+                                  Atom selection,
+                                  struct timespec *timeout) {
+    const Atom target = ctx->atoms[ATOM_LIBXCLIP_ZLIB];
+
+    // Everything that can fail is set up first, once the owner has started a
+    // transfer we have to see it through.
+    struct inflater inflater;
+    memset(&inflater, 0, sizeof(inflater));
+    inflater.receiver = receiver;
+    inflater.out = malloc(INFLATE_BUFFER_SIZE);
+    if (inflater.out == NULL) {
+        return -1;
+    }
+    if (inflateInit(&inflater.z) != Z_OK) {
+        free(inflater.out);
+        return -1;
+    }
+
+    xconn_convert_selection(ctx->conn,
+                            selection,
+                            target,
+                            ctx->atoms[ATOM_LIBXCLIP_OUT],
+                            ctx->window);
+    XEvent event;
+    int ret = ctx_wait_selection_notify(ctx, selection, target, timeout,
+                                        &event);
+    if (ret == 0 && event.xselection.property == None) {
+        ret = 1;
+    } else if (ret == 0) {
+        const struct receiver inflating = { inflater_sink, NULL, &inflater };
+        ret = ctx_read(ctx, &inflating, target, &event, timeout);
+        if (ret == 0 && !inflater.done) {
+            ret = -1;
+        }
+    }
+
+    inflateEnd(&inflater.z);
+    free(inflater.out);
+    return ret;
+}
+#endif
+
+
+
+#ifdef LIBXCLIP_SHM
+// Asks the owner of `selection` for UTF8_STRING in shared memory, see "Shared
+// memory" above, and if we can map it hands it to `receiver` in one go.
+// Returns 1 if the owner doesn't have it, or we can't map it, otherwise like
+// ctx_receive.
+static int ctx_receive_shared(libxclip_ctx *ctx,
+                              const struct receiver *receiver,
+                              Atom selection,
+                              struct timespec *timeout) {
+    const Atom target = ctx->atoms[ATOM_LIBXCLIP_SHM];
+    const Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+    xconn_convert_selection(ctx->conn,
+                            selection,
+                            target,
+                            property,
+                            ctx->window);
+    XEvent event;
+    if (ctx_wait_selection_notify(ctx, selection, target, timeout, &event)
+        == -1) {
+        return -1;
+    }
+    if (event.xselection.property != property) {
+        return 1;
+    }
+
+    // The descriptor is small enough to always come in one piece.
+    Atom type;
+    int format;
+    unsigned long nitems;
+    unsigned char *data;
+    ctx_take_property(ctx, property, &type, &format, &nitems, &data);
+    struct shm_descriptor d;
+    const Bool ok = type == target && format == 8 && nitems == sizeof(d);
+    if (ok) {
+        memcpy(&d, data, sizeof(d));
+    }
+    if (data != NULL) {
+        xconn_free(data);
+    }
+
+    char boot_id[40];
+    if (!ok
+        || d.magic != SHM_DESCRIPTOR_MAGIC
+        || d.size == 0
+        || read_boot_id(boot_id) == -1
+        || memcmp(boot_id, d.boot_id, sizeof(boot_id)) != 0) {
+        #ifdef DEBUG
+        printf("The shared memory isn't for us, falling back.\n");
+        #endif
+        return 1;
+    }
+
+    // The pid may be another process in another pid namespace, but then the
+    // file won't be the same one. The seals make sure it stays as it is for
+    // as long as we have it mapped.
+    //
+    // Both numbers come from whoever owns the selection, so the descriptor
+    // could be anything: a FIFO would block a plain open forever, and a
+    // terminal could become our controlling one.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%llu/fd/%llu",
+             (unsigned long long) d.pid, (unsigned long long) d.fd);
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+    if (fd == -1) {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1
+        || !S_ISREG(st.st_mode)
+        || (uint64_t) st.st_dev != d.dev
+        || (uint64_t) st.st_ino != d.ino
+        || (uint64_t) st.st_size != d.size) {
+        close(fd);
+        return 1;
+    }
+    const int seals = fcntl(fd, F_GET_SEALS);
+    const int needed = F_SEAL_SHRINK | F_SEAL_WRITE;
+    if (seals == -1 || (seals & needed) != needed) {
+        close(fd);
+        return 1;
+    }
+    void *mapped = mmap(NULL, d.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return 1;
+    }
+    madvise(mapped, d.size, MADV_SEQUENTIAL);
+
+    if (receiver->size_hint != NULL) {
+        receiver->size_hint(d.size, receiver->userdata);
+    }
+    int stop = receiver->sink(mapped, d.size, receiver->userdata);
+    munmap(mapped, d.size);
+    return stop == 0 ? 0 : -1;
+}
+#endif
+
+
+
+#if defined(LIBXCLIP_SHM) || defined(LIBXCLIP_ZLIB)
+// How much UTF8_STRING there has to be, going by the lower bound in the INCR
+// property, for another exchange with the owner to ask for it some faster way
+// to be worth it.
+static const size_t FAST_TEXT_MIN_SIZE = 1 << 20;
+
+// Gets UTF8_STRING from the owner of `selection`, see ctx_receive.
+//
+// Another libxclip may have a faster way to get it to us, but asking for that
+// blindly would cost every get from any other owner one more exchange. So we
+// ask for TARGETS along with UTF8_STRING, in the same exchange, and only when
+// UTF8_STRING turns out to be large and the owner has a faster target do we
+// leave the INCR transfer of UTF8_STRING unstarted and ask for that instead.
+static int ctx_receive_text(libxclip_ctx *ctx,
+                            const struct receiver *receiver,
+                            Atom selection,
+                            struct timespec *timeout) {
+    xconn *conn = ctx->conn;
+    const Window window = ctx->window;
+    const Atom target = ctx->atoms[ATOM_UTF8_STRING];
+    const Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+
+    Atom targets_answer = None;
+    XEvent event;
+    if (ctx_convert_with_targets(ctx, selection, target, timeout,
+                                 &targets_answer, &event) == -1) {
+        return -1;
+    }
+    if (event.xselection.property != property) {
+        xconn_delete_property(conn, window, ctx->atoms[ATOM_LIBXCLIP_TARGETS]);
+        return ctx_read(ctx, receiver, target, &event, timeout);
+    }
+
+    // Read the answer without deleting it, deleting an INCR property is what
+    // has the owner start the transfer.
+    Atom type;
+    int format;
+    unsigned long nitems;
+    unsigned long bytes_after;
+    unsigned char *data = NULL;
+    xconn_get_property(conn, window, property, 0, 0x1FFFFFFF, False,
+                       AnyPropertyType, &type, &format, &nitems, &bytes_after,
+                       &data);
+    size_t size_hint = 0;
+    if (type == ctx->atoms[ATOM_INCR] && format == 32 && nitems == 1) {
+        size_hint = (unsigned long) *(long *) data & 0xFFFFFFFF;
+    }
+
+    unsigned long ntargets = 0;
+    Atom *targets = NULL;
+    if (size_hint >= FAST_TEXT_MIN_SIZE && targets_answer != None) {
+        targets = ctx_take_targets(ctx, &ntargets);
+    } else {
+        xconn_delete_property(conn, window, ctx->atoms[ATOM_LIBXCLIP_TARGETS]);
+    }
+
+    // A libxclip owner drops the transfer of UTF8_STRING as soon as we ask
+    // for something else in its property. Mapping it beats inflating it.
+    int ret = 1;
+    Bool asked = False;
+    #ifdef LIBXCLIP_SHM
+    if (targets_contain(targets, ntargets, ctx->atoms[ATOM_LIBXCLIP_SHM])) {
+        asked = True;
+        ret = ctx_receive_shared(ctx, receiver, selection, timeout);
+    }
+    #endif
+    #ifdef LIBXCLIP_ZLIB
+    if (ret == 1
+        && targets_contain(targets, ntargets,
+                           ctx->atoms[ATOM_LIBXCLIP_ZLIB])) {
+        asked = True;
+        ret = ctx_receive_compressed(ctx, receiver, selection, timeout);
+    }
+    #endif
+    xconn_free(targets);
+
+    if (ret != 1 || asked) {
+        xconn_free(data);
+    }
+    if (ret != 1) {
+        return ret;
+    }
+    if (asked) {
+        xconn_convert_selection(conn, selection, target, property, window);
+        if (ctx_wait_selection_notify(ctx, selection, target, timeout, &event)
+            == -1) {
+            return -1;
+        }
+        return ctx_read(ctx, receiver, target, &event, timeout);
+    }
+
+    // We'll have it as it is. Deleting the property also starts the
+    // transfer, if it's an INCR one.
+    xconn_delete_property(conn, window, property);
+    return ctx_read_value(ctx, receiver, target, type, format, nitems, data,
+                          timeout);
+}
+#endif
+
+
+
+// Does the actual work of libxclip_ctx_get and libxclip_ctx_get_stream:
+// converts the selection and hands each chunk to the receiver straight out of
+// the reply from the X server, without copying it anywhere first.
+//
+// Returns -1 if the conversion failed, timed out or the sink asked us to stop,
+// and 0 otherwise.
+static int ctx_receive(libxclip_ctx *ctx,
+                       const struct receiver *receiver,
+                       struct libxclip_getopts *options) {
+    if (ctx_begin(ctx) == -1) {
+        return -1;
+    }
+    xconn *conn = ctx->conn;
+    Window window = ctx->window;
+
+    // In the case that the caller specified a timeout this is the point in
+    // time where if we pass it we should timeout, otherwise NULL.
+    struct timespec deadline;
+    struct timespec *timeout = deadline_from_options(options, &deadline);
+
+    // The property where the selection owner can place their response.
+    Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+
+    Atom selection;
+    if (options == NULL || options->selection == None) {
+        selection = ctx->atoms[ATOM_CLIPBOARD];
+    } else {
+        selection = options->selection;
+    }
+
+    Atom target;
+    XEvent event;
+    int ret;
+    if (options != NULL && options->npreferred > 0) {
+        ret = ctx_negotiate(ctx, selection, options->preferred,
+                            options->npreferred, timeout, &target, &event);
+        if (ret == -1) {
+            return -1;
+        }
+    } else {
+        if (options == NULL || options->target == None) {
+            target = ctx->atoms[ATOM_UTF8_STRING];
+        } else {
+            target = options->target;
+        }
+
+        #if defined(LIBXCLIP_SHM) || defined(LIBXCLIP_ZLIB)
+        // The owner may well be another libxclip with a faster way to get
+        // UTF8_STRING to us, see ctx_receive_text.
+        if (target == ctx->atoms[ATOM_UTF8_STRING]) {
+            if (options != NULL) {
+                options->chosen = target;
+            }
+            return ctx_receive_text(ctx, receiver, selection, timeout);
+        }
+        #endif
+
+        // Make the request
+        xconn_convert_selection(conn,
+                                selection,
+                                target,
+                                property,
+                                window);
+
+        #ifdef DEBUG
+        printf("Called XConvertSelection, waiting for an XEvent.\n");
+        #endif
+
+        // Wait for a response
+        ret = ctx_wait_selection_notify(ctx, selection, target, timeout,
+                                        &event);
+
+        // Did we timeout?
+        if (ret == -1) {
+            return -1;
+        }
+    }
+
+    if (options != NULL) {
+        options->chosen = target;
+    }
+
+    return ctx_read(ctx, receiver, target, &event, timeout);
+}
+
+int libxclip_ctx_get_stream(libxclip_ctx *ctx,
+                            libxclip_sink sink,
+                            void *userdata,
+                            struct libxclip_getopts *options) {
+    struct receiver receiver = { sink, NULL, userdata };
+    return ctx_receive(ctx, &receiver, options);
+}
+
+int libxclip_get_stream(Display *display,
+                        libxclip_sink sink,
+                        void *userdata,
+                        struct libxclip_getopts *options) {
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    int ret = libxclip_ctx_get_stream(ctx, sink, userdata, options);
+    libxclip_ctx_destroy(ctx);
+    return ret;
+}
+
+// libxclip_ctx_get is libxclip_ctx_get_stream with a sink that collects all of
+// the chunks into a DynamicBuffer.
+
+static void dynamic_buffer_size_hint(size_t size_hint, void *userdata) {
+    dynamic_buffer_new((struct DynamicBuffer *) userdata, size_hint);
+}
+
+static int dynamic_buffer_sink(const char *data, size_t len, void *userdata) {
+    dynamic_buffer_append((struct DynamicBuffer *) userdata, data, len);
+    return 0;
+}
+
+int libxclip_ctx_get(libxclip_ctx *ctx,
+                     char **data_ret,
+                     size_t *size_ret,
+                     struct libxclip_getopts *options) {
+    // ctx_receive always calls `dynamic_buffer_size_hint` before handing us
+    // any data, which is where the buffer is allocated.
+    struct DynamicBuffer buffer = { NULL, 0, 0 };
+    struct receiver receiver = {
+        dynamic_buffer_sink,
+        dynamic_buffer_size_hint,
+        &buffer,
+    };
+
+    if (ctx_receive(ctx, &receiver, options) == -1) {
+        free(buffer.ptr);
+        return -1;
+    }
+
+    *data_ret = buffer.ptr;
+    *size_ret = buffer.size;
+    // TODO realloc to shrink the buffer
+
+    return 0;
+}
+
+int libxclip_get_multiple(Display *display,
+                          const Atom *targets,
+                          size_t ntargets,
+                          char **data_ret,
+                          size_t *sizes_ret,
+                          Atom *types_ret,
+                          struct libxclip_getopts *options) {
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    if (ctx == NULL) {
+        return -1;
+    }
+
+    int ret = libxclip_ctx_get_multiple(ctx, targets, ntargets, data_ret,
+                                        sizes_ret, types_ret, options);
+    libxclip_ctx_destroy(ctx);
+    return ret;
+}
+
+// Where libxclip_ctx_get_multiple keeps track of each target.
+struct multiple_target {
+    Atom property;
+    Bool incr;  // Whether we're still receiving it with INCR.
+    Atom type;  // What the owner sent it as, None until we know.
+    int format;
+    struct DynamicBuffer buffer;
+};
+
+// Gives up on `t`, as if the owner had refused it.
+static void multiple_fail(libxclip_ctx *ctx, struct multiple_target *t) {
+    // The owner may still be sending us chunks.
+    if (t->incr) {
+        ctx_abandon(ctx);
+    }
+    t->incr = False;
+    t->type = None;
+    free(t->buffer.ptr);
+    t->buffer.ptr = NULL;
+    t->buffer.size = 0;
+}
+
+// Reads and deletes the property of `t`. Returns the property's type, or None
+// if there is no such property.
+static Atom multiple_read(libxclip_ctx *ctx, struct multiple_target *t) {
+    Atom type;
+    int format;
+    unsigned long nitems;
+    unsigned char *data = NULL;
+    ctx_take_property(ctx, t->property, &type, &format, &nitems, &data);
+
+    if (type == ctx->atoms[ATOM_INCR] && !t->incr) {
+        // The INCR property holds a lower bound on the size of the data.
+        size_t size_hint = 0;
+        if (format == 32 && nitems == 1) {
+            size_hint = (unsigned long) *(long *) data & 0xFFFFFFFF;
+        }
+        dynamic_buffer_new(&t->buffer, size_hint);
+        t->incr = True;
+    } else if (t->incr && type != None && nitems == 0) {
+        t->incr = False;  // The final, empty, chunk.
+        if (t->type == None) {
+            t->type = type;
+        }
+    } else if (type != None) {
+        // Every chunk of an INCR transfer has to be the same type as the
+        // first, ICCCM 2.7.2.
+        if (t->type != None && (type != t->type || format != t->format)) {
+            #ifdef DEBUG
+            printf("Got a chunk of type %lu in a transfer of type %lu.\n",
+                   type, t->type);
+            #endif
+            multiple_fail(ctx, t);
+            if (data != NULL) {
+                xconn_free(data);
+            }
+            return type;
+        }
+        t->type = type;
+        t->format = format;
+
+        // Xlib hands us 32 bit items as longs.
+        size_t len = nitems * (format == 32 ? sizeof(long)
+                                            : (size_t) format / 8);
+        if (t->buffer.ptr == NULL) {
+            dynamic_buffer_new(&t->buffer, len);
+        }
+        dynamic_buffer_append(&t->buffer, (char *) data, len);
+    }
+
+    if (data != NULL) {
+        xconn_free(data);
+    }
+    return type;
+}
+
+// Converts the selection into all of `targets` with a single request for
+// MULTIPLE, ICCCM 2.6.2. Each target gets a property of its own on our window,
+// and those the owner sends with INCR we receive side by side, keeping track
+// of them through the PropertyNotify events for their properties.
+int libxclip_ctx_get_multiple(libxclip_ctx *ctx,
+                              const Atom *targets,
+                              size_t ntargets,
+                              char **data_ret,
+                              size_t *sizes_ret,
+                              Atom *types_ret,
+                              struct libxclip_getopts *options) {
+    if (ctx_begin(ctx) == -1) {
+        return -1;
+    }
+    xconn *conn = ctx->conn;
+    Window window = ctx->window;
+
+    struct timespec deadline;
+    struct timespec *timeout = deadline_from_options(options, &deadline);
+
+    Atom selection;
+    if (options == NULL || options->selection == None) {
+        selection = ctx->atoms[ATOM_CLIPBOARD];
+    } else {
+        selection = options->selection;
+    }
+
+    for (size_t i = 0; i < ntargets; i++) {
+        data_ret[i] = NULL;
+        sizes_ret[i] = 0;
+        types_ret[i] = None;
+    }
+    if (ntargets == 0) {
+        return 0;
+    }
+
+    struct multiple_target *ts = calloc(ntargets,
+                                        sizeof(struct multiple_target));
+    char **names = calloc(ntargets, sizeof(char *));
+    Atom *properties = calloc(ntargets, sizeof(Atom));
+    Atom *pairs = calloc(2 * ntargets, sizeof(Atom));
+    int ret = -1;
+    if (ts == NULL || names == NULL || properties == NULL || pairs == NULL) {
+        goto out;
+    }
+
+    // One property per target, all interned in one round trip.
+    for (size_t i = 0; i < ntargets; i++) {
+        names[i] = malloc(40);
+        if (names[i] == NULL) {
+            goto out;
+        }
+        snprintf(names[i], 40, "LIBXCLIP_OUT_%zu", i);
+    }
+    xconn_intern_atoms(conn, names, (int) ntargets, properties);
+    for (size_t i = 0; i < ntargets; i++) {
+        ts[i].property = properties[i];
+        pairs[2 * i] = targets[i];
+        pairs[2 * i + 1] = properties[i];
+    }
+
+    // We see the owner's chunks arrive through the PropertyNotify events
+    // libxclip_ctx_create asked for.
+    xconn_change_property(conn,
+                          window,
+                          ctx->atoms[ATOM_LIBXCLIP_OUT],
+                          ctx->atoms[ATOM_ATOM_PAIR],
+                          32,
+                          (unsigned char *) pairs,
+                          (int) (2 * ntargets));
+    xconn_convert_selection(conn,
+                            selection,
+                            ctx->atoms[ATOM_MULTIPLE],
+                            ctx->atoms[ATOM_LIBXCLIP_OUT],
+                            window);
+
+    XEvent event;
+    if (ctx_wait_selection_notify(ctx,
+                                  selection,
+                                  ctx->atoms[ATOM_MULTIPLE],
+                                  timeout,
+                                  &event) == -1
+        || event.xselection.property == None) {
+        goto out;
+    }
+
+    // The owner replaced the property of every target it couldn't convert
+    // with None.
+    Atom type;
+    int format;
+    unsigned long nitems;
+    unsigned long bytes_after;
+    unsigned char *answer = NULL;
+    xconn_get_property(conn,
+                       window,
+                       ctx->atoms[ATOM_LIBXCLIP_OUT],
+                       0,
+                       (long) (2 * ntargets),
+                       True,
+                       ctx->atoms[ATOM_ATOM_PAIR],
+                       &type,
+                       &format,
+                       &nitems,
+                       &bytes_after,
+                       &answer);
+    if (type != ctx->atoms[ATOM_ATOM_PAIR] || format != 32
+        || nitems != 2 * ntargets) {
+        if (answer != NULL) {
+            xconn_free(answer);
+        }
+        goto out;
+    }
+
+    size_t incr_left = 0;
+    for (size_t i = 0; i < ntargets; i++) {
+        if (((Atom *) answer)[2 * i + 1] != None
+            && multiple_read(ctx, &ts[i]) != None
+            && ts[i].incr) {
+            incr_left++;
+        }
+    }
+    xconn_free(answer);
+
+    // Receive the INCR transfers. Deleting their properties (which
+    // multiple_read did) told the owner to send the first chunk, and every
+    // time we read and delete a chunk it sends the next one.
+    while (incr_left > 0) {
+        if (timeout == NULL) {
+            xconn_next_event(conn, &event);
+        } else if (XNextEvent_timeout(conn, &event, *timeout) == -1) {
+            ctx_abandon(ctx);
+            goto out;
+        }
+
+        if (event.type != PropertyNotify
+            || event.xproperty.window != window
+            || event.xproperty.state != PropertyNewValue) {
+            continue;
+        }
+        for (size_t i = 0; i < ntargets; i++) {
+            if (ts[i].incr && ts[i].property == event.xproperty.atom) {
+                multiple_read(ctx, &ts[i]);
+                if (!ts[i].incr) {
+                    incr_left--;
+                }
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ntargets; i++) {
+        data_ret[i] = ts[i].buffer.ptr;
+        sizes_ret[i] = ts[i].buffer.size;
+        types_ret[i] = ts[i].type;
+        ts[i].buffer.ptr = NULL;
+    }
+    ret = 0;
+
+out:
+    if (ts != NULL) {
+        for (size_t i = 0; i < ntargets; i++) {
+            free(ts[i].buffer.ptr);
+        }
+    }
+    if (names != NULL) {
+        for (size_t i = 0; i < ntargets; i++) {
+            free(names[i]);
+        }
+    }
+    free(ts);
+    free(names);
+    free(properties);
+    free(pairs);
+    return ret;
+}
+
+
+
+/*
+ * Asynchronous get
+ *
+ * libxclip_get blocks until the owner has answered, which an application with
+ * an event loop of its own can't afford. So libxclip_get_start only sends the
+ * request, after which the caller waits for libxclip_get_fd to become
+ * readable (along with whatever else it waits for) and calls
+ * libxclip_get_process, which handles whatever has arrived and returns right
+ * away. Once that says the get is done libxclip_get_finish hands over the
+ * contents.
+ *
+ * Each get has a context of its own and with it its own connection and file
+ * descriptor, so any number of them can be under way at once. The only thing
+ * we ever wait for is the X server answering a GetProperty, never the owner.
+ * A get on the caller's context has that context to itself until it's
+ * finished, see ctx_begin.
+ */
+
+enum { GET_WAITING, GET_INCR, GET_DONE, GET_FAILED };
+
+struct libxclip_get_op {
+    libxclip_ctx *ctx;
+    Bool own_ctx;   // Whether we created `ctx`, and destroy it when done.
+    Atom selection;
+    Atom target;
+    struct timespec deadline;
+    Bool has_deadline;
+    int state;      // One of GET_*.
+    struct DynamicBuffer buffer;
+};
+
+libxclip_get_op *libxclip_ctx_get_start(libxclip_ctx *ctx,
+                                        struct libxclip_getopts *options) {
+    // Picking one of several targets takes more than one request, and would
+    // have to be another state of its own.
+    if (ctx == NULL || (options != NULL && options->npreferred > 0)
+        || ctx_begin(ctx) == -1) {
+        return NULL;
+    }
+    libxclip_get_op *op = calloc(1, sizeof(libxclip_get_op));
+    if (op == NULL) {
+        return NULL;
+    }
+    ctx->busy = True;
+    op->ctx = ctx;
+    op->selection = options == NULL || options->selection == None
+                    ? ctx->atoms[ATOM_CLIPBOARD]
+                    : options->selection;
+    op->target = options == NULL || options->target == None
+                 ? ctx->atoms[ATOM_UTF8_STRING]
+                 : options->target;
+    op->has_deadline = deadline_from_options(options, &op->deadline) != NULL;
+    op->state = GET_WAITING;
+    if (options != NULL) {
+        options->chosen = op->target;
+    }
+
+    xconn_convert_selection(ctx->conn,
+                            op->selection,
+                            op->target,
+                            ctx->atoms[ATOM_LIBXCLIP_OUT],
+                            ctx->window);
+    xconn_flush(ctx->conn);
+    return op;
+}
+
+libxclip_get_op *libxclip_get_start(Display *display,
+                                    struct libxclip_getopts *options) {
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    libxclip_get_op *op = libxclip_ctx_get_start(ctx, options);
+    if (op == NULL) {
+        libxclip_ctx_destroy(ctx);
+        return NULL;
+    }
+    op->own_ctx = True;
+    return op;
+}
+
+int libxclip_get_fd(libxclip_get_op *op) {
+    return xconn_fd(op->ctx->conn);
+}
+
+// Reads our property, which holds the owner's answer (or the next INCR chunk),
+// and moves `op` along accordingly.
+static void get_op_read(libxclip_get_op *op) {
+    libxclip_ctx *ctx = op->ctx;
+    Atom type;
+    int format;
+    unsigned long nitems;
+    unsigned char *data;
+    ctx_take_property(ctx, ctx->atoms[ATOM_LIBXCLIP_OUT], &type, &format,
+                      &nitems, &data);
+
+    if (op->state == GET_WAITING && type == ctx->atoms[ATOM_INCR]) {
+        // See ctx_read.
+        size_t size_hint = 0;
+        if (format == 32 && nitems == 1) {
+            size_hint = (unsigned long) *(long *) data & 0xFFFFFFFF;
+        }
+        dynamic_buffer_new(&op->buffer, size_hint);
+        op->state = GET_INCR;
+    } else if (op->state == GET_INCR && type == None) {
+        // Gone already, this wasn't about the chunk we're waiting for.
+    } else if (type != op->target || format != 8) {
+        #ifdef DEBUG
+        printf("Unexpected property type %lu or format %d.\n", type, format);
+        #endif
+        op->state = GET_FAILED;
+    } else if (op->state == GET_WAITING) {
+        dynamic_buffer_new(&op->buffer, nitems);
+        dynamic_buffer_append(&op->buffer, (char *) data, nitems);
+        op->state = GET_DONE;
+    } else if (nitems == 0) {
+        op->state = GET_DONE;
+    } else {
+        dynamic_buffer_append(&op->buffer, (char *) data, nitems);
+    }
+
+    if (data != NULL) {
+        xconn_free(data);
+    }
+}
+
+int libxclip_get_process(libxclip_get_op *op) {
+    libxclip_ctx *ctx = op->ctx;
+    const Atom property = ctx->atoms[ATOM_LIBXCLIP_OUT];
+
+    // Everything that has arrived, without waiting for anything more.
+    while ((op->state == GET_WAITING || op->state == GET_INCR)
+           && xconn_pending(ctx->conn)) {
+        XEvent event;
+        xconn_next_event(ctx->conn, &event);
+
+        if (op->state == GET_WAITING
+            && event.type == SelectionNotify
+            && event.xselection.selection == op->selection
+            && event.xselection.target == op->target
+            && ctx_answers_us(ctx, &event.xselection)) {
+            if (event.xselection.property != property) {
+                #ifdef DEBUG
+                printf("The owner refused our request.\n");
+                #endif
+                op->state = GET_FAILED;
+            } else {
+                get_op_read(op);
+            }
+        } else if (op->state == GET_INCR
+                   && event.type == PropertyNotify
+                   && event.xproperty.window == ctx->window
+                   && event.xproperty.atom == property
+                   && event.xproperty.state == PropertyNewValue) {
+            get_op_read(op);
+        }
+    }
+
+    if ((op->state == GET_WAITING || op->state == GET_INCR)
+        && op->has_deadline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > op->deadline.tv_sec
+            || (now.tv_sec == op->deadline.tv_sec
+                && now.tv_nsec >= op->deadline.tv_nsec)) {
+            op->state = GET_FAILED;
+        }
+    }
+
+    // Deleting the property is what asks the owner for the next chunk, so it
+    // can't wait in our buffer until the next call.
+    xconn_flush(ctx->conn);
+    return op->state == GET_DONE || op->state == GET_FAILED;
+}
+
+int libxclip_get_finish(libxclip_get_op *op,
+                        char **data_ret,
+                        size_t *size_ret) {
+    int ret = -1;
+    if (op->state == GET_DONE) {
+        *data_ret = op->buffer.ptr;
+        *size_ret = op->buffer.size;
+        op->buffer.ptr = NULL;
+        ret = 0;
+    }
+    free(op->buffer.ptr);
+    op->ctx->busy = False;
+    if (op->own_ctx) {
+        libxclip_ctx_destroy(op->ctx);
+    } else if (op->state != GET_DONE) {
+        ctx_abandon(op->ctx);
+    }
+    free(op);
+    return ret;
+}
+
+
+
+/*
+ * In-process owner
+ *
+ * Instead of a child process, thread or daemon with a connection of its own,
+ * the selection is owned by the caller's own window on the caller's own
+ * connection, and served from the caller's event loop, which hands us every
+ * event through libxclip_handle_event. Everything else (interning atoms, the
+ * transfer table) is set up once, so that a put costs no more than the
+ * SetSelectionOwner request.
+ *
+ * With XCB the owner's requests go out over an xcb_connection_t, which we
+ * can't get from the caller's Display without Xlib-xcb, so there the
+ * in-process owner isn't available.
+ */
+
+struct libxclip_owner {
+    struct owner owner;
+};
+
+libxclip_owner *libxclip_owner_create(Display *display, Window window) {
+    #ifdef LIBXCLIP_XCB
+    (void) display;
+    (void) window;
+    errno = ENOSYS;
+    return NULL;
+    #else
+    libxclip_owner *handle = calloc(1, sizeof(libxclip_owner));
+    if (handle == NULL) {
+        return NULL;
+    }
+    struct owner *owner = &handle->owner;
+    owner->conn = display;
+    owner->window = window;
+    owner->mode = OWNER_EMBEDDED;
+    owner->file_fd = -1;
+    intern_atoms(owner->conn, owner->atoms);
+    owner_init_transfers(owner);
+    return handle;
+    #endif
+}
+
+int libxclip_owner_put(libxclip_owner *handle,
+                       char *data,
+                       size_t len,
+                       libxclip_putopts *options) {
+    struct owner *owner = &handle->owner;
+    struct libxclip_putopts default_options;
+    if (options == NULL) {
+        libxclip_putopts_initialize(&default_options);
+        options = &default_options;
+    }
+
+    // The caller is free to do whatever they want with `data` once we
+    // return, so we serve a copy of our own. Convert callbacks on the other
+    // hand are simply called from the caller's event loop.
+    struct contents *contents = put_contents(data, len, False, -1, options);
+    if (contents == NULL) {
+        return -1;
+    }
+    if (contents_copy(contents, 0) == -1) {
+        contents_release(contents);
+        return -1;
+    }
+    contents_index(contents, owner->atoms[ATOM_UTF8_STRING]);
+
+    libxclip_put_handle *stats_handle = NULL;
+    if (options->handle_ret != NULL) {
+        *options->handle_ret = NULL;
+        stats_handle = calloc(1, sizeof(libxclip_put_handle));
+        if (stats_handle == NULL
+            || stats_create(stats_handle, &contents->stats) == -1) {
+            free(stats_handle);
+            contents_release(contents);
+            return -1;
+        }
+    }
+
+    // Transfers already in progress hold on to the contents they're sending.
+    contents_release(owner->contents);
+    owner->contents = contents;
+
+    // Unlike owner_acquire we don't make a round trip to double-check that
+    // we got the selection. If we didn't, or lose it later, we hear about it
+    // through a SelectionClear.
+    // FIXME: Should not use CurrentTime, according to ICCCM section 2.1
+    #ifndef LIBXCLIP_XCB
+    owner->acquired = NextRequest(owner->conn);
+    #endif
+    xconn_set_selection_owner(owner->conn,
+                              owner->atoms[ATOM_CLIPBOARD],
+                              owner->window);
+    xconn_flush(owner->conn);
+    owner->selection_owner = True;
+
+    if (stats_handle != NULL) {
+        *options->handle_ret = stats_handle;
+    }
+    return 0;
+}
+
+int libxclip_handle_event(libxclip_owner *handle, XEvent *event) {
+    struct owner *owner = &handle->owner;
+    const Atom A_CLIPBOARD = owner->atoms[ATOM_CLIPBOARD];
+
+    // Only what concerns our selection on our window, or one of our
+    // transfers. Everything else is the caller's.
+    Bool ours = False;
+    if (event->type == SelectionRequest) {
+        ours = event->xselectionrequest.owner == owner->window
+            && event->xselectionrequest.selection == A_CLIPBOARD;
+    } else if (event->type == SelectionClear) {
+        ours = event->xselectionclear.window == owner->window
+            && event->xselectionclear.selection == A_CLIPBOARD;
+    } else if (event->type == PropertyNotify
+               && event->xproperty.state == PropertyDelete) {
+        ours = get_transfer(&owner->transfers,
+                            event->xproperty.window,
+                            event->xproperty.atom) != NULL;
+    }
+    if (!ours) {
+        return 0;
+    }
+
+    owner_handle_event(owner, event);
+
+    // The caller's event loop may well be waiting on the connection's file
+    // descriptor rather than in XNextEvent, which would flush for us.
+    xconn_flush(owner->conn);
+    return 1;
+}
+
+void libxclip_owner_destroy(libxclip_owner *handle) {
+    struct owner *owner = &handle->owner;
+    if (owner->selection_owner) {
+        xconn_set_selection_owner(owner->conn,
+                                  owner->atoms[ATOM_CLIPBOARD],
+                                  None);
+        xconn_flush(owner->conn);
+    }
+
+    // Whoever was in the middle of a transfer won't get the rest of it.
+    for (size_t i = 0; i < owner->transfers.capacity; i++) {
+        struct transfer *t = &owner->transfers.slots[i];
+        if (t->requestor_window != None) {
+            owner_count_transfer(owner, t, -1);
+            contents_release(t->contents);
+        }
+    }
+    for (size_t i = 0; i < owner->watched.capacity; i++) {
+        struct watched_window *w = &owner->watched.slots[i];
+        if (w->window != None
+            && (w->saved_mask & PropertyChangeMask) == 0) {
+            xconn_select_input(owner->conn, w->window, w->saved_mask);
+        }
+    }
+    xconn_flush(owner->conn);
+    free(owner->watched.slots);
+    free(owner->transfers.slots);
+    contents_release(owner->contents);
+    free(handle);
+}
+
+
+
+/*
+ * Watching the selections
+ *
+ * Rather than getting the selection over and over to see whether it changed,
+ * the XFixes extension has the X server tell us whenever CLIPBOARD or PRIMARY
+ * gets a new owner, or loses its owner because the window was destroyed or
+ * the client went away.
+ *
+ * The watch only ever reads events, so it always has an Xlib connection of
+ * its own, also with XCB.
+ */
+
+#ifdef LIBXCLIP_XFIXES
+struct libxclip_watch {
+    Display *display;
+    int event_base;
+};
+
+libxclip_watch *libxclip_watch_start(Display *display) {
+    libxclip_watch *watch = calloc(1, sizeof(libxclip_watch));
+    if (watch == NULL) {
+        return NULL;
+    }
+    watch->display = XOpenDisplay(XDisplayString(display));
+    if (watch->display == NULL) {
+        free(watch);
+        return NULL;
+    }
+
+    int error_base;
+    if (!XFixesQueryExtension(watch->display, &watch->event_base,
+                              &error_base)) {
+        #ifdef DEBUG
+        printf("The X server doesn't have the XFixes extension!\n");
+        #endif
+        libxclip_watch_destroy(watch);
+        return NULL;
+    }
+
+    // Xlib doesn't let us know an extension's events until we've asked for
+    // its version.
+    int major = 1;
+    int minor = 0;
+    XFixesQueryVersion(watch->display, &major, &minor);
+
+    const unsigned long mask = XFixesSetSelectionOwnerNotifyMask
+                               | XFixesSelectionWindowDestroyNotifyMask
+                               | XFixesSelectionClientCloseNotifyMask;
+    const Window root = DefaultRootWindow(watch->display);
+    XFixesSelectSelectionInput(watch->display, root,
+                               XInternAtom(watch->display, "CLIPBOARD",
+                                           False),
+                               mask);
+    XFixesSelectSelectionInput(watch->display, root, XA_PRIMARY, mask);
+
+    // So that nothing that happens once we return goes unnoticed.
+    XSync(watch->display, False);
+    return watch;
+}
+
+int libxclip_watch_fd(libxclip_watch *watch) {
+    return ConnectionNumber(watch->display);
+}
+
+int libxclip_watch_next(libxclip_watch *watch,
+                        struct libxclip_owner_change *change_ret) {
+    // Everything that has arrived, without waiting for anything more.
+    while (XPending(watch->display)) {
+        XEvent event;
+        XNextEvent(watch->display, &event);
+        if (event.type != watch->event_base + XFixesSelectionNotify) {
+            continue;
+        }
+
+        XFixesSelectionNotifyEvent *notify =
+            (XFixesSelectionNotifyEvent *) &event;
+        change_ret->selection = notify->selection;
+        change_ret->owner = notify->subtype == XFixesSetSelectionOwnerNotify
+                            ? notify->owner
+                            : None;
+        change_ret->timestamp = notify->timestamp;
+        change_ret->selection_timestamp = notify->selection_timestamp;
+        return 1;
+    }
+    return 0;
+}
+
+void libxclip_watch_destroy(libxclip_watch *watch) {
+    XCloseDisplay(watch->display);
+    free(watch);
+}
+#endif
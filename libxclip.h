@@ -18,16 +18,92 @@
 #include <unistd.h>
 #include <X11/Xlib.h>
 typedef struct libxclip_putopts libxclip_putopts;
+typedef struct libxclip_put_handle libxclip_put_handle;
+enum {
+    LIBXCLIP_PUT_FORK,
+    LIBXCLIP_PUT_THREAD,
+    LIBXCLIP_PUT_DAEMON,
+};
+enum {
+    LIBXCLIP_CHUNK_FIXED,
+    LIBXCLIP_CHUNK_SERVER_MAX,
+    LIBXCLIP_CHUNK_ADAPTIVE,
+};
+typedef int (*libxclip_convert)(Atom target,
+                                char **data_ret,
+                                size_t *len_ret,
+                                void *userdata);
+struct libxclip_target {
+    Atom target;
+    const char *data;
+    size_t len;
+    libxclip_convert convert;
+    void *userdata;
+};
+struct libxclip_putopts {
+    int mode;  // One of LIBXCLIP_PUT_*
+    struct libxclip_target *targets;
+    size_t ntargets;
+    int chunk_policy;  // One of LIBXCLIP_CHUNK_*
+    size_t chunk_size;
+    libxclip_put_handle **handle_ret;
+};
+void libxclip_putopts_initialize(libxclip_putopts *options);
+enum {
+    LIBXCLIP_STATS_TARGETS = 16,
+    LIBXCLIP_STATS_REQUESTORS = 16,
+    LIBXCLIP_STATS_BUCKETS = 24,
+};
+struct libxclip_stats_target {
+    Atom target;
+    unsigned long requests;
+    unsigned long long bytes;
+};
+struct libxclip_stats_requestor {
+    Window window;
+    long pid;  // _NET_WM_PID, 0 if unknown
+    unsigned long requests;
+    unsigned long long bytes;
+};
+struct libxclip_stats {
+    unsigned long requests;
+    unsigned long refused;
+    unsigned long long bytes_served;
+    unsigned long active_transfers;
+    struct libxclip_stats_target targets[LIBXCLIP_STATS_TARGETS];
+    struct libxclip_stats_requestor requestors[LIBXCLIP_STATS_REQUESTORS];
+    unsigned long chunk_turnaround[LIBXCLIP_STATS_BUCKETS];
+};
+int libxclip_put_stats(libxclip_put_handle *handle,
+                       struct libxclip_stats *stats_ret);
+void libxclip_put_handle_destroy(libxclip_put_handle *handle);
+typedef struct libxclip_ctx libxclip_ctx;
+typedef int (*libxclip_sink)(const char *data, size_t len, void *userdata);
+typedef ssize_t (*libxclip_source)(char *buf, size_t len, void *userdata);
 struct libxclip_getopts {
     Atom selection;
     Atom target;
     int timeout;  // in milliseconds
+    const Atom *preferred;
+    size_t npreferred;
+    Atom chosen;
 };
 void libxclip_getopts_initialize(struct libxclip_getopts *options);
 int libxclip_put(Display *display,
                  char *data,
                  size_t len,
                  libxclip_putopts *options);
+int libxclip_put_stream(Display *display,
+                        libxclip_source source,
+                        void *userdata,
+                        libxclip_putopts *options);
+int libxclip_put_fd(Display *display, int fd, libxclip_putopts *options);
+int libxclip_put_file(Display *display,
+                      const char *path,
+                      libxclip_putopts *options);
+int libxclip_put_file_fd(Display *display,
+                         int fd,
+                         libxclip_putopts *options);
 int libxclip_targets(Display *display,
                      Atom **targets_ret,
                      unsigned long *nitems_ret,
@@ -36,4 +112,71 @@ int libxclip_get(Display *display,
                  char **data_ret,
                  size_t *size_ret,
                  struct libxclip_getopts *options);
+libxclip_ctx *libxclip_ctx_create(Display *display);
+void libxclip_ctx_destroy(libxclip_ctx *ctx);
+int libxclip_ctx_targets(libxclip_ctx *ctx,
+                         Atom **targets_ret,
+                         unsigned long *nitems_ret,
+                         struct libxclip_getopts *options);
+int libxclip_ctx_get(libxclip_ctx *ctx,
+                     char **data_ret,
+                     size_t *size_ret,
+                     struct libxclip_getopts *options);
+int libxclip_get_stream(Display *display,
+                        libxclip_sink sink,
+                        void *userdata,
+                        struct libxclip_getopts *options);
+int libxclip_ctx_get_stream(libxclip_ctx *ctx,
+                            libxclip_sink sink,
+                            void *userdata,
+                            struct libxclip_getopts *options);
+int libxclip_get_multiple(Display *display,
+                          const Atom *targets,
+                          size_t ntargets,
+                          char **data_ret,
+                          size_t *sizes_ret,
+                          Atom *types_ret,
+                          struct libxclip_getopts *options);
+int libxclip_ctx_get_multiple(libxclip_ctx *ctx,
+                              const Atom *targets,
+                              size_t ntargets,
+                              char **data_ret,
+                              size_t *sizes_ret,
+                              Atom *types_ret,
+                              struct libxclip_getopts *options);
+typedef struct libxclip_get_op libxclip_get_op;
+libxclip_get_op *libxclip_get_start(Display *display,
+                                    struct libxclip_getopts *options);
+libxclip_get_op *libxclip_ctx_get_start(libxclip_ctx *ctx,
+                                        struct libxclip_getopts *options);
+int libxclip_get_fd(libxclip_get_op *op);
+int libxclip_get_process(libxclip_get_op *op);
+int libxclip_get_finish(libxclip_get_op *op,
+                        char **data_ret,
+                        size_t *size_ret);
+typedef struct libxclip_owner libxclip_owner;
+libxclip_owner *libxclip_owner_create(Display *display, Window window);
+int libxclip_owner_put(libxclip_owner *owner,
+                       char *data,
+                       size_t len,
+                       libxclip_putopts *options);
+int libxclip_handle_event(libxclip_owner *owner, XEvent *event);
+void libxclip_owner_destroy(libxclip_owner *owner);
+#ifdef LIBXCLIP_XFIXES
+typedef struct libxclip_watch libxclip_watch;
+struct libxclip_owner_change {
+    Atom selection;  // CLIPBOARD or XA_PRIMARY
+    Window owner;    // None if the selection no longer has an owner
+    Time timestamp;
+    Time selection_timestamp;
+};
+libxclip_watch *libxclip_watch_start(Display *display);
+int libxclip_watch_fd(libxclip_watch *watch);
+int libxclip_watch_next(libxclip_watch *watch,
+                        struct libxclip_owner_change *change_ret);
+void libxclip_watch_destroy(libxclip_watch *watch);
+#endif
+#ifdef LIBXCLIP_COUNT_ROUNDTRIPS
+unsigned long libxclip_roundtrips(void);
+#endif
 #endif  // LIBXCLIP_H_
@@ -16,13 +16,25 @@
 
 
 echo "=== Checking if 'gcc -fanalyzer -O3 -shared' has any complaints ==="
-gcc -fanalyzer -O3 -lc -lX11 libxclip.c -shared -o /dev/null
+gcc -fanalyzer -O3 -lc -lX11 -pthread libxclip.c -shared -o /dev/null
 
 echo "=== Checking if 'gcc -std=99' has any complaints ==="
-gcc -std=gnu99 -O3 -lc -lX11 libxclip.c -shared -o /dev/null
+gcc -std=gnu99 -O3 -lc -lX11 -pthread libxclip.c -shared -o /dev/null
 
 echo "=== Checking if 'gcc -std=99 -pedantic' has any complaints ==="
-gcc -std=gnu99 -pedantic -O3 -lc -lX11 libxclip.c -shared -o /dev/null
+gcc -std=gnu99 -pedantic -O3 -lc -lX11 -pthread libxclip.c -shared -o /dev/null
+
+echo "=== Checking if 'gcc -std=99 -pedantic -DLIBXCLIP_XCB' has any complaints ==="
+gcc -std=gnu99 -pedantic -O3 -DLIBXCLIP_XCB -lc -lX11 -lxcb -pthread libxclip.c -shared -o /dev/null
+
+echo "=== Checking if 'gcc -std=99 -pedantic -DLIBXCLIP_ZLIB' has any complaints ==="
+gcc -std=gnu99 -pedantic -O3 -DLIBXCLIP_ZLIB -lc -lX11 -lz -pthread libxclip.c -shared -o /dev/null
+
+echo "=== Checking if 'gcc -std=99 -pedantic -DLIBXCLIP_SHM' has any complaints ==="
+gcc -std=gnu99 -pedantic -O3 -DLIBXCLIP_SHM -lc -lX11 -pthread libxclip.c -shared -o /dev/null
+
+echo "=== Checking if 'gcc -std=99 -pedantic -DLIBXCLIP_XFIXES' has any complaints ==="
+gcc -std=gnu99 -pedantic -O3 -DLIBXCLIP_XFIXES -lc -lX11 -lXfixes -pthread libxclip.c -shared -o /dev/null
 
 echo "=== Checking if cpplint has any complaits ==="
 cpplint --extensions=c,h \
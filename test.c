@@ -19,8 +19,13 @@
 #include <sys/wait.h> // for waitpid
 #include <string.h>
 #include <stdio.h>
+#include <time.h> // for clock
 #include <stdio_ext.h> // for __fpurge
 #include <assert.h>
+#include <dirent.h> // for opendir, to count open file descriptors
+#include <poll.h> // for the asynchronous gets
+#include <fcntl.h> // for open
+#include <errno.h> // for EBUSY
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 
@@ -29,6 +34,18 @@ Display *display;                         // X connection.
 struct libxclip_getopts default_getopts;  // initialized with default values.
 Atom a_clipboard;                         // CLIPBOARD atom.
 
+// Counts the number of file descriptors this process has open.
+int count_open_fds() {
+    int n = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    assert(dir != NULL);
+    while (readdir(dir) != NULL) {
+        n ++;
+    }
+    closedir(dir);
+    return n;
+}
+
 void _00200_test_no_double_printing() {
     printf("\n\n=== libxclip_put doesn't cause double printing\n");
     // See the comments next to __fpurge in libxclip.c for an explaination of
@@ -159,6 +176,18 @@ void _011000_multiple_large_transfers() {
     usleep(1000);  // Just to make sure the previous `system` call had time to output everyting
 }
 
+void _011100_many_concurrent_readers() {
+    printf("\n\n=== libxclip can handle hundreds of large transfers at the same time===\n");
+    size_t size = 1 << 22;
+    char *buffer = malloc(size);
+    memset(buffer, '#', size);
+    libxclip_put(display, buffer, size, NULL);
+    printf("Each of 200 concurrent readers got (count, #bytes):\n");
+    fflush(stdout);
+    system("for i in $(seq 200); do (xclip -o -se c | wc -c) & done"
+           " | sort | uniq -c");
+}
+
 void _012000_read_and_steal() {
     printf("\n\n=== libxclip should complete ongoing transfers evevn after having lost ownership of the selection\n");
 
@@ -174,6 +203,7 @@ void _012000_read_and_steal() {
     Window window = XCreateSimpleWindow(display,
                                         DefaultRootWindow(display),
                                         0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(display, window, PropertyChangeMask);
 
     printf("Doing XConvertSelection.\n");
     XConvertSelection(display,
@@ -183,9 +213,11 @@ void _012000_read_and_steal() {
                       window,
                       CurrentTime);
 
-    printf("Doing XNextEvent and asserting it's type is SelectionNotify.\n");
+    printf("Doing XNextEvent until we get the SelectionNotify.\n");
     XEvent event;
-    XNextEvent(display, &event);
+    do {
+        XNextEvent(display, &event);
+    } while (event.type == PropertyNotify);
     assert(event.type == SelectionNotify);
 
     printf("Doing XGetWindowProperty and asserting the property type is INCR.\n");
@@ -215,22 +247,937 @@ void _012000_read_and_steal() {
     printf("Doing XDeleteProperty, signaling that we're ready for a new chunk.\n");
     XDeleteProperty(display, window, property);
 
-    printf("Doing XNextEvent with a (2sec timeout) and asserting it's type is SelectionNotify.\n");
+    printf("Waiting (2sec timeout) for the PropertyNotify announcing the next chunk.\n");
 
     for (int i = 0; i < 10; i++) {
-        if(XPending(display) != 0) {
-            goto gotevent;
+        while (XPending(display) != 0) {
+            XNextEvent(display, &event);
+            if (event.type == PropertyNotify
+                && event.xproperty.atom == property
+                && event.xproperty.state == PropertyNewValue) {
+                goto gotevent;
+            }
         }
         usleep(200000);
     }
     assert(False);
 
     gotevent:
-    XNextEvent(display, &event);
-    assert(event.type == SelectionNotify);
     printf("Success!\n");
 }
 
+void _013000_two_transfers_one_requestor() {
+    printf("\n\n=== libxclip can handle two INCR transfers to the same window on different properties\n");
+
+    size_t size = 1 << 25;
+    char *inbuffer = malloc(size);
+    memset(inbuffer, '#', size);
+    libxclip_put(display, inbuffer, size, NULL);
+
+    Window window = XCreateSimpleWindow(display,
+                                        DefaultRootWindow(display),
+                                        0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(display, window, PropertyChangeMask);
+
+    Atom properties[2] = {
+        XInternAtom(display, "LIBXCLIP_DATA_1", False),
+        XInternAtom(display, "LIBXCLIP_DATA_2", False),
+    };
+    size_t received[2] = { 0, 0 };
+    Bool done[2] = { False, False };
+
+    printf("Doing two XConvertSelection's from the same window.\n");
+    for (int i = 0; i < 2; i++) {
+        XConvertSelection(display,
+                          a_clipboard,
+                          XInternAtom(display, "UTF8_STRING", False),
+                          properties[i],
+                          window,
+                          CurrentTime);
+    }
+
+    printf("Waiting for both SelectionNotify's.\n");
+    XEvent event;
+    for (int n = 0; n < 2;) {
+        XNextEvent(display, &event);
+        if (event.type == SelectionNotify) {
+            n++;
+        }
+    }
+
+    printf("Reading both INCR properties, starting both transfers.\n");
+    Atom property_type;
+    int format;
+    unsigned long nitems;
+    unsigned long bytes_after;
+    unsigned char *out_buffer;
+    for (int i = 0; i < 2; i++) {
+        XGetWindowProperty(display, window, properties[i], 0, 1, True,
+                           AnyPropertyType, &property_type, &format, &nitems,
+                           &bytes_after, &out_buffer);
+        assert(property_type == XInternAtom(display, "INCR", False));
+        XFree(out_buffer);
+    }
+
+    printf("Receiving chunks on both properties.\n");
+    while (done[0] == False || done[1] == False) {
+        XNextEvent(display, &event);
+        if (event.type != PropertyNotify
+            || event.xproperty.state != PropertyNewValue) {
+            continue;
+        }
+
+        int i = event.xproperty.atom == properties[0] ? 0 : 1;
+        assert(event.xproperty.atom == properties[i]);
+
+        XGetWindowProperty(display, window, properties[i], 0, size, True,
+                           AnyPropertyType, &property_type, &format, &nitems,
+                           &bytes_after, &out_buffer);
+        XFree(out_buffer);
+
+        if (nitems == 0) {
+            done[i] = True;
+        }
+        received[i] += nitems;
+    }
+
+    printf("Received %zu and %zu bytes.\n", received[0], received[1]);
+    assert(received[0] == size);
+    assert(received[1] == size);
+    printf("Success!\n");
+}
+
+// A libxclip_source that produces `remaining` '#' characters.
+ssize_t hash_source(char *buf, size_t len, void *userdata) {
+    size_t *remaining = userdata;
+    if (len > *remaining) {
+        len = *remaining;
+    }
+    memset(buf, '#', len);
+    *remaining -= len;
+    return len;
+}
+
+void _014000_put_stream() {
+    printf("\n\n=== libxclip_put_stream can serve large generated data once ===\n");
+
+    size_t n = 1 << 25;
+    size_t remaining = n;
+    libxclip_put_stream(display, hash_source, &remaining, NULL);
+
+    char *out_data;
+    size_t out_size;
+    int ret = libxclip_get(display, &out_data, &out_size, NULL);
+    assert(ret == 0);
+    assert(out_size == n);
+    for (size_t i = 0; i < n; i ++) {
+        assert(out_data[i] == '#');
+    }
+    free(out_data);
+    printf("Got %zu bytes.\n", out_size);
+
+    printf("A second paste is refused.\n");
+    ret = libxclip_get(display, &out_data, &out_size, NULL);
+    assert(ret != 0);
+    printf("Ok.\n");
+}
+
+void _014100_put_fd_small() {
+    printf("\n\n=== libxclip_put_fd with small data can be pasted many times ===\n");
+
+    int pipefd[2];
+    assert(pipe(pipefd) == 0);
+    write(pipefd[1], "Foobarbaz", 9);
+    close(pipefd[1]);
+
+    libxclip_put_fd(display, pipefd[0], NULL);
+    close(pipefd[0]);
+
+    for(int i = 0; i < 3; i++) {
+        printf("> xclip -o -selection clipboard 2>&1: ");
+        fflush(stdout);
+        system("xclip -o -selection clipboard 2>&1");
+        printf("\n");
+    }
+}
+
+void _015000_put_file() {
+    printf("\n\n=== libxclip_put_file serves the contents of a file ===\n");
+
+    size_t sizes[2] = { 9, 1 << 25 };
+    for (int i = 0; i < 2; i ++) {
+        char path[] = "/tmp/libxclip-test-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd != -1);
+        char *in_data = malloc(sizes[i]);
+        memset(in_data, '#', sizes[i]);
+        write(fd, in_data, sizes[i]);
+        close(fd);
+
+        assert(libxclip_put_file(display, path, NULL) == 0);
+        // The child process has the file mapped, so it can be removed.
+        unlink(path);
+
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+        assert(out_size == sizes[i]);
+        assert(memcmp(in_data, out_data, out_size) == 0);
+        printf("Got %zu bytes.\n", out_size);
+        free(in_data);
+        free(out_data);
+    }
+
+    printf("libxclip_put_file returns an error if there is no such file.\n");
+    assert(libxclip_put_file(display, "/no/such/file", NULL) != 0);
+    printf("Ok.\n");
+}
+
+void _016000_put_thread() {
+    printf("\n\n=== libxclip_put in thread mode ===\n");
+
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.mode = LIBXCLIP_PUT_THREAD;
+
+    size_t sizes[2] = { 9, 1 << 25 };
+    for (int i = 0; i < 2; i ++) {
+        char *in_data = malloc(sizes[i]);
+        char *expected = malloc(sizes[i]);
+        memset(in_data, '#', sizes[i]);
+        memset(expected, '#', sizes[i]);
+        assert(libxclip_put(display, in_data, sizes[i], &putopts) == 0);
+
+        // The owner thread has a copy of its own, so we can do whatever we
+        // want with ours.
+        memset(in_data, '!', sizes[i]);
+        free(in_data);
+
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+        assert(out_size == sizes[i]);
+        assert(memcmp(expected, out_data, out_size) == 0);
+        printf("Got %zu bytes.\n", out_size);
+        free(expected);
+        free(out_data);
+    }
+
+    printf("A stream and a file in thread mode.\n");
+    int pipefd[2];
+    assert(pipe(pipefd) == 0);
+    write(pipefd[1], "stream", 6);
+    close(pipefd[1]);
+    assert(libxclip_put_fd(display, pipefd[0], &putopts) == 0);
+    // The owner thread has its own descriptor.
+    close(pipefd[0]);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 6);
+    assert(memcmp("stream", out_data, 6) == 0);
+    free(out_data);
+
+    char path[] = "/tmp/libxclip-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    write(fd, "file", 4);
+    close(fd);
+    assert(libxclip_put_file(display, path, &putopts) == 0);
+    unlink(path);
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 4);
+    assert(memcmp("file", out_data, 4) == 0);
+    free(out_data);
+
+    printf("Many puts in a row, each owner thread exits when the next one "
+           "takes over.\n");
+    for (int i = 0; i < 100; i++) {
+        char in_data[16];
+        int len = sprintf(in_data, "%d", i);
+        assert(libxclip_put(display, in_data, len, &putopts) == 0);
+        assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+        assert(out_size == (size_t) len);
+        assert(memcmp(in_data, out_data, len) == 0);
+        free(out_data);
+    }
+
+    printf("A put that fails in the owner thread leaks nothing.\n");
+    char failing_path[] = "/tmp/libxclip-test-XXXXXX";
+    fd = mkstemp(failing_path);
+    assert(fd != -1);
+    write(fd, "file", 4);
+    close(fd);
+    // Can't be mapped for reading.
+    fd = open(failing_path, O_WRONLY);
+    unlink(failing_path);
+    assert(fd != -1);
+    int fds_before = count_open_fds();
+    for (int i = 0; i < 10; i++) {
+        assert(libxclip_put_file_fd(display, fd, &putopts) == -1);
+    }
+    assert(count_open_fds() == fds_before);
+    close(fd);
+    printf("Ok.\n");
+}
+
+void _017000_put_daemon() {
+    printf("\n\n=== libxclip_put in daemon mode ===\n");
+
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.mode = LIBXCLIP_PUT_DAEMON;
+
+    size_t sizes[3] = { 0, 9, 1 << 25 };
+    for (int i = 0; i < 3; i ++) {
+        char *in_data = malloc(sizes[i] + 1);
+        memset(in_data, '#', sizes[i]);
+        assert(libxclip_put(display, in_data, sizes[i], &putopts) == 0);
+
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+        assert(out_size == sizes[i]);
+        assert(memcmp(in_data, out_data, out_size) == 0);
+        printf("Got %zu bytes.\n", out_size);
+        free(in_data);
+        free(out_data);
+    }
+
+    printf("Every put is served by the same daemon.\n");
+    Window owner = XGetSelectionOwner(display, a_clipboard);
+    for (int i = 0; i < 100; i++) {
+        char in_data[16];
+        int len = sprintf(in_data, "%d", i);
+        assert(libxclip_put(display, in_data, len, &putopts) == 0);
+        assert(XGetSelectionOwner(display, a_clipboard) == owner);
+
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+        assert(out_size == (size_t) len);
+        assert(memcmp(in_data, out_data, len) == 0);
+        free(out_data);
+    }
+
+    printf("The daemon takes the selection back after losing it.\n");
+    XSetSelectionOwner(display, a_clipboard, None, CurrentTime);
+    XSync(display, False);
+    assert(libxclip_put(display, "back", 4, &putopts) == 0);
+    assert(XGetSelectionOwner(display, a_clipboard) == owner);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 4);
+    assert(memcmp("back", out_data, 4) == 0);
+    free(out_data);
+
+    printf("A file in daemon mode.\n");
+    char path[] = "/tmp/libxclip-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    write(fd, "file", 4);
+    close(fd);
+    assert(libxclip_put_file(display, path, &putopts) == 0);
+    unlink(path);
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 4);
+    assert(memcmp("file", out_data, 4) == 0);
+    free(out_data);
+    printf("Ok.\n");
+}
+
+void _018000_put_targets() {
+    printf("\n\n=== libxclip_put with several targets ===\n");
+
+    Atom a_html = XInternAtom(display, "text/html", False);
+    Atom a_plain = XInternAtom(display, "text/plain;charset=utf-8", False);
+    Atom a_png = XInternAtom(display, "image/png", False);
+    Atom a_targets = XInternAtom(display, "TARGETS", False);
+    Atom a_multiple = XInternAtom(display, "MULTIPLE", False);
+    Atom a_utf8 = XInternAtom(display, "UTF8_STRING", False);
+
+    // Large enough that image/png has to be sent with INCR.
+    const size_t png_len = 1 << 24;
+    char *png = malloc(png_len);
+    memset(png, 'P', png_len);
+
+    struct libxclip_target targets[3] = {
+        { a_html, "<b>bold</b>", 11 },
+        { a_plain, "bold", 4 },
+        { a_png, png, png_len },
+    };
+
+    const int modes[3] = {
+        LIBXCLIP_PUT_FORK, LIBXCLIP_PUT_THREAD, LIBXCLIP_PUT_DAEMON
+    };
+    for (int m = 0; m < 3; m++) {
+        printf("Mode %d.\n", modes[m]);
+        libxclip_putopts putopts;
+        libxclip_putopts_initialize(&putopts);
+        putopts.mode = modes[m];
+        putopts.targets = targets;
+        putopts.ntargets = 3;
+        assert(libxclip_put(display, "bold", 4, &putopts) == 0);
+
+        Atom *out_targets;
+        unsigned long nitems;
+        assert(libxclip_targets(display, &out_targets, &nitems, NULL) == 0);
+        assert(nitems == 6);
+        assert(out_targets[0] == a_targets);
+        assert(out_targets[1] == a_multiple);
+        assert(out_targets[2] == a_utf8);
+        assert(out_targets[3] == a_html);
+        assert(out_targets[4] == a_plain);
+        assert(out_targets[5] == a_png);
+        free(out_targets);
+
+        struct libxclip_getopts getopts;
+        libxclip_getopts_initialize(&getopts);
+        char *out_data;
+        size_t out_size;
+
+        assert(libxclip_get(display, &out_data, &out_size, &getopts) == 0);
+        assert(out_size == 4 && memcmp(out_data, "bold", 4) == 0);
+        free(out_data);
+
+        for (int i = 0; i < 3; i++) {
+            getopts.target = targets[i].target;
+            assert(libxclip_get(display, &out_data, &out_size, &getopts)
+                   == 0);
+            assert(out_size == targets[i].len);
+            assert(memcmp(out_data, targets[i].data, out_size) == 0);
+            free(out_data);
+        }
+
+        getopts.target = XInternAtom(display, "image/jpeg", False);
+        assert(libxclip_get(display, &out_data, &out_size, &getopts) != 0);
+    }
+
+    printf("Only targets, no UTF8_STRING.\n");
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.targets = targets;
+    putopts.ntargets = 2;
+    assert(libxclip_put(display, NULL, 0, &putopts) == 0);
+    Atom *out_targets;
+    unsigned long nitems;
+    assert(libxclip_targets(display, &out_targets, &nitems, NULL) == 0);
+    assert(nitems == 4);
+    free(out_targets);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) != 0);
+
+    free(png);
+    printf("Ok.\n");
+}
+
+// A convert callback for _019000_put_convert, `userdata` points to how many
+// times it's been called.
+int counting_convert(Atom target, char **data_ret, size_t *len_ret,
+                     void *userdata) {
+    (void) target;
+    int *calls = userdata;
+    (*calls)++;
+
+    // Large enough that it has to be sent with INCR.
+    *len_ret = 1 << 24;
+    *data_ret = malloc(*len_ret);
+    memset(*data_ret, 'C', *len_ret);
+    return 0;
+}
+
+int failing_convert(Atom target, char **data_ret, size_t *len_ret,
+                    void *userdata) {
+    (void) target;
+    (void) data_ret;
+    (void) len_ret;
+    (void) userdata;
+    return -1;
+}
+
+void _019000_put_convert() {
+    printf("\n\n=== libxclip_put with targets converted on demand ===\n");
+
+    Atom a_png = XInternAtom(display, "image/png", False);
+    Atom a_html = XInternAtom(display, "text/html", False);
+    int calls = 0;
+    struct libxclip_target targets[2] = {
+        { a_png, NULL, 0, counting_convert, &calls },
+        { a_html, NULL, 0, failing_convert, NULL },
+    };
+
+    // In thread mode the callback is called in our process, so we can see
+    // how many times it's called.
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.mode = LIBXCLIP_PUT_THREAD;
+    putopts.targets = targets;
+    putopts.ntargets = 2;
+    assert(libxclip_put(display, "text", 4, &putopts) == 0);
+
+    printf("Nothing is converted until someone asks for it.\n");
+    Atom *out_targets;
+    unsigned long nitems;
+    assert(libxclip_targets(display, &out_targets, &nitems, NULL) == 0);
+    assert(nitems == 5);
+    free(out_targets);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    free(out_data);
+    assert(calls == 0);
+
+    printf("The result is kept for later requests.\n");
+    struct libxclip_getopts getopts;
+    libxclip_getopts_initialize(&getopts);
+    getopts.target = a_png;
+    for (int i = 0; i < 3; i++) {
+        assert(libxclip_get(display, &out_data, &out_size, &getopts) == 0);
+        assert(out_size == 1 << 24);
+        assert(out_data[0] == 'C' && out_data[out_size - 1] == 'C');
+        free(out_data);
+    }
+    assert(calls == 1);
+
+    printf("A failing callback refuses the request.\n");
+    getopts.target = a_html;
+    assert(libxclip_get(display, &out_data, &out_size, &getopts) != 0);
+
+    printf("And in fork mode.\n");
+    putopts.mode = LIBXCLIP_PUT_FORK;
+    assert(libxclip_put(display, "text", 4, &putopts) == 0);
+    getopts.target = a_png;
+    assert(libxclip_get(display, &out_data, &out_size, &getopts) == 0);
+    assert(out_size == 1 << 24);
+    free(out_data);
+    printf("Ok.\n");
+}
+
+void _019500_put_chunk_policies() {
+    printf("\n\n=== libxclip_put with each of the chunk policies ===\n");
+
+    // Large enough to be sent with INCR by every policy, and not a multiple
+    // of any chunk size so that the last chunk is a short one.
+    const size_t large = (1 << 25) + 5;
+    char *in_data = malloc(large);
+    for (size_t i = 0; i < large; i++) {
+        in_data[i] = 'a' + i % 26;
+    }
+
+    const int policies[4] = {
+        LIBXCLIP_CHUNK_FIXED, LIBXCLIP_CHUNK_FIXED,
+        LIBXCLIP_CHUNK_SERVER_MAX, LIBXCLIP_CHUNK_ADAPTIVE
+    };
+    const size_t chunk_sizes[4] = { 0, 4096, 0, 0 };
+    const size_t sizes[2] = { 5000, large };
+    for (int p = 0; p < 4; p++) {
+        for (int s = 0; s < 2; s++) {
+            printf("Policy %d, chunk size %zu, %zu bytes.\n",
+                   policies[p], chunk_sizes[p], sizes[s]);
+            libxclip_putopts putopts;
+            libxclip_putopts_initialize(&putopts);
+            putopts.chunk_policy = policies[p];
+            putopts.chunk_size = chunk_sizes[p];
+            assert(libxclip_put(display, in_data, sizes[s], &putopts) == 0);
+
+            char *out_data;
+            size_t out_size;
+            assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+            assert(out_size == sizes[s]);
+            assert(memcmp(in_data, out_data, sizes[s]) == 0);
+            free(out_data);
+        }
+    }
+
+    // The daemon is told the policy along with the contents.
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.mode = LIBXCLIP_PUT_DAEMON;
+    putopts.chunk_size = 4096;
+    assert(libxclip_put(display, in_data, large, &putopts) == 0);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == large);
+    assert(memcmp(in_data, out_data, large) == 0);
+    free(out_data);
+
+    free(in_data);
+    printf("Ok.\n");
+}
+
+void _019600_put_stats() {
+    printf("\n\n=== libxclip_put keeps statistics for the put handle ===\n");
+
+    const Atom utf8_string = XInternAtom(display, "UTF8_STRING", False);
+    const int modes[3] = {
+        LIBXCLIP_PUT_FORK, LIBXCLIP_PUT_THREAD, LIBXCLIP_PUT_DAEMON
+    };
+    for (int m = 0; m < 3; m++) {
+        printf("Mode %d.\n", modes[m]);
+        libxclip_put_handle *handle = NULL;
+        libxclip_putopts putopts;
+        libxclip_putopts_initialize(&putopts);
+        putopts.mode = modes[m];
+        putopts.handle_ret = &handle;
+        assert(libxclip_put(display, "foobar", 6, &putopts) == 0);
+        assert(handle != NULL);
+
+        for (int i = 0; i < 2; i++) {
+            char *out_data;
+            size_t out_size;
+            assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+            free(out_data);
+        }
+        struct libxclip_getopts getopts;
+        libxclip_getopts_initialize(&getopts);
+        getopts.target = XInternAtom(display, "LIBXCLIP_NO_SUCH_TARGET",
+                                     False);
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_get(display, &out_data, &out_size, &getopts) != 0);
+
+        struct libxclip_stats stats;
+        assert(libxclip_put_stats(handle, &stats) == 0);
+        assert(stats.requests >= 3);
+        assert(stats.refused >= 1);
+        assert(stats.bytes_served == 12);
+        assert(stats.active_transfers == 0);
+        Bool found = False;
+        for (int i = 0; i < LIBXCLIP_STATS_TARGETS; i++) {
+            if (stats.targets[i].target == utf8_string) {
+                assert(stats.targets[i].requests == 2);
+                assert(stats.targets[i].bytes == 12);
+                found = True;
+            }
+        }
+        assert(found);
+        assert(stats.requestors[0].window != None);
+        assert(stats.requestors[0].requests >= 3);
+        libxclip_put_handle_destroy(handle);
+    }
+
+    printf("A large put sent with INCR.\n");
+    const size_t large = (1 << 24) + 5;
+    char *in_data = malloc(large);
+    memset(in_data, 'x', large);
+    libxclip_put_handle *handle = NULL;
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.handle_ret = &handle;
+    assert(libxclip_put(display, in_data, large, &putopts) == 0);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == large);
+    free(out_data);
+
+    struct libxclip_stats stats;
+    assert(libxclip_put_stats(handle, &stats) == 0);
+    assert(stats.bytes_served == large);
+    assert(stats.active_transfers == 0);
+    unsigned long chunks = 0;
+    for (int i = 0; i < LIBXCLIP_STATS_BUCKETS; i++) {
+        chunks += stats.chunk_turnaround[i];
+    }
+    assert(chunks > 1);
+    libxclip_put_handle_destroy(handle);
+    free(in_data);
+
+    printf("Ok.\n");
+}
+
+#ifdef LIBXCLIP_ZLIB
+void _019700_compressed_transfer() {
+    printf("\n\n=== libxclip_get takes large contents compressed ===\n");
+
+    const Atom a_zlib = XInternAtom(display, "application/x-libxclip-zlib",
+                                    False);
+    // Something like the CSV people paste around.
+    const size_t large = (1 << 25) + 5;
+    char *in_data = malloc(large);
+    for (size_t i = 0; i < large; i++) {
+        in_data[i] = i % 16 == 15 ? '\n' : i % 4 == 3 ? ',' : '0' + i % 7;
+    }
+
+    libxclip_put_handle *handle = NULL;
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.handle_ret = &handle;
+    assert(libxclip_put(display, in_data, large, &putopts) == 0);
+
+    Atom *targets;
+    unsigned long nitems;
+    assert(libxclip_targets(display, &targets, &nitems, NULL) == 0);
+    Bool advertised = False;
+    for (unsigned long i = 0; i < nitems; i++) {
+        advertised = advertised || targets[i] == a_zlib;
+    }
+    free(targets);
+    assert(advertised);
+
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == large);
+    assert(memcmp(in_data, out_data, large) == 0);
+    free(out_data);
+
+    // All of that came compressed.
+    struct libxclip_stats stats;
+    assert(libxclip_put_stats(handle, &stats) == 0);
+    assert(stats.bytes_served < large / 4);
+    assert(stats.refused == 0);
+    libxclip_put_handle_destroy(handle);
+
+    printf("Other clients still get UTF8_STRING, xclip says %zu bytes:\n",
+           large);
+    system("xclip -o -selection CLIPBOARD | wc -c");
+
+    printf("Small contents aren't compressed, or asked for compressed.\n");
+    assert(libxclip_put(display, "foo", 3, &putopts) == 0);
+    assert(libxclip_targets(display, &targets, &nitems, NULL) == 0);
+    for (unsigned long i = 0; i < nitems; i++) {
+        assert(targets[i] != a_zlib);
+    }
+    free(targets);
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 3 && memcmp(out_data, "foo", 3) == 0);
+    free(out_data);
+    assert(libxclip_put_stats(handle, &stats) == 0);
+    assert(stats.refused == 0);
+    libxclip_put_handle_destroy(handle);
+
+    free(in_data);
+    printf("Ok.\n");
+}
+#endif
+
+#ifdef LIBXCLIP_SHM
+void _019800_shared_memory_transfer() {
+    printf("\n\n=== libxclip_get maps large contents on the same host ===\n");
+
+    const Atom a_shm = XInternAtom(display, "application/x-libxclip-shm",
+                                   False);
+    const size_t large = (1 << 26) + 5;
+    char *in_data = malloc(large);
+    for (size_t i = 0; i < large; i++) {
+        in_data[i] = 'a' + i % 26;
+    }
+
+    const int modes[3] = {
+        LIBXCLIP_PUT_FORK, LIBXCLIP_PUT_THREAD, LIBXCLIP_PUT_DAEMON
+    };
+    for (int m = 0; m < 3; m++) {
+        printf("Mode %d.\n", modes[m]);
+        libxclip_put_handle *handle = NULL;
+        libxclip_putopts putopts;
+        libxclip_putopts_initialize(&putopts);
+        putopts.mode = modes[m];
+        putopts.handle_ret = &handle;
+        assert(libxclip_put(display, in_data, large, &putopts) == 0);
+
+        Atom *targets;
+        unsigned long nitems;
+        assert(libxclip_targets(display, &targets, &nitems, NULL) == 0);
+        Bool advertised = False;
+        for (unsigned long i = 0; i < nitems; i++) {
+            advertised = advertised || targets[i] == a_shm;
+        }
+        free(targets);
+        assert(advertised);
+
+        // Twice, the second time the memfd is already there.
+        for (int i = 0; i < 2; i++) {
+            char *out_data;
+            size_t out_size;
+            assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+            assert(out_size == large);
+            assert(memcmp(in_data, out_data, large) == 0);
+            free(out_data);
+        }
+
+        // Nothing but the descriptors went through the X server, and we
+        // never asked for a target the owner didn't have.
+        struct libxclip_stats stats;
+        assert(libxclip_put_stats(handle, &stats) == 0);
+        assert(stats.bytes_served < 1024);
+        assert(stats.refused == 0);
+        libxclip_put_handle_destroy(handle);
+    }
+
+    printf("Other clients still get UTF8_STRING, xclip says %zu bytes:\n",
+           large);
+    system("xclip -o -selection CLIPBOARD | wc -c");
+
+    free(in_data);
+    printf("Ok.\n");
+}
+#endif
+
+#ifndef LIBXCLIP_XCB
+// Hands every event on `display` to `owner` until `op` is done.
+static void serve_in_process(libxclip_owner *owner, libxclip_get_op *op) {
+    struct pollfd fds[2];
+    fds[0].fd = ConnectionNumber(display);
+    fds[0].events = POLLIN;
+    fds[1].fd = libxclip_get_fd(op);
+    fds[1].events = POLLIN;
+    while (!libxclip_get_process(op)) {
+        while (XPending(display)) {
+            XEvent event;
+            XNextEvent(display, &event);
+            libxclip_handle_event(owner, &event);
+        }
+        assert(poll(fds, 2, 10000) > 0);
+    }
+}
+
+// Pastes CLIPBOARD into `window` by hand, the way the caller of an in-process
+// owner would, handing `owner` the events that are its. Returns how many
+// bytes came over.
+static size_t paste_by_hand(libxclip_owner *owner, Window window) {
+    const Atom a_utf8 = XInternAtom(display, "UTF8_STRING", False);
+    const Atom a_incr = XInternAtom(display, "INCR", False);
+    const Atom property = XInternAtom(display, "PASTE_BY_HAND", False);
+    XConvertSelection(display, a_clipboard, a_utf8, property, window,
+                      CurrentTime);
+
+    size_t total = 0;
+    Bool incr = False;
+    while (True) {
+        XEvent event;
+        XNextEvent(display, &event);
+        if (libxclip_handle_event(owner, &event)) {
+            continue;
+        }
+        if (event.type == SelectionNotify) {
+            assert(event.xselection.property == property);
+        } else if (!incr
+                   || event.type != PropertyNotify
+                   || event.xproperty.window != window
+                   || event.xproperty.atom != property
+                   || event.xproperty.state != PropertyNewValue) {
+            continue;
+        }
+
+        // Deleting the INCR property starts the transfer, deleting each
+        // chunk asks for the next one.
+        Atom type;
+        int format;
+        unsigned long nitems;
+        unsigned long bytes_after;
+        unsigned char *data;
+        XGetWindowProperty(display, window, property, 0, 0x1FFFFFFF, True,
+                           AnyPropertyType, &type, &format, &nitems,
+                           &bytes_after, &data);
+        XFree(data);
+        if (type == a_incr) {
+            incr = True;
+        } else if (!incr) {
+            return nitems;
+        } else if (nitems == 0) {
+            return total;
+        } else {
+            total += nitems;
+        }
+    }
+}
+#endif
+
+void _019900_in_process_owner() {
+    printf("\n\n=== The caller's event loop can serve the selection ===\n");
+
+    #ifdef LIBXCLIP_XCB
+    assert(libxclip_owner_create(display, None) == NULL);
+    printf("Not available with XCB.\n");
+    #else
+    Window window = XCreateSimpleWindow(display, DefaultRootWindow(display),
+                                        0, 0, 1, 1, 0, 0, 0);
+    libxclip_owner *owner = libxclip_owner_create(display, window);
+    assert(owner != NULL);
+
+    const size_t large = (1 << 25) + 5;
+    char *in_data = malloc(large);
+    for (size_t i = 0; i < large; i++) {
+        in_data[i] = 'a' + i % 26;
+    }
+
+    // Something small in one go, then something large over INCR.
+    const size_t sizes[2] = { 3, large };
+    for (int i = 0; i < 2; i++) {
+        #ifdef LIBXCLIP_COUNT_ROUNDTRIPS
+        unsigned long before = libxclip_roundtrips();
+        #endif
+        assert(libxclip_owner_put(owner, in_data, sizes[i], NULL) == 0);
+        #ifdef LIBXCLIP_COUNT_ROUNDTRIPS
+        assert(libxclip_roundtrips() == before);
+        #endif
+
+        libxclip_get_op *op = libxclip_get_start(display, NULL);
+        assert(op != NULL);
+        serve_in_process(owner, op);
+
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_get_finish(op, &out_data, &out_size) == 0);
+        assert(out_size == sizes[i]);
+        assert(memcmp(in_data, out_data, sizes[i]) == 0);
+        free(out_data);
+    }
+
+    printf("Pasting into its own window leaves the caller's events alone.\n");
+    const long own_mask = KeyPressMask | ExposureMask | PropertyChangeMask;
+    XSelectInput(display, window, own_mask);
+    assert(libxclip_owner_put(owner, in_data, large, NULL) == 0);
+    assert(paste_by_hand(owner, window) == large);
+    XWindowAttributes attributes;
+    assert(XGetWindowAttributes(display, window, &attributes) != 0);
+    assert(attributes.your_event_mask == own_mask);
+
+    printf("Events that aren't ours are left to the caller.\n");
+    XEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = PropertyNotify;
+    event.xproperty.window = window;
+    event.xproperty.state = PropertyDelete;
+    assert(libxclip_handle_event(owner, &event) == 0);
+
+    printf("A SelectionClear from before the latest put doesn't count.\n");
+    Window other = XCreateSimpleWindow(display, DefaultRootWindow(display),
+                                       0, 0, 1, 1, 0, 0, 0);
+    XSetSelectionOwner(display, a_clipboard, other, CurrentTime);
+    assert(libxclip_owner_put(owner, in_data, 3, NULL) == 0);
+    XSync(display, False);
+    while (XPending(display)) {
+        XNextEvent(display, &event);
+        libxclip_handle_event(owner, &event);
+    }
+    libxclip_get_op *op = libxclip_get_start(display, NULL);
+    assert(op != NULL);
+    serve_in_process(owner, op);
+    char *out_data;
+    size_t out_size;
+    assert(libxclip_get_finish(op, &out_data, &out_size) == 0);
+    assert(out_size == 3);
+    free(out_data);
+    XDestroyWindow(display, other);
+
+    printf("Once destroyed someone else's put goes through as usual.\n");
+    libxclip_owner_destroy(owner);
+    XDestroyWindow(display, window);
+    assert(libxclip_put(display, "foo", 3, NULL) == 0);
+    assert(libxclip_get(display, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 3);
+    free(out_data);
+
+    free(in_data);
+    #endif
+    printf("Ok.\n");
+}
+
 void _100000_simple_targets() {
     printf("\n\n=== libxclip_targets can retrive the targets from xclip. ===\n");
     system("echo foo | xclip -i -selection CLIPBOARD -target FOO");
@@ -394,6 +1341,32 @@ void _205000_timeout() {
     printf("libxclip_get timed out!\n");
 }
 
+void _205100_timeout_does_not_spin() {
+    printf("\n\n=== libxclip_get doesn't burn CPU time while it waits. ===\n");
+
+    printf("Setting the selection owner to a unresponsive window.\n");
+    Window window = XCreateSimpleWindow(display,
+                                        DefaultRootWindow(display),
+                                        0, 0, 1, 1, 0, 0, 0);
+    XSetSelectionOwner(display, a_clipboard, window, CurrentTime);
+    XSync(display, False);
+
+    char *data;
+    size_t size;
+    default_getopts.timeout = 1000;
+
+    printf("Running libxclip_get with a timeout of 1000 millisec.\n");
+    clock_t cpu_start = clock();
+    int ret = libxclip_get(display, &data, &size, &default_getopts);
+    clock_t cpu_end = clock();
+    assert(ret != 0);
+
+    double cpu_millisecs = (cpu_end - cpu_start) * 1000.0 / CLOCKS_PER_SEC;
+    printf("libxclip_get used %.1f millisec of CPU time.\n", cpu_millisecs);
+    assert(cpu_millisecs < 50);
+    printf("Ok.\n");
+}
+
 void _206000_incr() {
     printf("\n\n=== libxclip_get can handle incremental transfers. ===\n");
 
@@ -417,6 +1390,503 @@ void _206000_incr() {
     printf("Ok.\n");
 }
 
+void _207000_no_fd_leak() {
+    printf("\n\n=== libxclip_get and libxclip_targets doesn't leak connections. ===\n");
+
+    libxclip_put(display, "foo", 3, NULL);
+
+    int fds_before = count_open_fds();
+    printf("Open file descriptors before: %d\n", fds_before);
+
+    for (int i = 0; i < 100; i ++) {
+        char *data;
+        size_t size;
+        assert(libxclip_get(display, &data, &size, NULL) == 0);
+        free(data);
+
+        Atom *targets;
+        unsigned long nitems;
+        assert(libxclip_targets(display, &targets, &nitems, NULL) == 0);
+        free(targets);
+    }
+
+    int fds_after = count_open_fds();
+    printf("Open file descriptors after 100 gets and targets: %d\n", fds_after);
+    assert(fds_before == fds_after);
+    printf("Ok.\n");
+}
+
+// A libxclip_sink that counts the chunks and bytes it gets, and checks that
+// every byte is a '#'. If `stop_after` is non-zero it asks libxclip to stop
+// after that many chunks.
+struct counting_sink {
+    size_t chunks;
+    size_t bytes;
+    size_t stop_after;
+};
+
+int counting_sink(const char *data, size_t len, void *userdata) {
+    struct counting_sink *counter = userdata;
+    for (size_t i = 0; i < len; i ++) {
+        assert(data[i] == '#');
+    }
+    counter->chunks ++;
+    counter->bytes += len;
+    return counter->stop_after != 0 && counter->chunks >= counter->stop_after;
+}
+
+void _208000_stream() {
+    printf("\n\n=== libxclip_get_stream hands over small data in one chunk. ===\n");
+
+    libxclip_put(display, "####", 4, NULL);
+
+    struct counting_sink counter = { 0, 0, 0 };
+    int ret = libxclip_get_stream(display, counting_sink, &counter, NULL);
+
+    printf("Got %zu bytes in %zu chunks.\n", counter.bytes, counter.chunks);
+    assert(ret == 0);
+    assert(counter.chunks == 1);
+    assert(counter.bytes == 4);
+    printf("Ok.\n");
+}
+
+void _208100_stream_incr() {
+    printf("\n\n=== libxclip_get_stream hands over large data chunk by chunk. ===\n");
+
+    size_t n = 1 << 25;
+    char *large_data = malloc(n);
+    memset(large_data, '#', n);
+    libxclip_put(display, large_data, n, NULL);
+
+    struct counting_sink counter = { 0, 0, 0 };
+    int ret = libxclip_get_stream(display, counting_sink, &counter, NULL);
+
+    printf("Got %zu bytes in %zu chunks.\n", counter.bytes, counter.chunks);
+    assert(ret == 0);
+    assert(counter.chunks > 1);
+    assert(counter.bytes == n);
+    printf("Ok.\n");
+}
+
+void _208200_stream_stop() {
+    printf("\n\n=== libxclip_get_stream stops when the sink asks it to. ===\n");
+
+    size_t n = 1 << 25;
+    char *large_data = malloc(n);
+    memset(large_data, '#', n);
+    libxclip_put(display, large_data, n, NULL);
+
+    struct counting_sink counter = { 0, 0, 2 };
+    int ret = libxclip_get_stream(display, counting_sink, &counter, NULL);
+
+    printf("Got %zu bytes in %zu chunks.\n", counter.bytes, counter.chunks);
+    assert(ret != 0);
+    assert(counter.chunks == 2);
+    assert(counter.bytes < n);
+    printf("Ok.\n");
+}
+
+void _209000_get_multiple() {
+    printf("\n\n=== libxclip_get_multiple gets several targets at once ===\n");
+
+    Atom a_html = XInternAtom(display, "text/html", False);
+    Atom a_png = XInternAtom(display, "image/png", False);
+    Atom a_jpeg = XInternAtom(display, "image/jpeg", False);
+    Atom a_utf8 = XInternAtom(display, "UTF8_STRING", False);
+
+    // Two targets large enough to be sent with INCR, at the same time.
+    const size_t large = 1 << 24;
+    char *png = malloc(large);
+    char *text = malloc(large);
+    memset(png, 'P', large);
+    memset(text, 'T', large);
+
+    struct libxclip_target targets[2] = {
+        { a_html, "<i>it</i>", 9 },
+        { a_png, png, large },
+    };
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.targets = targets;
+    putopts.ntargets = 2;
+    assert(libxclip_put(display, text, large, &putopts) == 0);
+
+    Atom wanted[4] = { a_utf8, a_html, a_png, a_jpeg };
+    char *data[4];
+    size_t sizes[4];
+    Atom types[4];
+    assert(libxclip_get_multiple(display, wanted, 4, data, sizes, types,
+                                 NULL) == 0);
+    assert(sizes[0] == large && memcmp(data[0], text, large) == 0);
+    assert(sizes[1] == 9 && memcmp(data[1], "<i>it</i>", 9) == 0);
+    assert(sizes[2] == large && memcmp(data[2], png, large) == 0);
+    assert(types[0] == a_utf8 && types[1] == a_html && types[2] == a_png);
+    printf("A target the owner doesn't have is NULL, of type None.\n");
+    assert(data[3] == NULL && sizes[3] == 0 && types[3] == None);
+    for (int i = 0; i < 4; i++) {
+        free(data[i]);
+    }
+
+    printf("An empty target isn't.\n");
+    struct libxclip_target empty[1] = { { a_html, "", 0 } };
+    putopts.targets = empty;
+    putopts.ntargets = 1;
+    assert(libxclip_put(display, "text", 4, &putopts) == 0);
+    assert(libxclip_get_multiple(display, wanted, 2, data, sizes, types,
+                                 NULL) == 0);
+    assert(sizes[0] == 4 && types[0] == a_utf8);
+    assert(sizes[1] == 0 && types[1] == a_html);
+    free(data[0]);
+    free(data[1]);
+
+    printf("Without an owner it fails.\n");
+    XSetSelectionOwner(display, a_clipboard, None, CurrentTime);
+    XSync(display, False);
+    assert(libxclip_get_multiple(display, wanted, 4, data, sizes, types,
+                                 NULL) != 0);
+
+    free(png);
+    free(text);
+    printf("Ok.\n");
+}
+
+void _210000_preferred_targets() {
+    printf("\n\n=== libxclip_get picks the first preferred target there is ===\n");
+
+    Atom a_html = XInternAtom(display, "text/html", False);
+    Atom a_png = XInternAtom(display, "image/png", False);
+    Atom a_jpeg = XInternAtom(display, "image/jpeg", False);
+    Atom a_utf8 = XInternAtom(display, "UTF8_STRING", False);
+
+    // Large enough to be sent with INCR.
+    const size_t png_len = 1 << 24;
+    char *png = malloc(png_len);
+    memset(png, 'P', png_len);
+
+    struct libxclip_target targets[2] = {
+        { a_html, "<i>it</i>", 9 },
+        { a_png, png, png_len },
+    };
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.targets = targets;
+    putopts.ntargets = 2;
+    assert(libxclip_put(display, "it", 2, &putopts) == 0);
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    struct libxclip_getopts getopts;
+    libxclip_getopts_initialize(&getopts);
+    char *out_data;
+    size_t out_size;
+
+    printf("The first one is there.\n");
+    Atom first[3] = { a_png, a_html, a_utf8 };
+    getopts.preferred = first;
+    getopts.npreferred = 3;
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, &getopts) == 0);
+    assert(getopts.chosen == a_png);
+    assert(out_size == png_len && memcmp(out_data, png, png_len) == 0);
+    free(out_data);
+
+    printf("The first one isn't there.\n");
+    Atom later[3] = { a_jpeg, a_html, a_utf8 };
+    getopts.preferred = later;
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, &getopts) == 0);
+    assert(getopts.chosen == a_html);
+    assert(out_size == 9 && memcmp(out_data, "<i>it</i>", 9) == 0);
+    free(out_data);
+
+    printf("None of them are there.\n");
+    Atom none[1] = { a_jpeg };
+    getopts.preferred = none;
+    getopts.npreferred = 1;
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, &getopts) != 0);
+
+    printf("The context still works afterwards.\n");
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 2 && memcmp(out_data, "it", 2) == 0);
+    free(out_data);
+
+    libxclip_ctx_destroy(ctx);
+    free(png);
+    printf("Ok.\n");
+}
+
+void _211000_incr_roundtrips() {
+    printf("\n\n=== libxclip_ctx_get makes one round trip per INCR chunk ===\n");
+    #ifndef LIBXCLIP_COUNT_ROUNDTRIPS
+    printf("Skipped, needs -DLIBXCLIP_COUNT_ROUNDTRIPS.\n");
+    #else
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    assert(ctx != NULL);
+    char *out_data;
+    size_t out_size;
+
+    printf("One round trip for something small.\n");
+    libxclip_put(display, "foo", 3, NULL);
+    unsigned long before = libxclip_roundtrips();
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == 0);
+    assert(out_size == 3);
+    free(out_data);
+    printf("%lu round trips.\n", libxclip_roundtrips() - before);
+    assert(libxclip_roundtrips() - before == 1);
+
+    // 32 chunks of 1 MiB, plus the INCR property and the final empty chunk.
+    printf("One round trip per chunk for something large.\n");
+    const size_t size = 1 << 25;
+    char *in_data = malloc(size);
+    memset(in_data, '#', size);
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.chunk_size = 1 << 20;
+    libxclip_put(display, in_data, size, &putopts);
+    before = libxclip_roundtrips();
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == 0);
+    assert(out_size == size);
+    free(out_data);
+    printf("%lu round trips.\n", libxclip_roundtrips() - before);
+    assert(libxclip_roundtrips() - before <= 1 + 32 + 1);
+
+    free(in_data);
+    libxclip_ctx_destroy(ctx);
+    printf("Ok.\n");
+    #endif
+}
+
+void _212000_async_get() {
+    printf("\n\n=== Several libxclip_get_start's at once on one thread ===\n");
+
+    const size_t large = (1 << 25) + 5;
+    char *in_data = malloc(large);
+    for (size_t i = 0; i < large; i++) {
+        in_data[i] = 'a' + i % 26;
+    }
+    assert(libxclip_put(display, in_data, large, NULL) == 0);
+
+    // One get of something the owner doesn't have, the rest of the contents.
+    enum { N = 5 };
+    libxclip_get_op *ops[N];
+    struct pollfd fds[N];
+    Bool done[N];
+    for (int i = 0; i < N; i++) {
+        struct libxclip_getopts getopts;
+        libxclip_getopts_initialize(&getopts);
+        getopts.timeout = 10000;
+        if (i == 0) {
+            getopts.target = XInternAtom(display, "LIBXCLIP_NO_SUCH_TARGET",
+                                         False);
+        }
+        ops[i] = libxclip_get_start(display, &getopts);
+        assert(ops[i] != NULL);
+        fds[i].fd = libxclip_get_fd(ops[i]);
+        fds[i].events = POLLIN;
+        done[i] = False;
+    }
+
+    int left = N;
+    while (left > 0) {
+        assert(poll(fds, N, 10000) > 0);
+        for (int i = 0; i < N; i++) {
+            if (!done[i] && libxclip_get_process(ops[i])) {
+                done[i] = True;
+                fds[i].fd = -1;
+                left--;
+            }
+        }
+    }
+
+    for (int i = 0; i < N; i++) {
+        char *out_data;
+        size_t out_size;
+        int ret = libxclip_get_finish(ops[i], &out_data, &out_size);
+        if (i == 0) {
+            assert(ret == -1);
+            continue;
+        }
+        assert(ret == 0);
+        assert(out_size == large);
+        assert(memcmp(in_data, out_data, large) == 0);
+        free(out_data);
+    }
+
+    printf("A context has one get under way at a time.\n");
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    assert(ctx != NULL);
+    libxclip_get_op *op = libxclip_ctx_get_start(ctx, NULL);
+    assert(op != NULL);
+    errno = 0;
+    assert(libxclip_ctx_get_start(ctx, NULL) == NULL);
+    assert(errno == EBUSY);
+    char *out_data;
+    size_t out_size;
+    errno = 0;
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == -1);
+    assert(errno == EBUSY);
+    struct pollfd fd = { libxclip_get_fd(op), POLLIN, 0 };
+    while (!libxclip_get_process(op)) {
+        assert(poll(&fd, 1, 10000) > 0);
+    }
+    assert(libxclip_get_finish(op, &out_data, &out_size) == 0);
+    assert(out_size == large);
+    free(out_data);
+    assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == 0);
+    assert(out_size == large);
+    free(out_data);
+    libxclip_ctx_destroy(ctx);
+
+    free(in_data);
+    printf("Ok.\n");
+}
+
+void _300000_ctx_reuse() {
+    printf("\n\n=== A libxclip_ctx can be used for many gets and targets. ===\n");
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    assert(ctx != NULL);
+
+    char *in_data[3] = { "foo", "", "barbaz" };
+    for (int i = 0; i < 3; i ++) {
+        size_t in_size = strlen(in_data[i]);
+        libxclip_put(display, in_data[i], in_size, NULL);
+
+        Atom *targets;
+        unsigned long nitems;
+        assert(libxclip_ctx_targets(ctx, &targets, &nitems, NULL) == 0);
+        assert(nitems == 3);
+        assert(targets[0] == XInternAtom(display, "TARGETS", False));
+        assert(targets[1] == XInternAtom(display, "MULTIPLE", False));
+        assert(targets[2] == XInternAtom(display, "UTF8_STRING", False));
+        free(targets);
+
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == 0);
+        assert(out_size == in_size);
+        assert(memcmp(in_data[i], out_data, in_size) == 0);
+        free(out_data);
+    }
+
+    libxclip_ctx_destroy(ctx);
+    printf("Ok.\n");
+}
+
+void _301000_ctx_after_timeout() {
+    printf("\n\n=== A libxclip_ctx can be used again after a get timed out. ===\n");
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    assert(ctx != NULL);
+
+    printf("Setting the selection owner to a unresponsive window.\n");
+    Window window = XCreateSimpleWindow(display,
+                                        DefaultRootWindow(display),
+                                        0, 0, 1, 1, 0, 0, 0);
+    XSetSelectionOwner(display, a_clipboard, window, CurrentTime);
+    XSync(display, False);
+
+    char *data;
+    size_t size;
+    default_getopts.timeout = 100;
+    assert(libxclip_ctx_get(ctx, &data, &size, &default_getopts) != 0);
+    printf("libxclip_ctx_get timed out.\n");
+
+    libxclip_put(display, "foo", 3, NULL);
+    assert(libxclip_ctx_get(ctx, &data, &size, &default_getopts) == 0);
+    assert(size == 3);
+    assert(memcmp(data, "foo", 3) == 0);
+    free(data);
+
+    libxclip_ctx_destroy(ctx);
+    printf("Ok.\n");
+}
+
+static int stop_sink(const char *data, size_t len, void *userdata) {
+    (void) data;
+    (void) len;
+    (void) userdata;
+    return 1;
+}
+
+void _302000_ctx_after_stopped_sink() {
+    printf("\n\n=== A libxclip_ctx can be used again after an abandoned INCR "
+           "transfer. ===\n");
+
+    libxclip_ctx *ctx = libxclip_ctx_create(display);
+    assert(ctx != NULL);
+
+    const size_t large = (1 << 24) + 5;
+    char *in_data = malloc(large);
+    memset(in_data, 'a', large);
+    libxclip_putopts putopts;
+    libxclip_putopts_initialize(&putopts);
+    putopts.chunk_size = 1 << 16;
+    assert(libxclip_put(display, in_data, large, &putopts) == 0);
+
+    printf("Stopping after the first chunk.\n");
+    assert(libxclip_ctx_get_stream(ctx, stop_sink, NULL, NULL) == -1);
+
+    // The first owner is still around, waiting for us to take the next chunk.
+    for (int i = 0; i < 3; i++) {
+        char *out_data;
+        size_t out_size;
+        assert(libxclip_put(display, "foo", 3, NULL) == 0);
+        assert(libxclip_ctx_get(ctx, &out_data, &out_size, NULL) == 0);
+        assert(out_size == 3);
+        assert(memcmp(out_data, "foo", 3) == 0);
+        free(out_data);
+    }
+
+    free(in_data);
+    libxclip_ctx_destroy(ctx);
+    printf("Ok.\n");
+}
+
+#ifdef LIBXCLIP_XFIXES
+// Waits for the next change `watch` sees.
+static void next_owner_change(libxclip_watch *watch,
+                              struct libxclip_owner_change *change) {
+    struct pollfd fds[1];
+    fds[0].fd = libxclip_watch_fd(watch);
+    fds[0].events = POLLIN;
+    while (!libxclip_watch_next(watch, change)) {
+        assert(poll(fds, 1, 10000) > 0);
+    }
+}
+
+void _400000_watch() {
+    printf("\n\n=== A libxclip_watch sees the selections change hands ===\n");
+
+    libxclip_watch *watch = libxclip_watch_start(display);
+    assert(watch != NULL);
+    struct libxclip_owner_change change;
+    assert(libxclip_watch_next(watch, &change) == 0);
+
+    printf("A put takes CLIPBOARD.\n");
+    assert(libxclip_put(display, "foo", 3, NULL) == 0);
+    next_owner_change(watch, &change);
+    assert(change.selection == a_clipboard);
+    assert(change.owner != None);
+
+    printf("Our window takes PRIMARY, and then goes away.\n");
+    Window window = XCreateSimpleWindow(display,
+                                        DefaultRootWindow(display),
+                                        0, 0, 1, 1, 0, 0, 0);
+    XSetSelectionOwner(display, XA_PRIMARY, window, CurrentTime);
+    XSync(display, False);
+    next_owner_change(watch, &change);
+    assert(change.selection == XA_PRIMARY);
+    assert(change.owner == window);
+
+    XDestroyWindow(display, window);
+    XSync(display, False);
+    next_owner_change(watch, &change);
+    assert(change.selection == XA_PRIMARY);
+    assert(change.owner == None);
+
+    libxclip_watch_destroy(watch);
+    printf("Ok.\n");
+}
+#endif
+
 int main(void) {
     display = XOpenDisplay(NULL);
     libxclip_getopts_initialize(&default_getopts);
@@ -460,9 +1930,55 @@ int main(void) {
     if(strcmp(buffer, "01100\n") == 0) {
         _011000_multiple_large_transfers();
     }
+    if(strcmp(buffer, "01110\n") == 0) {
+        _011100_many_concurrent_readers();
+    }
     if(strcmp(buffer, "01200\n") == 0) {
         _012000_read_and_steal();
     }
+    if(strcmp(buffer, "01300\n") == 0) {
+        _013000_two_transfers_one_requestor();
+    }
+    if(strcmp(buffer, "01400\n") == 0) {
+        _014000_put_stream();
+    }
+    if(strcmp(buffer, "01410\n") == 0) {
+        _014100_put_fd_small();
+    }
+    if(strcmp(buffer, "01500\n") == 0) {
+        _015000_put_file();
+    }
+    if(strcmp(buffer, "01600\n") == 0) {
+        _016000_put_thread();
+    }
+    if(strcmp(buffer, "01700\n") == 0) {
+        _017000_put_daemon();
+    }
+    if(strcmp(buffer, "01800\n") == 0) {
+        _018000_put_targets();
+    }
+    if(strcmp(buffer, "01900\n") == 0) {
+        _019000_put_convert();
+    }
+    if(strcmp(buffer, "01950\n") == 0) {
+        _019500_put_chunk_policies();
+    }
+    if(strcmp(buffer, "01960\n") == 0) {
+        _019600_put_stats();
+    }
+    #ifdef LIBXCLIP_ZLIB
+    if(strcmp(buffer, "01970\n") == 0) {
+        _019700_compressed_transfer();
+    }
+    #endif
+    #ifdef LIBXCLIP_SHM
+    if(strcmp(buffer, "01980\n") == 0) {
+        _019800_shared_memory_transfer();
+    }
+    #endif
+    if(strcmp(buffer, "01990\n") == 0) {
+        _019900_in_process_owner();
+    }
 
     if(strcmp(buffer, "10000\n") == 0) {
         _100000_simple_targets();
@@ -495,9 +2011,52 @@ int main(void) {
     if(strcmp(buffer, "20500\n") == 0) {
         _205000_timeout();
     }
+    if(strcmp(buffer, "20510\n") == 0) {
+        _205100_timeout_does_not_spin();
+    }
     if(strcmp(buffer, "20600\n") == 0) {
         _206000_incr();
     }
+    if(strcmp(buffer, "20700\n") == 0) {
+        _207000_no_fd_leak();
+    }
+    if(strcmp(buffer, "20800\n") == 0) {
+        _208000_stream();
+    }
+    if(strcmp(buffer, "20810\n") == 0) {
+        _208100_stream_incr();
+    }
+    if(strcmp(buffer, "20820\n") == 0) {
+        _208200_stream_stop();
+    }
+    if(strcmp(buffer, "20900\n") == 0) {
+        _209000_get_multiple();
+    }
+    if(strcmp(buffer, "21000\n") == 0) {
+        _210000_preferred_targets();
+    }
+    if(strcmp(buffer, "21100\n") == 0) {
+        _211000_incr_roundtrips();
+    }
+    if(strcmp(buffer, "21200\n") == 0) {
+        _212000_async_get();
+    }
+
+    if(strcmp(buffer, "30000\n") == 0) {
+        _300000_ctx_reuse();
+    }
+    if(strcmp(buffer, "30100\n") == 0) {
+        _301000_ctx_after_timeout();
+    }
+    if(strcmp(buffer, "30200\n") == 0) {
+        _302000_ctx_after_stopped_sink();
+    }
+
+    #ifdef LIBXCLIP_XFIXES
+    if(strcmp(buffer, "40000\n") == 0) {
+        _400000_watch();
+    }
+    #endif
 
     return 0;
 }
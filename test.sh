@@ -17,7 +17,8 @@
 
 # TODO: Maybe we should also do a test-run with -O3 in case optimizing reveals
 #       bugs to us.
-gcc -Og -Wall -Wno-unused-result -lX11 libxclip.c test.c -o test
+gcc -Og -Wall -Wno-unused-result -DLIBXCLIP_COUNT_ROUNDTRIPS -lX11 -pthread \
+    libxclip.c test.c -o test
 
 echo "00200" | ./test
 echo "00300" | ./test
@@ -29,7 +30,19 @@ echo "00800" | ./test
 echo "00900" | ./test
 echo "01000" | ./test
 echo "01100" | ./test
+echo "01110" | ./test
 echo "01200" | ./test
+echo "01300" | ./test
+echo "01400" | ./test
+echo "01410" | ./test
+echo "01500" | ./test
+echo "01600" | ./test
+echo "01700" | ./test
+echo "01800" | ./test
+echo "01900" | ./test
+echo "01950" | ./test
+echo "01960" | ./test
+echo "01990" | ./test
 
 echo "10000" | ./test
 echo "10100" | ./test
@@ -42,4 +55,44 @@ echo "20200" | ./test
 echo "20300" | ./test
 echo "20400" | ./test
 echo "20500" | ./test
+echo "20510" | ./test
 echo "20600" | ./test
+echo "20700" | ./test
+echo "20800" | ./test
+echo "20810" | ./test
+echo "20820" | ./test
+echo "20900" | ./test
+echo "21000" | ./test
+echo "21100" | ./test
+echo "21200" | ./test
+
+echo "30000" | ./test
+echo "30100" | ./test
+echo "30200" | ./test
+
+# The put, get, INCR, TARGETS and MULTIPLE paths once more, through XCB.
+gcc -Og -Wall -Wno-unused-result -DLIBXCLIP_XCB -DLIBXCLIP_COUNT_ROUNDTRIPS \
+    -lX11 -lxcb -pthread libxclip.c test.c -o test_xcb
+for code in 00200 00400 01000 01100 01200 01700 01800 01900 01990 \
+            10000 20000 20100 20600 20900 21000 21100 21200; do
+    echo "$code" | ./test_xcb
+done
+
+# Large gets once more, compressed between libxclips.
+gcc -Og -Wall -Wno-unused-result -DLIBXCLIP_ZLIB -lX11 -lz -pthread \
+    libxclip.c test.c -o test_zlib
+for code in 01000 01100 01700 01950 01970 20000 20900; do
+    echo "$code" | ./test_zlib
+done
+
+# And mapped from shared memory.
+gcc -Og -Wall -Wno-unused-result -DLIBXCLIP_SHM -lX11 -pthread \
+    libxclip.c test.c -o test_shm
+for code in 01000 01100 01700 01950 01980 20000 20900; do
+    echo "$code" | ./test_shm
+done
+
+# Watching the selections change hands.
+gcc -Og -Wall -Wno-unused-result -DLIBXCLIP_XFIXES -lX11 -lXfixes -pthread \
+    libxclip.c test.c -o test_xfixes
+echo "40000" | ./test_xfixes